@@ -0,0 +1,146 @@
+import numpy as np
+
+SLOPE_THRESHOLD = 0
+VALVE_OPENING_TIME = 600
+VALUE_LEN = 30
+SRV_PERIOD = 60 # Seconds between two SRV of a sensor
+# Forecast mode : the slopes of a sensor are smoothed by Holt's linear method,
+# and the valve follows the slope expected FORECAST_HORIZON evaluations ahead.
+# It opens above SLOPE_THRESHOLD + FORECAST_HYSTERESIS, and is kept open above
+# SLOPE_THRESHOLD - FORECAST_HYSTERESIS : a borderline sensor does not flap.
+FORECAST_ALPHA = 0.5 # Weight of a new slope in the level
+FORECAST_BETA = 0.25 # Weight of a new level change in the trend
+FORECAST_HORIZON = 3
+FORECAST_HYSTERESIS = 5.0 # Seconds per unit of air quality, like the slopes
+
+class SensorTable:
+    # Readings of all the sensors, in columnar arrays (one row per sensor)
+    # The last VALUE_LEN readings of a row are kept in a ring : their order does
+    # not matter for the regression
+
+    def __init__(self, capacity=64):
+        self.ids = [] # row -> sensor id
+        self.rows = {} # sensor id -> row
+        self.air = np.zeros((capacity, VALUE_LEN))
+        self.time = np.zeros((capacity, VALUE_LEN))
+        self.count = np.zeros(capacity, dtype=np.int64) # Number of readings received
+        self.timer = np.full(capacity, -1.0) # Opening time of the valve, -1 if closed
+        self.changed = np.zeros(capacity, dtype=bool) # New readings since the last tick
+        self.level = np.zeros(capacity) # Level and trend of the slope (forecast mode)
+        self.trend = np.zeros(capacity)
+        self.forecast_ready = np.zeros(capacity, dtype=bool) # The forecast started
+
+    def __len__(self):
+        return len(self.ids)
+
+    def row(self, sensor_id):
+        if sensor_id not in self.rows: #New node
+            if len(self.ids) == len(self.count):
+                self._grow()
+            self.rows[sensor_id] = len(self.ids)
+            self.ids.append(sensor_id)
+        return self.rows[sensor_id]
+
+    def append(self, sensor_id, new_value, receive_time):
+        row = self.row(sensor_id)
+        position = self.count[row] % VALUE_LEN
+        self.air[row, position] = new_value
+        self.time[row, position] = receive_time
+        self.count[row] += 1
+        self.changed[row] = True
+
+    def window(self, sensor_id, n):
+        # Last n readings of a sensor, oldest first
+        if sensor_id not in self.rows:
+            return []
+        row = self.rows[sensor_id]
+        count = int(self.count[row])
+        return [int(self.air[row, i % VALUE_LEN]) for i in range(max(0, count - n), count)]
+
+    def valve(self, sensor_id, now):
+        # State of the valve of a sensor : (open, SRV periods since its opening)
+        if sensor_id not in self.rows or self.timer[self.rows[sensor_id]] == -1:
+            return False, 0
+        return True, int((now - self.timer[self.rows[sensor_id]]) // SRV_PERIOD)
+
+    def hand_back(self, sensor_id, is_open, periods, values, now):
+        # State of a sensor given back by a computation node : its last readings
+        # (one per SRV_PERIOD, oldest first) and its valve
+        for i, value in enumerate(values):
+            self.append(sensor_id, value, now - (len(values) - 1 - i) * SRV_PERIOD)
+        row = self.row(sensor_id)
+        self.timer[row] = now - periods * SRV_PERIOD if is_open else -1
+        self.forecast_ready[row] = False
+
+    def open_valves(self):
+        return int(np.count_nonzero(self.timer[:len(self.ids)] != -1))
+
+    def _grow(self):
+        self.air = np.vstack((self.air, np.zeros_like(self.air)))
+        self.time = np.vstack((self.time, np.zeros_like(self.time)))
+        self.count = np.concatenate((self.count, np.zeros_like(self.count)))
+        self.timer = np.concatenate((self.timer, np.full_like(self.timer, -1.0)))
+        self.changed = np.concatenate((self.changed, np.zeros_like(self.changed)))
+        self.level = np.concatenate((self.level, np.zeros_like(self.level)))
+        self.trend = np.concatenate((self.trend, np.zeros_like(self.trend)))
+        self.forecast_ready = np.concatenate((self.forecast_ready, np.zeros_like(self.forecast_ready)))
+
+def get_slopes(air, time):
+    # Slope of the linear regression of the time against the air quality
+    # (same as scipy.stats.linregress(air, time)), for every row at once
+    dx = air - air.mean(axis=1, keepdims=True)
+    dy = time - time.mean(axis=1, keepdims=True)
+    sxx = (dx * dx).sum(axis=1)
+    sxy = (dx * dy).sum(axis=1)
+    slopes = np.full(len(sxx), np.nan)
+    np.divide(sxy, sxx, out=slopes, where=sxx > 0)
+    return slopes
+
+def forecast_slopes(table, rows, slopes):
+    # Holt's linear method on the slopes of the sensors of rows : returns the
+    # slopes expected FORECAST_HORIZON evaluations ahead (nan if not enough data)
+    known = ~np.isnan(slopes)
+    rows, new = rows[known], slopes[known]
+    ready = table.forecast_ready[rows]
+    level, trend = table.level[rows], table.trend[rows]
+    new_level = np.where(ready, level + trend + FORECAST_ALPHA * (new - level - trend), new)
+    new_trend = np.where(ready, trend + FORECAST_BETA * (new_level - level - trend), 0.0)
+    table.level[rows], table.trend[rows] = new_level, new_trend
+    table.forecast_ready[rows] = True
+    forecasts = np.full(len(slopes), np.nan)
+    forecasts[known] = new_level + FORECAST_HORIZON * new_trend
+    return forecasts
+
+def decide(table, now, forecast=False):
+    # Evaluate all the sensors that received readings since the last tick
+    # Returns the orders to send, as a list of (sensor id, "open" / "close"),
+    # and the slopes of the evaluated sensors (sensor id -> slope, nan if not enough data)
+    # With forecast, the valves follow the forecast of the slopes instead (see forecast_slopes)
+    rows = np.flatnonzero(table.changed[:len(table)])
+    table.changed[rows] = False
+    if rows.size == 0:
+        return [], {}
+
+    # Wait VALUE_LEN data messages before computing the slope
+    slopes = np.full(rows.size, np.nan)
+    enough = table.count[rows] >= VALUE_LEN
+    slopes[enough] = get_slopes(table.air[rows[enough]], table.time[rows[enough]])
+
+    hysteresis = 0.0
+    if forecast:
+        slopes = forecast_slopes(table, rows, slopes)
+        hysteresis = FORECAST_HYSTERESIS
+
+    # Valve state machine, the comparisons with nan (not enough data) are false
+    timer = table.timer[rows]
+    is_open = timer != -1
+    expired = is_open & (now - timer >= VALVE_OPENING_TIME) #Need to re-evaluate the valve
+    close = expired & (slopes < SLOPE_THRESHOLD - hysteresis) #We can close the valve
+    keep = expired & ~close #we keep it open for another 10 mins
+    open_ = ~is_open & (slopes > SLOPE_THRESHOLD + hysteresis) #Need to open the valve
+    table.timer[rows[close]] = -1
+    table.timer[rows[keep | open_]] = now
+
+    orders = [(table.ids[row], "open") for row in rows[open_]]
+    orders += [(table.ids[row], "close") for row in rows[close]]
+    return orders, {table.ids[row]: slope for row, slope in zip(rows, slopes)}
@@ -0,0 +1,290 @@
+#include "../sky_computation.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Microbenchmarks of the computation node with full tables : MAX_ROUTES
+ * routes, MAX_CHILDREN of them children (see "make bench" for the sizes).
+ * Prints "name cycles" per call, the best of BENCH_RUNS runs. With a baseline
+ * file (same format), returns 1 if a result is BENCH_TOLERANCE % over it.
+ */
+
+#define NODE_ID 1
+#define PARENT_ID 2
+#define FIRST_ID 3
+
+// The ids of the routes are Rime ids
+typedef char first_id_check[(FIRST_ID + MAX_ROUTES - 1 <= 255) ? 1 : -1];
+
+#define BENCH_CALLS 2000
+#define BENCH_RUNS 5
+#define BENCH_TOLERANCE 25
+
+struct result {
+  char name[32];
+  unsigned long cycles;
+};
+
+static struct result results[16];
+static int nresults = 0;
+
+// Cycles on x86, else nanoseconds
+static unsigned long long
+now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static void
+add_result(const char *name, unsigned long long total)
+{
+  char full[32];
+  int i;
+
+  snprintf(full, sizeof(full), "%s_%d", name, MAX_ROUTES);
+  for(i = 0 ; i < nresults && strcmp(results[i].name, full) != 0 ; i++);
+  if(i == nresults)
+  {
+    strcpy(results[nresults].name, full);
+    results[nresults++].cycles = (unsigned long)-1;
+  }
+  if(total / BENCH_CALLS < results[i].cycles)
+  {
+    results[i].cycles = total / BENCH_CALLS;
+  }
+}
+
+// Full tables, the children first in the list (worst case for the candidates)
+static void
+fill_tables(void)
+{
+  struct routes *route;
+  struct children *child;
+  int i;
+
+  list_init(routes_list);
+  list_init(children_list);
+  memb_init(&routes_memb);
+  memb_init(&children_memb);
+  number_of_children = 0;
+  handback_pending = 0;
+  dedup_count = 0;
+  for(i = 0 ; i < MAX_ROUTES ; i++)
+  {
+    route = memb_alloc(&routes_memb);
+    memset(&route->id, 0, ROUTE_RECORD_SIZE);
+    route->id = FIRST_ID + i;
+    route->is_child = i < MAX_CHILDREN ? 0 : 1;
+    route->traffic = i % 7;
+    route->hops = 1;
+    list_add(routes_list, route);
+    if(i < MAX_CHILDREN)
+    {
+      child = memb_alloc(&children_memb);
+      memset(&child->id, 0, CHILD_RECORD_SIZE);
+      child->id = FIRST_ID + i;
+      child->last_order = SEQNO_MAX;
+      list_add(children_list, child);
+      number_of_children++;
+    }
+  }
+}
+
+static void
+reset_ages(void)
+{
+  struct routes *route;
+
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+  {
+    route->age = 0;
+  }
+}
+
+static void
+receive_srv(int id, int seqno)
+{
+  char message[PACKETBUF_SIZE];
+
+  snprintf(message, sizeof(message), "SRV%02d%03d%02d%d%03d%02d", 30 + seqno % 20, id, seqno % SEQNO_MAX, 0, ORIGIN_SERVER, 99);
+  shim_deliver_runicast(&runicast, id, message);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// SRV of the last candidate of the list : forwarded to the parent
+static void
+bench_srv_forward(void)
+{
+  unsigned long long start, total = 0;
+  int i;
+
+  for(i = 0 ; i < BENCH_CALLS ; i++)
+  {
+    // The other routes age with each SRV, the tables stay full
+    if(i % (INACTIVE_MESSAGE - 1) == 0)
+    {
+      reset_ages();
+    }
+    shim_clear_sent();
+    start = now();
+    receive_srv(FIRST_ID + MAX_ROUTES - 1, i);
+    total += now() - start;
+  }
+  add_result("srv_forward", total);
+}
+
+// SRV of a child : stored, and the decision taken once the values are known
+static void
+bench_srv_child(void)
+{
+  unsigned long long start, total = 0;
+  int i;
+
+  for(i = 0 ; i < BENCH_CALLS ; i++)
+  {
+    if(i % (INACTIVE_MESSAGE - 1) == 0)
+    {
+      reset_ages();
+    }
+    shim_clear_sent();
+    start = now();
+    receive_srv(FIRST_ID + i % MAX_CHILDREN, i / MAX_CHILDREN);
+    total += now() - start;
+  }
+  add_result("srv_child", total);
+}
+
+static void
+bench_remove_old_routes(void)
+{
+  unsigned long long start, total = 0;
+  int i;
+
+  for(i = 0 ; i < BENCH_CALLS ; i++)
+  {
+    if(i % (INACTIVE_MESSAGE - 1) == 0)
+    {
+      reset_ages();
+    }
+    start = now();
+    remove_old_routes();
+    total += now() - start;
+  }
+  add_result("remove_old_routes", total);
+}
+
+static void
+bench_rebalance_children(void)
+{
+  unsigned long long start, total = 0;
+  int i;
+
+  for(i = 0 ; i < BENCH_CALLS ; i++)
+  {
+    start = now();
+    rebalance_children();
+    total += now() - start;
+  }
+  add_result("rebalance_children", total);
+}
+
+static void
+bench_get_slope(void)
+{
+  uint8_t values[NUMBER_OF_SAVED_VALUES];
+  unsigned long long start, total = 0;
+  volatile float slope;
+  int i, j;
+
+  for(i = 0 ; i < BENCH_CALLS ; i++)
+  {
+    for(j = 0 ; j < NUMBER_OF_SAVED_VALUES ; j++)
+    {
+      values[j] = 20 + (i + j * 3) % 50;
+    }
+    start = now();
+    slope = get_slope(values);
+    total += now() - start;
+  }
+  (void)slope;
+  add_result("get_slope", total);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// Compare with the baseline, returns the number of regressions
+static int
+check_baseline(const char *file)
+{
+  FILE *f = fopen(file, "r");
+  char line[128], name[32];
+  unsigned long cycles;
+  int i, regressions = 0;
+
+  if(f == NULL)
+  {
+    perror(file);
+    return 1;
+  }
+  // Other lines (the make output) are skipped
+  while(fgets(line, sizeof(line), f) != NULL)
+  {
+    if(sscanf(line, "%31s %lu", name, &cycles) != 2)
+    {
+      continue;
+    }
+    for(i = 0 ; i < nresults ; i++)
+    {
+      if(strcmp(results[i].name, name) == 0
+        && results[i].cycles * 100 > cycles * (100 + BENCH_TOLERANCE))
+      {
+        fprintf(stderr, "%s : %lu, baseline %lu\n", name, results[i].cycles, cycles);
+        regressions++;
+      }
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+
+int
+main(int argc, char **argv)
+{
+  int run, i;
+
+  linkaddr_node_addr.u8[0] = NODE_ID;
+  msg_id_to_addr(&parent_node, PARENT_ID);
+  not_connected = 0;
+  runicast_open(&runicast, 144, &runicast_callbacks);
+  shim_cfs_format();
+
+  for(run = 0 ; run < BENCH_RUNS ; run++)
+  {
+    fill_tables();
+    bench_srv_forward();
+    bench_srv_child();
+    bench_remove_old_routes();
+    fill_tables();
+    bench_rebalance_children();
+    bench_get_slope();
+  }
+
+  for(i = 0 ; i < nresults ; i++)
+  {
+    printf("%s %lu\n", results[i].name, results[i].cycles);
+  }
+  return argc > 1 && check_baseline(argv[1]) != 0;
+}
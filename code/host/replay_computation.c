@@ -0,0 +1,122 @@
+// Decision parameters of the replay, set from the command line. The Makefile
+// gives them to the firmware as OPEN_TIME and SLOPE_THRESHOLD (same defaults).
+static int replay_open_time = 10;
+static float replay_slope_threshold = 1.0;
+
+#include "../sky_computation.c"
+
+#include <unistd.h>
+
+/*
+ * Replay of a capture through the decisions of the computation node, as fast
+ * as the host runs them (see replay.py, that sweeps the parameters).
+ *
+ * Reads lines "time [network] SRV..." (a capture of the server, or the -o file
+ * of the simulator) on stdin, and gives each SRV to the node as if its sensor
+ * was a direct child (the routes do not expire). The orders are supposed
+ * executed at once : the valve and the last order of the replayed SRV are the
+ * ones decided here.
+ * Prints one line "time sensor open|close" per order.
+ *
+ * Usage : replay_computation [-o open time (readings)] [-s slope threshold] < capture
+ * The lines of one network only : the node ids are the ones of a network.
+ */
+
+#define REPLAY_NODE_ID 255
+#define REPLAY_PARENT_ID 254
+#define REPLAY_LINE_MAX 256
+
+static struct children *
+replay_child(int id)
+{
+  struct children *child;
+
+  for(child = list_head(children_list); child != NULL && child->id != id; child = list_item_next(child));
+  return child;
+}
+
+// Give a SRV to the node, then print the orders it sent
+static void
+replay_srv(double t, const char *message)
+{
+  char srv[PACKETBUF_SIZE];
+  struct children *child;
+  struct routes *route;
+  struct msg_com com;
+  int air, id, seqno, sent, ordered, i;
+
+  if(sscanf(message, "SRV%2d%3d%2d", &air, &id, &seqno) != 3 || id <= 0 || id >= REPLAY_PARENT_ID)
+  {
+    return;
+  }
+  // Like the sensor, ORIGIN_SERVER and SEQNO_MAX - 1 before its first order
+  child = replay_child(id);
+  ordered = child != NULL && child->last_order != SEQNO_MAX;
+  snprintf(srv, sizeof(srv), "SRV%02d%03d%02d%d%03d%02d", air, id, seqno, child != NULL && child->is_open,
+    ordered ? linkaddr_node_addr.u8[0] : ORIGIN_SERVER, ordered ? child->last_order : SEQNO_MAX - 1);
+
+  // The routes age with the SRV of the others : a real node has a few
+  // children, here every sensor of the network is one and must not expire
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+  {
+    route->age = 0;
+  }
+
+  shim_clock = (clock_time_t)(unsigned long)(t * CLOCK_SECOND);
+  sent = shim_sent_count;
+  shim_deliver_runicast(&runicast, id, srv);
+  for(i = sent ; i < shim_sent_count ; i++)
+  {
+    packetbuf_copyfrom(shim_sent[i % SHIM_SENT_MAX].data, shim_sent[i % SHIM_SENT_MAX].len);
+    if(msg_type() == MSG_COM && msg_parse_com(&com) == 0)
+    {
+      printf("%.6f %03d %s\n", t, com.id, com.order ? "open" : "close");
+    }
+  }
+}
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr, "usage : %s [-o open time (1-255 readings)] [-s slope threshold] < capture\n", name);
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  char line[REPLAY_LINE_MAX], *message;
+  double t;
+  int opt;
+
+  while((opt = getopt(argc, argv, "o:s:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'o': replay_open_time = atoi(optarg); break;
+      case 's': replay_slope_threshold = atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  // time_it_has_been_opened is a uint8_t
+  if(replay_open_time < 1 || replay_open_time > 255)
+  {
+    usage(argv[0]);
+  }
+
+  linkaddr_node_addr.u8[0] = REPLAY_NODE_ID;
+  msg_id_to_addr(&parent_node, REPLAY_PARENT_ID);
+  not_connected = 0;
+  runicast_open(&runicast, 144, &runicast_callbacks);
+
+  while(fgets(line, sizeof(line), stdin) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    message = strrchr(line, ' ');
+    if(message != NULL && sscanf(line, "%lf", &t) == 1 && strncmp(message + 1, "SRV", TYPE_SIZE) == 0)
+    {
+      replay_srv(t, message + 1);
+    }
+  }
+  return 0;
+}
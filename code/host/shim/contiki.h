@@ -0,0 +1,126 @@
+#ifndef CONTIKI_H_
+#define CONTIKI_H_
+
+/*
+ * Host (Linux) shim of the parts of Contiki used by the firmwares.
+ *
+ * The firmwares are compiled unchanged against these headers (see
+ * host/Makefile). The processes are real protothreads, run by shim_run()
+ * with the same event semantics as Contiki. The clock does not move by
+ * itself : the tests and the benchmarks set shim_clock.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*---------------------------------------------------------------------------*/
+// Clock
+
+// 16 bits like the Sky/Z1 : the clock wraps after 512 s, and the firmwares
+// must compare times as differences
+typedef unsigned short clock_time_t;
+#define CLOCK_SECOND 128
+#define CLOCK_LT(a, b) ((signed short)((a) - (b)) < 0)
+
+extern clock_time_t shim_clock;
+
+clock_time_t clock_time(void);
+unsigned long clock_seconds(void);
+
+/*---------------------------------------------------------------------------*/
+// Protothreads (same local continuations as Contiki : switch on __LINE__)
+
+struct pt {
+  unsigned short lc;
+};
+
+#define PT_WAITING 0
+#define PT_YIELDED 1
+#define PT_EXITED 2
+#define PT_ENDED 3
+
+/*---------------------------------------------------------------------------*/
+// Processes
+
+typedef unsigned char process_event_t;
+typedef void *process_data_t;
+
+struct process {
+  struct process *next;
+  const char *name;
+  char (*thread)(struct pt *, process_event_t, process_data_t);
+  struct pt pt;
+  unsigned char running;
+  unsigned char needspoll;
+};
+
+#define PROCESS_EVENT_NONE 0x80
+#define PROCESS_EVENT_INIT 0x81
+#define PROCESS_EVENT_POLL 0x82
+#define PROCESS_EVENT_EXIT 0x83
+#define PROCESS_EVENT_CONTINUE 0x85
+#define PROCESS_EVENT_MSG 0x86
+#define PROCESS_EVENT_TIMER 0x88
+
+#define PROCESS_BROADCAST NULL
+
+#define PROCESS_THREAD(name, ev, data) \
+  static char process_thread_##name(struct pt *process_pt, process_event_t ev, process_data_t data)
+#define PROCESS_NAME(name) extern struct process name
+#define PROCESS(name, strname) \
+  PROCESS_THREAD(name, ev, data); \
+  struct process name = { NULL, strname, process_thread_##name, { 0 }, 0, 0 }
+#define AUTOSTART_PROCESSES(...) \
+  struct process * const autostart_processes[] = { __VA_ARGS__, NULL }
+
+#define PROCESS_BEGIN() { char PT_YIELD_FLAG = 1; (void)PT_YIELD_FLAG; switch(process_pt->lc) { case 0:
+#define PROCESS_END() } PT_YIELD_FLAG = 0; process_pt->lc = 0; return PT_ENDED; }
+#define PROCESS_WAIT_EVENT_UNTIL(c) \
+  do { \
+    PT_YIELD_FLAG = 0; \
+    process_pt->lc = __LINE__; case __LINE__: \
+    if(PT_YIELD_FLAG == 0 || !(c)) { \
+      return PT_YIELDED; \
+    } \
+  } while(0)
+#define PROCESS_WAIT_EVENT() PROCESS_WAIT_EVENT_UNTIL(1)
+#define PROCESS_YIELD() PROCESS_WAIT_EVENT()
+#define PROCESS_EXITHANDLER(handler) if(ev == PROCESS_EVENT_EXIT) { handler; }
+#define PROCESS_CURRENT() process_current
+
+extern struct process *process_current;
+extern struct process *process_list;
+
+void process_start(struct process *p, process_data_t data);
+void process_exit(struct process *p);
+int process_post(struct process *p, process_event_t ev, process_data_t data);
+void process_poll(struct process *p);
+process_event_t process_alloc_event(void);
+
+// Start the processes of AUTOSTART_PROCESSES
+void shim_autostart(struct process * const processes[]);
+
+// Deliver the pending polls and events, and the timers expired at shim_clock.
+// Returns the number of events delivered.
+int shim_run(void);
+
+/*---------------------------------------------------------------------------*/
+// Event timers
+
+struct etimer {
+  struct etimer *next;
+  clock_time_t start;
+  clock_time_t interval;
+  struct process *p;
+};
+
+void etimer_set(struct etimer *et, clock_time_t interval);
+void etimer_reset(struct etimer *et);
+void etimer_stop(struct etimer *et);
+int etimer_expired(struct etimer *et);
+
+// Time of the next timer to expire, returns 0 if there is none
+int shim_next_timer(clock_time_t *t);
+
+#endif /* CONTIKI_H_ */
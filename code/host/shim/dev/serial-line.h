@@ -0,0 +1,12 @@
+#ifndef SERIAL_LINE_H_
+#define SERIAL_LINE_H_
+
+// Host shim of the serial line : shim_serial_line() posts a line to all the processes
+
+#include "contiki.h"
+
+extern process_event_t serial_line_event_message;
+
+void shim_serial_line(const char *line);
+
+#endif /* SERIAL_LINE_H_ */
@@ -0,0 +1 @@
+#include "dev/leds.h"
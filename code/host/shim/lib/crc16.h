@@ -0,0 +1,9 @@
+#ifndef CRC16_H_
+#define CRC16_H_
+
+// Host shim of the Contiki CRC16 (same algorithm)
+
+unsigned short crc16_add(unsigned char b, unsigned short crc);
+unsigned short crc16_data(const unsigned char *data, int datalen, unsigned short acc);
+
+#endif /* CRC16_H_ */
@@ -0,0 +1,28 @@
+#ifndef MEMB_H_
+#define MEMB_H_
+
+// Host shim of the Contiki memory blocks (fixed size pools)
+
+#define MEMB_CONCAT2(s1, s2) s1##s2
+#define MEMB_CONCAT(s1, s2) MEMB_CONCAT2(s1, s2)
+
+#define MEMB(name, structure, num) \
+  static char MEMB_CONCAT(name, _memb_count)[num]; \
+  static structure MEMB_CONCAT(name, _memb_mem)[num]; \
+  static struct memb name = {sizeof(structure), num, \
+    MEMB_CONCAT(name, _memb_count), (void *)MEMB_CONCAT(name, _memb_mem)}
+
+struct memb {
+  unsigned short size;
+  unsigned short num;
+  char *count;
+  void *mem;
+};
+
+void memb_init(struct memb *m);
+void *memb_alloc(struct memb *m);
+char memb_free(struct memb *m, void *ptr);
+int memb_inmemb(struct memb *m, void *ptr);
+int memb_numfree(struct memb *m);
+
+#endif /* MEMB_H_ */
@@ -0,0 +1,114 @@
+#ifndef RIME_H_
+#define RIME_H_
+
+/*
+ * Host shim of the Rime stack : link addresses, packetbuf, and broadcast /
+ * runicast connections. Nothing goes on air : the sent packets are recorded
+ * (shim_sent), and shim_deliver_* calls the receive callbacks of a
+ * connection as if a packet arrived.
+ */
+
+#include "contiki.h"
+
+/*---------------------------------------------------------------------------*/
+// Link addresses
+
+typedef union {
+  unsigned char u8[2];
+  uint16_t u16;
+} linkaddr_t;
+
+extern linkaddr_t linkaddr_node_addr;
+extern const linkaddr_t linkaddr_null;
+
+void linkaddr_copy(linkaddr_t *dest, const linkaddr_t *src);
+int linkaddr_cmp(const linkaddr_t *addr1, const linkaddr_t *addr2);
+void linkaddr_set_node_addr(linkaddr_t *addr);
+
+/*---------------------------------------------------------------------------*/
+// Packet buffer
+
+#define PACKETBUF_SIZE 128
+
+#define PACKETBUF_ATTR_RSSI 1
+
+void packetbuf_clear(void);
+void *packetbuf_dataptr(void);
+uint16_t packetbuf_datalen(void);
+void packetbuf_set_datalen(uint16_t len);
+int packetbuf_copyfrom(const void *from, uint16_t len);
+int packetbuf_attr(int type);
+int packetbuf_set_attr(int type, int value);
+
+/*---------------------------------------------------------------------------*/
+// Connections
+
+struct broadcast_conn;
+struct broadcast_callbacks {
+  void (*recv)(struct broadcast_conn *c, const linkaddr_t *from);
+  void (*sent)(struct broadcast_conn *c, int status, int num_tx);
+};
+struct broadcast_conn {
+  const struct broadcast_callbacks *u;
+  uint16_t channel;
+};
+
+struct runicast_conn;
+struct runicast_callbacks {
+  void (*recv)(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno);
+  void (*sent)(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions);
+  void (*timedout)(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions);
+};
+struct runicast_conn {
+  const struct runicast_callbacks *u;
+  uint16_t channel;
+  uint8_t is_tx;
+  uint8_t max_rxmit;
+};
+
+void broadcast_open(struct broadcast_conn *c, uint16_t channel, const struct broadcast_callbacks *u);
+void broadcast_close(struct broadcast_conn *c);
+int broadcast_send(struct broadcast_conn *c);
+
+void runicast_open(struct runicast_conn *c, uint16_t channel, const struct runicast_callbacks *u);
+void runicast_close(struct runicast_conn *c);
+int runicast_send(struct runicast_conn *c, const linkaddr_t *receiver, uint8_t max_retransmissions);
+uint8_t runicast_is_transmitting(struct runicast_conn *c);
+
+/*---------------------------------------------------------------------------*/
+// Test hooks
+
+// Last packets sent (broadcast : to is linkaddr_null), the oldest are dropped
+#ifndef SHIM_SENT_MAX
+#define SHIM_SENT_MAX 32
+#endif
+struct shim_packet {
+  linkaddr_t to;
+  uint16_t len;
+  char data[PACKETBUF_SIZE + 1];
+};
+extern struct shim_packet shim_sent[SHIM_SENT_MAX];
+extern int shim_sent_count;
+
+// Called for every packet sent, if set (the packet is in packetbuf, c is the
+// broadcast_conn or the runicast_conn). While it is set, a runicast stays
+// busy until shim_runicast_done(), like on the radio.
+extern void (*shim_send_hook)(void *c, const linkaddr_t *to, int is_broadcast);
+
+// Calls of runicast_send() while a runicast was already being sent (dropped)
+extern unsigned int shim_runicast_dropped;
+
+// End of a runicast : calls the sent or timedout callback
+void shim_runicast_done(struct runicast_conn *c, const linkaddr_t *to, int acked, uint8_t retransmissions);
+
+// Forget the sent packets
+void shim_clear_sent(void);
+
+// Last packet sent, NULL if none
+const struct shim_packet *shim_last_sent(void);
+
+// Give a packet (a NUL terminated message) to the receive callback of a connection
+void shim_deliver_broadcast(struct broadcast_conn *c, int from, const char *message, int rssi);
+void shim_deliver_runicast(struct runicast_conn *c, int from, const char *message);
+
+#endif /* RIME_H_ */
@@ -0,0 +1,973 @@
+#include "contiki.h"
+#include "net/rime/rime.h"
+#include "lib/list.h"
+#include "lib/memb.h"
+#include "lib/random.h"
+#include "lib/crc16.h"
+#include "dev/leds.h"
+#include "dev/serial-line.h"
+#include "cfs/cfs.h"
+#include "sys/rtimer.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Host implementation of the Contiki shim (see contiki.h).
+ * Everything is global : one firmware per test program.
+ */
+
+/*---------------------------------------------------------------------------*/
+// Clock
+
+clock_time_t shim_clock = 0;
+
+clock_time_t
+clock_time(void)
+{
+  return shim_clock;
+}
+
+unsigned long
+clock_seconds(void)
+{
+  return shim_clock / CLOCK_SECOND;
+}
+
+rtimer_clock_t
+shim_rtimer_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (rtimer_clock_t)(now.tv_sec * RTIMER_SECOND + now.tv_nsec / (1000000000L / RTIMER_SECOND));
+}
+
+/*---------------------------------------------------------------------------*/
+// Processes and events
+
+#define SHIM_EVENTS 32
+
+struct shim_event {
+  process_event_t ev;
+  process_data_t data;
+  struct process *p;
+};
+
+static struct shim_event events[SHIM_EVENTS];
+static int events_first = 0;
+static int events_count = 0;
+static int poll_requested = 0;
+static process_event_t last_event = PROCESS_EVENT_TIMER;
+
+struct process *process_list = NULL;
+struct process *process_current = NULL;
+
+process_event_t serial_line_event_message;
+
+static struct etimer *timers = NULL;
+
+process_event_t
+process_alloc_event(void)
+{
+  return ++last_event;
+}
+
+static void
+process_remove(struct process *p)
+{
+  struct process **q;
+
+  for(q = &process_list ; *q != NULL ; q = &(*q)->next)
+  {
+    if(*q == p)
+    {
+      *q = p->next;
+      break;
+    }
+  }
+  p->running = 0;
+}
+
+static void
+call_process(struct process *p, process_event_t ev, process_data_t data)
+{
+  struct process *caller = process_current;
+  char ret;
+
+  if(!p->running)
+  {
+    return;
+  }
+  process_current = p;
+  ret = p->thread(&p->pt, ev, data);
+  if(ret == PT_EXITED || ret == PT_ENDED || ev == PROCESS_EVENT_EXIT)
+  {
+    process_remove(p);
+  }
+  process_current = caller;
+}
+
+void
+process_start(struct process *p, process_data_t data)
+{
+  struct process *q;
+
+  for(q = process_list ; q != NULL ; q = q->next)
+  {
+    if(q == p)
+    {
+      return;
+    }
+  }
+  p->next = process_list;
+  process_list = p;
+  p->running = 1;
+  p->needspoll = 0;
+  p->pt.lc = 0;
+  call_process(p, PROCESS_EVENT_INIT, data);
+}
+
+void
+process_exit(struct process *p)
+{
+  call_process(p, PROCESS_EVENT_EXIT, NULL);
+}
+
+int
+process_post(struct process *p, process_event_t ev, process_data_t data)
+{
+  struct shim_event *e;
+
+  if(events_count == SHIM_EVENTS)
+  {
+    return 1;
+  }
+  e = &events[(events_first + events_count) % SHIM_EVENTS];
+  e->ev = ev;
+  e->data = data;
+  e->p = p;
+  events_count++;
+  return 0;
+}
+
+void
+process_poll(struct process *p)
+{
+  if(p != NULL)
+  {
+    p->needspoll = 1;
+    poll_requested = 1;
+  }
+}
+
+void
+shim_autostart(struct process * const processes[])
+{
+  int i;
+
+  serial_line_event_message = process_alloc_event();
+  for(i = 0 ; processes[i] != NULL ; i++)
+  {
+    process_start(processes[i], NULL);
+  }
+}
+
+// Expired timers become a PROCESS_EVENT_TIMER for their process. Like
+// timer_expired() of Contiki, the time since the start is compared with the
+// interval, so an interval up to the whole 16 bits clock works.
+static void
+run_timers(void)
+{
+  struct etimer **t = &timers;
+  struct etimer *et;
+
+  while(*t != NULL)
+  {
+    et = *t;
+    if((clock_time_t)(shim_clock - et->start) >= et->interval)
+    {
+      *t = et->next;
+      process_post(et->p, PROCESS_EVENT_TIMER, et);
+      et->p = NULL;
+    }
+    else
+    {
+      t = &et->next;
+    }
+  }
+}
+
+int
+shim_run(void)
+{
+  struct process *p;
+  struct shim_event e;
+  int delivered = 0;
+
+  run_timers();
+  while(poll_requested || events_count > 0)
+  {
+    // Polls first, like Contiki
+    while(poll_requested)
+    {
+      poll_requested = 0;
+      for(p = process_list ; p != NULL ; p = p->next)
+      {
+        if(p->needspoll)
+        {
+          p->needspoll = 0;
+          call_process(p, PROCESS_EVENT_POLL, NULL);
+          delivered++;
+        }
+      }
+    }
+    if(events_count > 0)
+    {
+      e = events[events_first];
+      events_first = (events_first + 1) % SHIM_EVENTS;
+      events_count--;
+      if(e.p == PROCESS_BROADCAST)
+      {
+        for(p = process_list ; p != NULL ; p = p->next)
+        {
+          call_process(p, e.ev, e.data);
+        }
+      }
+      else
+      {
+        call_process(e.p, e.ev, e.data);
+      }
+      delivered++;
+    }
+  }
+  return delivered;
+}
+
+/*---------------------------------------------------------------------------*/
+// Event timers
+
+static void
+add_timer(struct etimer *et)
+{
+  struct etimer *t;
+
+  for(t = timers ; t != NULL ; t = t->next)
+  {
+    if(t == et)
+    {
+      return;
+    }
+  }
+  et->next = timers;
+  timers = et;
+}
+
+void
+etimer_stop(struct etimer *et)
+{
+  struct etimer **t;
+
+  for(t = &timers ; *t != NULL ; t = &(*t)->next)
+  {
+    if(*t == et)
+    {
+      *t = et->next;
+      break;
+    }
+  }
+  et->p = NULL;
+}
+
+void
+etimer_set(struct etimer *et, clock_time_t interval)
+{
+  et->start = shim_clock;
+  et->interval = interval;
+  et->p = process_current;
+  add_timer(et);
+}
+
+void
+etimer_reset(struct etimer *et)
+{
+  et->start += et->interval;
+  et->p = process_current;
+  add_timer(et);
+}
+
+int
+etimer_expired(struct etimer *et)
+{
+  return et->p == NULL;
+}
+
+int
+shim_next_timer(clock_time_t *next)
+{
+  struct etimer *t;
+  clock_time_t left, min = 0;
+  int found = 0;
+
+  for(t = timers ; t != NULL ; t = t->next)
+  {
+    left = t->start + t->interval - shim_clock;
+    if(!found || left < min)
+    {
+      min = left;
+      *next = t->start + t->interval;
+      found = 1;
+    }
+  }
+  return found;
+}
+
+/*---------------------------------------------------------------------------*/
+// Serial line
+
+void
+shim_serial_line(const char *line)
+{
+  process_post(PROCESS_BROADCAST, serial_line_event_message, (process_data_t)line);
+}
+
+/*---------------------------------------------------------------------------*/
+// Lists
+
+void
+list_init(list_t list)
+{
+  *list = NULL;
+}
+
+void *
+list_head(list_t list)
+{
+  return *list;
+}
+
+void *
+list_tail(list_t list)
+{
+  struct list { struct list *next; } *l;
+
+  if(*list == NULL)
+  {
+    return NULL;
+  }
+  for(l = *list ; l->next != NULL ; l = l->next);
+  return l;
+}
+
+void
+list_remove(list_t list, void *item)
+{
+  struct list { struct list *next; } *l, *r;
+
+  if(*list == NULL)
+  {
+    return;
+  }
+  r = NULL;
+  for(l = *list ; l != NULL ; l = l->next)
+  {
+    if(l == item)
+    {
+      if(r == NULL)
+      {
+        *list = l->next;
+      }
+      else
+      {
+        r->next = l->next;
+      }
+      l->next = NULL;
+      return;
+    }
+    r = l;
+  }
+}
+
+void
+list_add(list_t list, void *item)
+{
+  struct list { struct list *next; } *l;
+
+  // An item is at most once in a list
+  list_remove(list, item);
+  ((struct list *)item)->next = NULL;
+  l = list_tail(list);
+  if(l == NULL)
+  {
+    *list = item;
+  }
+  else
+  {
+    l->next = item;
+  }
+}
+
+void
+list_push(list_t list, void *item)
+{
+  struct list { struct list *next; } *l = item;
+
+  list_remove(list, item);
+  l->next = *list;
+  *list = l;
+}
+
+void *
+list_pop(list_t list)
+{
+  struct list { struct list *next; } *l = *list;
+
+  if(l != NULL)
+  {
+    *list = l->next;
+  }
+  return l;
+}
+
+int
+list_length(list_t list)
+{
+  struct list { struct list *next; } *l;
+  int n = 0;
+
+  for(l = *list ; l != NULL ; l = l->next)
+  {
+    n++;
+  }
+  return n;
+}
+
+void
+list_insert(list_t list, void *previtem, void *newitem)
+{
+  struct list { struct list *next; } *prev = previtem, *item = newitem;
+
+  if(prev == NULL)
+  {
+    list_push(list, newitem);
+  }
+  else
+  {
+    item->next = prev->next;
+    prev->next = item;
+  }
+}
+
+void *
+list_item_next(void *item)
+{
+  return item == NULL ? NULL : ((struct list { struct list *next; } *)item)->next;
+}
+
+/*---------------------------------------------------------------------------*/
+// Memory blocks
+
+void
+memb_init(struct memb *m)
+{
+  memset(m->count, 0, m->num);
+  memset(m->mem, 0, (size_t)m->size * m->num);
+}
+
+void *
+memb_alloc(struct memb *m)
+{
+  int i;
+
+  for(i = 0 ; i < m->num ; i++)
+  {
+    if(m->count[i] == 0)
+    {
+      m->count[i]++;
+      return (char *)m->mem + i * m->size;
+    }
+  }
+  return NULL;
+}
+
+char
+memb_free(struct memb *m, void *ptr)
+{
+  int i = ((char *)ptr - (char *)m->mem) / m->size;
+
+  if(!memb_inmemb(m, ptr) || m->count[i] == 0)
+  {
+    return -1;
+  }
+  return --m->count[i];
+}
+
+int
+memb_inmemb(struct memb *m, void *ptr)
+{
+  return (char *)ptr >= (char *)m->mem && (char *)ptr < (char *)m->mem + m->num * m->size;
+}
+
+int
+memb_numfree(struct memb *m)
+{
+  int i, n = 0;
+
+  for(i = 0 ; i < m->num ; i++)
+  {
+    n += m->count[i] == 0;
+  }
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+// Random, CRC, LEDs
+
+static unsigned short random_state = 1;
+
+void
+random_init(unsigned short seed)
+{
+  random_state = seed;
+}
+
+unsigned short
+random_rand(void)
+{
+  // Same generator as the native Contiki platform
+  random_state = random_state * 1103515245 + 12345;
+  return (random_state >> 8) & RANDOM_RAND_MAX;
+}
+
+unsigned short
+crc16_add(unsigned char b, unsigned short acc)
+{
+  acc ^= b;
+  acc = (acc >> 8) | (acc << 8);
+  acc ^= (acc & 0xff00) << 4;
+  acc ^= (acc >> 8) >> 4;
+  acc ^= (acc & 0xff00) >> 5;
+  return acc;
+}
+
+unsigned short
+crc16_data(const unsigned char *data, int len, unsigned short acc)
+{
+  int i;
+
+  for(i = 0 ; i < len ; i++)
+  {
+    acc = crc16_add(data[i], acc);
+  }
+  return acc;
+}
+
+unsigned char shim_leds = 0;
+
+void
+leds_on(unsigned char leds)
+{
+  shim_leds |= leds;
+}
+
+void
+leds_off(unsigned char leds)
+{
+  shim_leds &= ~leds;
+}
+
+unsigned char
+leds_get(void)
+{
+  return shim_leds;
+}
+
+/*---------------------------------------------------------------------------*/
+// Link addresses and packetbuf
+
+linkaddr_t linkaddr_node_addr;
+const linkaddr_t linkaddr_null = { { 0, 0 } };
+
+void
+linkaddr_copy(linkaddr_t *dest, const linkaddr_t *src)
+{
+  *dest = *src;
+}
+
+int
+linkaddr_cmp(const linkaddr_t *addr1, const linkaddr_t *addr2)
+{
+  return addr1->u8[0] == addr2->u8[0] && addr1->u8[1] == addr2->u8[1];
+}
+
+void
+linkaddr_set_node_addr(linkaddr_t *addr)
+{
+  linkaddr_copy(&linkaddr_node_addr, addr);
+}
+
+static char packetbuf[PACKETBUF_SIZE + 1];
+static uint16_t packetbuf_len = 0;
+static int packetbuf_rssi = 0;
+
+void
+packetbuf_clear(void)
+{
+  packetbuf_len = 0;
+  packetbuf_rssi = 0;
+}
+
+void *
+packetbuf_dataptr(void)
+{
+  return packetbuf;
+}
+
+uint16_t
+packetbuf_datalen(void)
+{
+  return packetbuf_len;
+}
+
+void
+packetbuf_set_datalen(uint16_t len)
+{
+  packetbuf_len = len > PACKETBUF_SIZE ? PACKETBUF_SIZE : len;
+}
+
+int
+packetbuf_copyfrom(const void *from, uint16_t len)
+{
+  packetbuf_clear();
+  packetbuf_len = len > PACKETBUF_SIZE ? PACKETBUF_SIZE : len;
+  memcpy(packetbuf, from, packetbuf_len);
+  return packetbuf_len;
+}
+
+int
+packetbuf_attr(int type)
+{
+  return type == PACKETBUF_ATTR_RSSI ? packetbuf_rssi : 0;
+}
+
+int
+packetbuf_set_attr(int type, int value)
+{
+  if(type == PACKETBUF_ATTR_RSSI)
+  {
+    packetbuf_rssi = value;
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+// Connections
+
+struct shim_packet shim_sent[SHIM_SENT_MAX];
+int shim_sent_count = 0;
+void (*shim_send_hook)(void *c, const linkaddr_t *to, int is_broadcast) = NULL;
+unsigned int shim_runicast_dropped = 0;
+
+void
+shim_clear_sent(void)
+{
+  shim_sent_count = 0;
+}
+
+const struct shim_packet *
+shim_last_sent(void)
+{
+  return shim_sent_count == 0 ? NULL : &shim_sent[(shim_sent_count - 1) % SHIM_SENT_MAX];
+}
+
+static void
+record_sent(void *c, const linkaddr_t *to, int is_broadcast)
+{
+  struct shim_packet *p = &shim_sent[shim_sent_count % SHIM_SENT_MAX];
+
+  linkaddr_copy(&p->to, to);
+  p->len = packetbuf_len;
+  memcpy(p->data, packetbuf, packetbuf_len);
+  p->data[packetbuf_len] = '\0';
+  shim_sent_count++;
+  if(shim_send_hook != NULL)
+  {
+    shim_send_hook(c, to, is_broadcast);
+  }
+}
+
+void
+broadcast_open(struct broadcast_conn *c, uint16_t channel, const struct broadcast_callbacks *u)
+{
+  c->channel = channel;
+  c->u = u;
+}
+
+void
+broadcast_close(struct broadcast_conn *c)
+{
+  c->u = NULL;
+}
+
+int
+broadcast_send(struct broadcast_conn *c)
+{
+  record_sent(c, &linkaddr_null, 1);
+  return 1;
+}
+
+void
+runicast_open(struct runicast_conn *c, uint16_t channel, const struct runicast_callbacks *u)
+{
+  c->channel = channel;
+  c->u = u;
+  c->is_tx = 0;
+}
+
+void
+runicast_close(struct runicast_conn *c)
+{
+  c->is_tx = 0;
+}
+
+int
+runicast_send(struct runicast_conn *c, const linkaddr_t *receiver, uint8_t max_retransmissions)
+{
+  // Like Contiki, a runicast sends one packet at a time
+  if(c->is_tx)
+  {
+    shim_runicast_dropped++;
+    return 0;
+  }
+  if(shim_send_hook != NULL)
+  {
+    c->is_tx = 1;
+  }
+  c->max_rxmit = max_retransmissions;
+  record_sent(c, receiver, 0);
+  return 1;
+}
+
+void
+shim_runicast_done(struct runicast_conn *c, const linkaddr_t *to, int acked, uint8_t retransmissions)
+{
+  c->is_tx = 0;
+  if(c->u == NULL)
+  {
+    return;
+  }
+  if(acked && c->u->sent != NULL)
+  {
+    c->u->sent(c, to, retransmissions);
+  }
+  else if(!acked && c->u->timedout != NULL)
+  {
+    c->u->timedout(c, to, retransmissions);
+  }
+}
+
+uint8_t
+runicast_is_transmitting(struct runicast_conn *c)
+{
+  return c->is_tx;
+}
+
+void
+shim_deliver_broadcast(struct broadcast_conn *c, int from, const char *message, int rssi)
+{
+  linkaddr_t addr = { { (unsigned char)from, 0 } };
+
+  packetbuf_copyfrom(message, strlen(message));
+  packetbuf_set_attr(PACKETBUF_ATTR_RSSI, rssi);
+  if(c->u != NULL && c->u->recv != NULL)
+  {
+    c->u->recv(c, &addr);
+  }
+}
+
+void
+shim_deliver_runicast(struct runicast_conn *c, int from, const char *message)
+{
+  linkaddr_t addr = { { (unsigned char)from, 0 } };
+
+  packetbuf_copyfrom(message, strlen(message));
+  if(c->u != NULL && c->u->recv != NULL)
+  {
+    c->u->recv(c, &addr, 0);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+// File system
+
+#define SHIM_FILES 4
+#ifndef SHIM_FILE_SIZE
+#define SHIM_FILE_SIZE 2048
+#endif
+
+struct shim_file {
+  char name[16];
+  int used;
+  int len;
+  unsigned char data[SHIM_FILE_SIZE];
+};
+
+struct shim_fd {
+  struct shim_file *file;
+  int offset;
+  int flags;
+};
+
+static struct shim_file files[SHIM_FILES];
+static struct shim_fd fds[SHIM_FILES];
+
+// Open file of a descriptor, NULL if invalid
+static struct shim_fd *
+get_fd(int fd)
+{
+  return (fd < 0 || fd >= SHIM_FILES || fds[fd].file == NULL) ? NULL : &fds[fd];
+}
+
+static struct shim_file *
+find_file(const char *name)
+{
+  int i;
+
+  for(i = 0 ; i < SHIM_FILES ; i++)
+  {
+    if(files[i].used && strcmp(files[i].name, name) == 0)
+    {
+      return &files[i];
+    }
+  }
+  return NULL;
+}
+
+void
+shim_cfs_format(void)
+{
+  memset(files, 0, sizeof(files));
+  memset(fds, 0, sizeof(fds));
+}
+
+int
+cfs_open(const char *name, int flags)
+{
+  struct shim_file *f = find_file(name);
+  int i;
+
+  if(f == NULL && (flags & (CFS_WRITE | CFS_APPEND)))
+  {
+    for(i = 0 ; i < SHIM_FILES && files[i].used ; i++);
+    if(i == SHIM_FILES || strlen(name) >= sizeof(files[i].name))
+    {
+      return -1;
+    }
+    f = &files[i];
+    memset(f, 0, sizeof(*f));
+    f->used = 1;
+    strcpy(f->name, name);
+  }
+  if(f == NULL)
+  {
+    return -1;
+  }
+  for(i = 0 ; i < SHIM_FILES && fds[i].file != NULL ; i++);
+  if(i == SHIM_FILES)
+  {
+    return -1;
+  }
+  fds[i].file = f;
+  fds[i].flags = flags;
+  fds[i].offset = (flags & CFS_APPEND) ? f->len : 0;
+  return i;
+}
+
+void
+cfs_close(int fd)
+{
+  struct shim_fd *d = get_fd(fd);
+
+  if(d != NULL)
+  {
+    d->file = NULL;
+  }
+}
+
+int
+cfs_read(int fd, void *buf, unsigned int len)
+{
+  struct shim_fd *d = get_fd(fd);
+
+  if(d == NULL || !(d->flags & CFS_READ))
+  {
+    return -1;
+  }
+  if(len > (unsigned int)(d->file->len - d->offset))
+  {
+    len = d->file->len - d->offset;
+  }
+  memcpy(buf, d->file->data + d->offset, len);
+  d->offset += len;
+  return len;
+}
+
+int
+cfs_write(int fd, const void *buf, unsigned int len)
+{
+  struct shim_fd *d = get_fd(fd);
+
+  if(d == NULL || !(d->flags & (CFS_WRITE | CFS_APPEND)))
+  {
+    return -1;
+  }
+  if(len > (unsigned int)(SHIM_FILE_SIZE - d->offset))
+  {
+    len = SHIM_FILE_SIZE - d->offset;
+  }
+  memcpy(d->file->data + d->offset, buf, len);
+  d->offset += len;
+  if(d->offset > d->file->len)
+  {
+    d->file->len = d->offset;
+  }
+  return len;
+}
+
+cfs_offset_t
+cfs_seek(int fd, cfs_offset_t offset, int whence)
+{
+  struct shim_fd *d = get_fd(fd);
+
+  if(d == NULL)
+  {
+    return -1;
+  }
+  if(whence == CFS_SEEK_CUR)
+  {
+    offset += d->offset;
+  }
+  else if(whence == CFS_SEEK_END)
+  {
+    offset += d->file->len;
+  }
+  if(offset < 0 || offset > d->file->len)
+  {
+    return -1;
+  }
+  d->offset = offset;
+  return offset;
+}
+
+int
+cfs_remove(const char *name)
+{
+  struct shim_file *f = find_file(name);
+
+  if(f == NULL)
+  {
+    return -1;
+  }
+  f->used = 0;
+  return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef RTIMER_H_
+#define RTIMER_H_
+
+// Host shim of the Contiki rtimer : only the clock, read from the host
+// monotonic clock at the rate of the MSP430 rtimer (it wraps the same way)
+
+typedef unsigned short rtimer_clock_t;
+
+#define RTIMER_SECOND 32768
+
+rtimer_clock_t shim_rtimer_now(void);
+#define RTIMER_NOW() shim_rtimer_now()
+
+#endif /* RTIMER_H_ */
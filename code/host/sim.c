@@ -0,0 +1,951 @@
+#include "contiki.h"
+#include "net/rime/rime.h"
+
+#include "sim.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Discrete-event simulator of large deployments, for capacity planning : the
+ * unchanged firmwares (see sim_node.c) on a simulated radio, faster than real
+ * time.
+ *
+ * The node ids fit in one byte, so a deployment is simulated as several
+ * networks of at most 254 nodes : a border, computation nodes and sensors
+ * spread on a square around it. The networks do not hear each other (other
+ * channels). Their borders give their lines to the same server, which only
+ * counts them : the load at the sink.
+ *
+ * Radio : a frame is heard by the nodes in range, and received with a ratio
+ * that falls near the edge of the range. Two frames heard at the same time by
+ * a node collide. Each node has a CSMA MAC with a queue, the runicast is
+ * acknowledged and retransmitted like the one of Contiki.
+ *
+ * Usage : sim [-s sensors] [-n sensors per network] [-c computation nodes per network]
+ *             [-k neighbours] [-l loss] [-t seconds] [-S seed] [-o file] [-i]
+ * -o writes the lines received by the server, with their time and network.
+ * -i runs the single image (sky_node.c) on the sensors : the loaded
+ * computation nodes promote some of them.
+ */
+
+#define US_PER_SECOND 1000000ULL
+#define NEVER UINT64_MAX
+
+// Frames : 250 kbit/s (32 us per byte), plus the headers and the preamble
+#define BYTE_TIME 32
+#define FRAME_OVERHEAD 20
+#define ACK_LEN 4
+
+// Range of a node (m), RSSI at 1 m and at the edge of the range (dBm). The
+// reception ratio is 1 - loss up to FADE_START of the range, then falls to 0.
+#define RANGE 50.0
+#define RSSI_1M -40
+#define RSSI_EDGE -90
+#define FADE_START 0.8
+
+// CSMA : a random backoff of up to 2^be BACKOFF_UNIT before each attempt,
+// be grows while the channel is busy. Dropped after MAX_BACKOFFS.
+#define MAC_QUEUE 8
+#define BACKOFF_UNIT 1000
+#define MIN_BE 3
+#define MAX_BE 5
+#define MAX_BACKOFFS 5
+
+// Runicast : no ACK after REXMIT_TIME, sent again, the time doubles each time (up to 16x)
+#define REXMIT_TIME US_PER_SECOND
+#define RUNICAST_SEQNO_MASK 7
+
+// Most nodes in a network : the ids fit in one byte, 0 is nobody
+#define MAX_NETWORK_NODES 254
+
+enum frame_kind { FRAME_BROADCAST, FRAME_DATA, FRAME_ACK };
+
+struct frame {
+  struct frame *next;
+  uint8_t kind;
+  uint8_t seqno;
+  uint8_t len;
+  uint8_t backoffs;
+  uint8_t be;
+  int src;
+  int dst;
+  char data[PACKETBUF_SIZE];
+};
+
+struct role_slot {
+  const struct sim_role *role;
+  void *pristine;
+  int resident;
+};
+
+struct node {
+  struct role_slot *slot;
+  int net;
+  int id;
+  double x, y;
+  void *state;
+
+  // Nodes in range, the RSSI of their frames here and the reception ratio (/ 255)
+  int *neighbours;
+  signed char *rssi;
+  unsigned char *prr;
+  int nneighbours;
+
+  // Next timer of the firmware
+  uint64_t wake;
+
+  // MAC queue, frame on air, backoff scheduled
+  struct frame *queue, *queue_tail;
+  int queue_len;
+  struct frame *tx;
+  uint8_t mac_pending;
+
+  // Runicast being sent (in the queue, on air or waiting for its ACK)
+  struct frame *ruc;
+  int ruc_to;
+  uint8_t ruc_seqno;
+  uint8_t ruc_tx;
+  uint8_t ruc_max;
+  uint32_t ruc_gen;
+
+  // Frames heard now, and the one being received (if not collided)
+  uint16_t heard;
+  struct frame *rx;
+  uint8_t rx_ok;
+
+  // Statistics
+  int parent;
+  uint64_t joined;
+  uint64_t queue_since;
+  double queue_area;
+  int queue_max;
+};
+
+enum event_type { EV_WAKE, EV_MAC, EV_TX_END, EV_REXMIT };
+
+struct event {
+  uint64_t t;
+  uint32_t order;
+  uint8_t type;
+  int node;
+  uint32_t gen;
+};
+
+static struct role_slot slots[] = {
+  { &sim_sensor, NULL, -1 },
+  { &sim_computation, NULL, -1 },
+  { &sim_border, NULL, -1 },
+  { &sim_node, NULL, -1 },
+};
+#define SLOT_SENSOR (&slots[0])
+#define SLOT_COMPUTATION (&slots[1])
+#define SLOT_BORDER (&slots[2])
+#define SLOT_NODE (&slots[3])
+
+static struct node *nodes;
+static int nnodes;
+static int networks;
+static int network_size;
+static double loss = 0.05;
+
+static uint64_t now = 0;
+static uint64_t duration = 3600 * US_PER_SECOND;
+static int current = -1;
+
+static struct event *heap;
+static int heap_len = 0, heap_size = 0;
+static uint32_t event_order = 0;
+static uint64_t events = 0;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static FILE *sink_file = NULL;
+
+// Counters
+static struct {
+  uint64_t frames, collisions, lost, mac_drops, queue_drops;
+  uint64_t ruc_acked, ruc_timedout, ruc_retransmissions;
+  uint64_t sink_lines, sink_bytes, sink_srv, sink_sum, sink_hnd, sink_gak, sink_lnk;
+  uint64_t parent_changes, last_parent_change;
+} stats;
+static uint32_t *sink_per_second;
+static uint64_t *sink_per_network;
+
+/*---------------------------------------------------------------------------*/
+
+static uint64_t
+rng(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 2685821657736338717ULL;
+}
+
+static double
+rng_uniform(void)
+{
+  return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void
+heap_push(uint64_t t, int type, int node, uint32_t gen)
+{
+  struct event e = { t, event_order++, type, node, gen };
+  int i, parent;
+
+  if(heap_len == heap_size)
+  {
+    heap_size = heap_size ? heap_size * 2 : 1024;
+    heap = realloc(heap, heap_size * sizeof(*heap));
+  }
+  for(i = heap_len++ ; i > 0 ; i = parent)
+  {
+    parent = (i - 1) / 2;
+    if(heap[parent].t < e.t || (heap[parent].t == e.t && heap[parent].order < e.order))
+    {
+      break;
+    }
+    heap[i] = heap[parent];
+  }
+  heap[i] = e;
+}
+
+static struct event
+heap_pop(void)
+{
+  struct event top = heap[0], last = heap[--heap_len];
+  int i = 0, child;
+
+  while((child = 2 * i + 1) < heap_len)
+  {
+    if(child + 1 < heap_len && (heap[child + 1].t < heap[child].t
+      || (heap[child + 1].t == heap[child].t && heap[child + 1].order < heap[child].order)))
+    {
+      child++;
+    }
+    if(last.t < heap[child].t || (last.t == heap[child].t && last.order < heap[child].order))
+    {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+/*---------------------------------------------------------------------------*/
+// Running a node
+
+// Load the state of the node in its role (saving the node that was there)
+static void
+enter(int n)
+{
+  struct role_slot *slot = nodes[n].slot;
+
+  if(slot->resident != n)
+  {
+    if(slot->resident >= 0)
+    {
+      slot->role->save(nodes[slot->resident].state);
+    }
+    slot->role->load(nodes[n].state);
+    slot->resident = n;
+  }
+  current = n;
+}
+
+// Run the processes of the node, then follow its timers and its parent
+static void
+leave(int n)
+{
+  struct node *node = &nodes[n];
+  unsigned long next;
+  uint64_t wake = NEVER;
+  int parent;
+
+  if(node->slot->role->run((unsigned long)(now * CLOCK_SECOND / US_PER_SECOND), &next))
+  {
+    wake = (next * US_PER_SECOND + CLOCK_SECOND - 1) / CLOCK_SECOND;
+    wake = wake > now ? wake : now + 1;
+  }
+  if(wake != node->wake)
+  {
+    node->wake = wake;
+    if(wake != NEVER)
+    {
+      heap_push(wake, EV_WAKE, n, 0);
+    }
+  }
+
+  parent = node->slot->role->parent();
+  if(parent != node->parent)
+  {
+    if(node->joined == NEVER)
+    {
+      node->joined = now;
+    }
+    else
+    {
+      stats.parent_changes++;
+      stats.last_parent_change = now;
+    }
+    node->parent = parent;
+  }
+  current = -1;
+}
+
+/*---------------------------------------------------------------------------*/
+// MAC
+
+static void
+queue_changed(struct node *node, int delta)
+{
+  node->queue_area += (double)node->queue_len * (now - node->queue_since);
+  node->queue_since = now;
+  node->queue_len += delta;
+  if(node->queue_len > node->queue_max)
+  {
+    node->queue_max = node->queue_len;
+  }
+}
+
+// Schedule the next attempt of the MAC, if it has something to send
+static void
+mac_kick(int n)
+{
+  struct node *node = &nodes[n];
+
+  if(node->tx == NULL && !node->mac_pending && node->queue != NULL)
+  {
+    node->mac_pending = 1;
+    heap_push(now + 1 + (rng() % (1U << node->queue->be)) * BACKOFF_UNIT, EV_MAC, n, 0);
+  }
+}
+
+static int
+enqueue(int n, struct frame *f, int first)
+{
+  struct node *node = &nodes[n];
+
+  if(node->queue_len == MAC_QUEUE)
+  {
+    stats.queue_drops++;
+    return -1;
+  }
+  f->backoffs = 0;
+  f->be = MIN_BE;
+  if(first && node->queue != NULL)
+  {
+    f->next = node->queue;
+    node->queue = f;
+  }
+  else
+  {
+    f->next = NULL;
+    if(node->queue == NULL)
+    {
+      node->queue = f;
+    }
+    else
+    {
+      node->queue_tail->next = f;
+    }
+    node->queue_tail = f;
+  }
+  queue_changed(node, 1);
+  mac_kick(n);
+  return 0;
+}
+
+static void
+dequeue(int n, struct frame *f)
+{
+  struct node *node = &nodes[n];
+  struct frame **q;
+
+  for(q = &node->queue ; *q != NULL ; q = &(*q)->next)
+  {
+    if(*q == f)
+    {
+      *q = f->next;
+      if(node->queue_tail == f)
+      {
+        node->queue_tail = NULL;
+        for(f = node->queue ; f != NULL ; f = f->next)
+        {
+          node->queue_tail = f;
+        }
+      }
+      queue_changed(node, -1);
+      return;
+    }
+  }
+}
+
+static struct frame *
+new_frame(int kind, int src, int dst, const char *data, int len)
+{
+  struct frame *f = malloc(sizeof(*f));
+
+  f->kind = kind;
+  f->src = src;
+  f->dst = dst;
+  f->len = len;
+  f->seqno = 0;
+  memcpy(f->data, data, len);
+  return f;
+}
+
+// End of the runicast of a node (called out of its role)
+static void
+runicast_end(int n, int acked)
+{
+  struct node *node = &nodes[n];
+  struct frame *f = node->ruc;
+  int to = node->ruc_to;
+  int retransmissions = node->ruc_tx - 1;
+
+  node->ruc = NULL;
+  node->ruc_gen++;
+  dequeue(n, f);
+  free(f);
+  if(acked)
+  {
+    stats.ruc_acked++;
+  }
+  else
+  {
+    stats.ruc_timedout++;
+  }
+  enter(n);
+  node->slot->role->runicast_done(to, acked, retransmissions);
+  leave(n);
+}
+
+/*---------------------------------------------------------------------------*/
+// Radio
+
+
+static void
+receive(int r, struct frame *f, int rssi)
+{
+  struct node *node = &nodes[r];
+  struct frame *ack;
+
+  if(f->kind == FRAME_BROADCAST)
+  {
+    enter(r);
+    node->slot->role->receive_broadcast(nodes[f->src].id, f->data, f->len, rssi);
+    leave(r);
+  }
+  else if(f->kind == FRAME_DATA && f->dst == r)
+  {
+    // The ACK first, then the packet is given to the firmware (duplicates
+    // included, the firmwares drop them)
+    ack = new_frame(FRAME_ACK, r, f->src, f->data, 0);
+    ack->seqno = f->seqno;
+    ack->len = ACK_LEN;
+    if(enqueue(r, ack, 1) < 0)
+    {
+      free(ack);
+    }
+    enter(r);
+    node->slot->role->receive_runicast(nodes[f->src].id, f->data, f->len, f->seqno);
+    leave(r);
+  }
+  else if(f->kind == FRAME_ACK && f->dst == r && node->ruc != NULL
+    && node->ruc->dst == f->src && node->ruc->seqno == f->seqno)
+  {
+    runicast_end(r, 1);
+  }
+}
+
+static void
+start_tx(int n, struct frame *f)
+{
+  struct node *node = &nodes[n];
+  struct node *r;
+  int i;
+
+  node->tx = f;
+  node->rx_ok = 0;
+  stats.frames++;
+  if(f->kind == FRAME_DATA)
+  {
+    node->ruc_tx++;
+    stats.ruc_retransmissions += node->ruc_tx > 1;
+  }
+  for(i = 0 ; i < node->nneighbours ; i++)
+  {
+    r = &nodes[node->neighbours[i]];
+    if(++r->heard == 1 && r->tx == NULL)
+    {
+      r->rx = f;
+      r->rx_ok = 1;
+    }
+    else if(r->rx_ok)
+    {
+      r->rx_ok = 0;
+      stats.collisions++;
+    }
+  }
+  heap_push(now + (uint64_t)(f->len + FRAME_OVERHEAD) * BYTE_TIME, EV_TX_END, n, 0);
+}
+
+static void
+end_tx(int n)
+{
+  struct node *node = &nodes[n];
+  struct frame *f = node->tx;
+  struct node *r;
+  int i, shift;
+
+  node->tx = NULL;
+  for(i = 0 ; i < node->nneighbours ; i++)
+  {
+    r = &nodes[node->neighbours[i]];
+    r->heard--;
+    if(r->rx == f && r->rx_ok && rng() % 255 < node->prr[i])
+    {
+      r->rx = NULL;
+      receive(node->neighbours[i], f, node->rssi[i]);
+      continue;
+    }
+    if(r->rx == f)
+    {
+      r->rx = NULL;
+    }
+    if(f->dst == node->neighbours[i])
+    {
+      stats.lost++;
+    }
+  }
+
+  // The runicast waits for its ACK, the other frames are done
+  if(f->kind == FRAME_DATA && node->ruc == f)
+  {
+    shift = node->ruc_tx - 1 < 4 ? node->ruc_tx - 1 : 4;
+    heap_push(now + (REXMIT_TIME << shift), EV_REXMIT, n, node->ruc_gen);
+  }
+  else if(f->kind != FRAME_DATA)
+  {
+    free(f);
+  }
+  mac_kick(n);
+}
+
+static void
+mac_attempt(int n)
+{
+  struct node *node = &nodes[n];
+  struct frame *f = node->queue;
+  int shift;
+
+  node->mac_pending = 0;
+  if(f == NULL || node->tx != NULL)
+  {
+    return;
+  }
+  if(node->heard == 0)
+  {
+    dequeue(n, f);
+    start_tx(n, f);
+    return;
+  }
+
+  // Busy channel
+  if(++f->backoffs > MAX_BACKOFFS)
+  {
+    stats.mac_drops++;
+    dequeue(n, f);
+    if(node->ruc == f)
+    {
+      // Lost like a collision : the runicast sends it again later
+      node->ruc_tx++;
+      shift = node->ruc_tx - 1 < 4 ? node->ruc_tx - 1 : 4;
+      heap_push(now + (REXMIT_TIME << shift), EV_REXMIT, n, node->ruc_gen);
+    }
+    else
+    {
+      free(f);
+    }
+    mac_kick(n);
+    return;
+  }
+  f->be = f->be < MAX_BE ? f->be + 1 : MAX_BE;
+  node->mac_pending = 1;
+  heap_push(now + 1 + (rng() % (1U << f->be)) * BACKOFF_UNIT, EV_MAC, n, 0);
+}
+
+static void
+rexmit(int n, uint32_t gen)
+{
+  struct node *node = &nodes[n];
+
+  if(node->ruc == NULL || gen != node->ruc_gen)
+  {
+    return;
+  }
+  if(node->ruc_tx > node->ruc_max)
+  {
+    runicast_end(n, 0);
+  }
+  else if(enqueue(n, node->ruc, 0) < 0)
+  {
+    runicast_end(n, 0);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+// Called by the roles
+
+void
+sim_send(int to, const char *data, int len, int retransmissions)
+{
+  struct node *node = &nodes[current];
+  int base = current - (node->id - 1);
+  struct frame *f;
+
+  if(to == 0)
+  {
+    f = new_frame(FRAME_BROADCAST, current, -1, data, len);
+    if(enqueue(current, f, 0) < 0)
+    {
+      free(f);
+    }
+    return;
+  }
+
+  // A runicast to nobody in the network is sent, and times out
+  f = new_frame(FRAME_DATA, current, to <= network_size && to != node->id ? base + to - 1 : -1, data, len);
+  node->ruc_seqno = (node->ruc_seqno + 1) & RUNICAST_SEQNO_MASK;
+  f->seqno = node->ruc_seqno;
+  node->ruc = f;
+  node->ruc_to = to;
+  node->ruc_tx = 0;
+  node->ruc_max = retransmissions;
+  node->ruc_gen++;
+  if(enqueue(current, f, 0) < 0)
+  {
+    // Lost like a collision : the runicast sends it again later
+    node->ruc_tx = 1;
+    heap_push(now + REXMIT_TIME, EV_REXMIT, current, node->ruc_gen);
+  }
+}
+
+void
+sim_serial(const char *line)
+{
+  int len = strcspn(line, "\n");
+
+  if(current < 0 || nodes[current].slot != SLOT_BORDER || len < 3)
+  {
+    return;
+  }
+  if(strncmp(line, "SRV", 3) == 0)
+  {
+    stats.sink_srv++;
+  }
+  else if(strncmp(line, "SUM", 3) == 0)
+  {
+    stats.sink_sum++;
+  }
+  else if(strncmp(line, "HND", 3) == 0)
+  {
+    stats.sink_hnd++;
+  }
+  else if(strncmp(line, "GAK", 3) == 0)
+  {
+    stats.sink_gak++;
+  }
+  else if(strncmp(line, "LNK", 3) == 0)
+  {
+    stats.sink_lnk++;
+  }
+  else
+  {
+    return;
+  }
+  stats.sink_lines++;
+  stats.sink_bytes += len + 1;
+  sink_per_second[now / US_PER_SECOND]++;
+  sink_per_network[nodes[current].net]++;
+  if(sink_file != NULL)
+  {
+    fprintf(sink_file, "%.6f %d %.*s\n", (double)now / US_PER_SECOND, nodes[current].net, len, line);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+// Deployment
+
+static int
+rssi_at(double d)
+{
+  d = d < 1.0 ? 1.0 : d;
+  return RSSI_1M + (int)((RSSI_EDGE - RSSI_1M) * log10(d) / log10(RANGE));
+}
+
+static int
+prr_at(double d)
+{
+  double prr = 1.0 - loss;
+
+  if(d > FADE_START * RANGE)
+  {
+    prr *= (RANGE - d) / ((1.0 - FADE_START) * RANGE);
+  }
+  return (int)(prr * 255);
+}
+
+// One network : the border in the middle of a square where every node has
+// about "neighbours" nodes in range, node i has the id i + 1
+static void
+build_network(int net, int computation, int neighbours, int image)
+{
+  struct node *first = &nodes[net * network_size];
+  double side = RANGE * sqrt(M_PI * network_size / neighbours);
+  double d;
+  int i, j, k;
+
+  for(i = 0 ; i < network_size ; i++)
+  {
+    first[i].slot = i == 0 ? SLOT_BORDER : i <= computation ? SLOT_COMPUTATION : image ? SLOT_NODE : SLOT_SENSOR;
+    first[i].net = net;
+    first[i].id = i + 1;
+    first[i].x = i == 0 ? side / 2 : rng_uniform() * side;
+    first[i].y = i == 0 ? side / 2 : rng_uniform() * side;
+  }
+  for(i = 0 ; i < network_size ; i++)
+  {
+    first[i].neighbours = malloc(network_size * sizeof(int));
+    first[i].rssi = malloc(network_size);
+    first[i].prr = malloc(network_size);
+    for(j = 0, k = 0 ; j < network_size ; j++)
+    {
+      d = hypot(first[i].x - first[j].x, first[i].y - first[j].y);
+      if(j != i && d < RANGE)
+      {
+        first[i].neighbours[k] = net * network_size + j;
+        first[i].rssi[k] = rssi_at(d);
+        first[i].prr[k++] = prr_at(d);
+      }
+    }
+    first[i].nneighbours = k;
+  }
+}
+
+static void
+boot_nodes(void)
+{
+  struct node *node;
+  int n;
+
+  for(n = 0 ; n < (int)(sizeof(slots) / sizeof(slots[0])) ; n++)
+  {
+    slots[n].pristine = malloc(slots[n].role->state_size());
+    slots[n].role->save(slots[n].pristine);
+  }
+  for(n = 0 ; n < nnodes ; n++)
+  {
+    node = &nodes[n];
+    node->state = malloc(node->slot->role->state_size());
+    memcpy(node->state, node->slot->pristine, node->slot->role->state_size());
+    node->wake = NEVER;
+    node->joined = NEVER;
+    enter(n);
+    node->slot->role->boot(node->id, (unsigned short)(rng() | 1));
+    leave(n);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+// Report
+
+static int
+compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+seconds(uint64_t t)
+{
+  return (double)t / US_PER_SECOND;
+}
+
+static void
+report(double wall)
+{
+  uint64_t *joined = malloc(nnodes * sizeof(uint64_t));
+  uint64_t busiest = 0, dropped = 0, peak = 0, steady = 0;
+  double area = 0, border_area = 0;
+  int n, njoined = 0, deciding = 0, max_queue = 0, max_border_queue = 0, seconds_total = duration / US_PER_SECOND;
+
+  for(n = 0 ; n < nnodes ; n++)
+  {
+    queue_changed(&nodes[n], 0);
+    area += nodes[n].queue_area;
+    max_queue = nodes[n].queue_max > max_queue ? nodes[n].queue_max : max_queue;
+    if(nodes[n].slot == SLOT_BORDER)
+    {
+      border_area += nodes[n].queue_area;
+      max_border_queue = nodes[n].queue_max > max_border_queue ? nodes[n].queue_max : max_border_queue;
+    }
+    else if(nodes[n].joined != NEVER)
+    {
+      joined[njoined++] = nodes[n].joined;
+    }
+    enter(n);
+    dropped += nodes[n].slot->role->runicast_dropped();
+    deciding += nodes[n].slot->role->computation();
+  }
+  qsort(joined, njoined, sizeof(uint64_t), compare_u64);
+  for(n = 0 ; n < seconds_total ; n++)
+  {
+    peak = sink_per_second[n] > peak ? sink_per_second[n] : peak;
+    steady += n >= seconds_total / 2 ? sink_per_second[n] : 0;
+  }
+  for(n = 0 ; n < networks ; n++)
+  {
+    busiest = sink_per_network[n] > busiest ? sink_per_network[n] : busiest;
+  }
+
+  printf("nodes               %d (%d networks of %d)\n", nnodes, networks, network_size);
+  printf("simulated           %.0f s in %.1f s (%.0fx real time, %llu events)\n",
+    seconds(duration), wall, seconds(duration) / (wall > 0 ? wall : 1e-9), (unsigned long long)events);
+  printf("joined              %d / %d\n", njoined, nnodes - networks);
+  if(njoined > 0)
+  {
+    printf("convergence         50%% joined at %.1f s, 95%% at %.1f s, ",
+      seconds(joined[(njoined - 1) / 2]), seconds(joined[(njoined * 95 + 99) / 100 - 1]));
+    if(njoined == nnodes - networks)
+    {
+      printf("all at %.1f s\n", seconds(joined[njoined - 1]));
+    }
+    else
+    {
+      printf("not all\n");
+    }
+  }
+  printf("computation role    %d nodes at the end\n", deciding);
+  printf("parent changes      %llu (last at %.1f s)\n",
+    (unsigned long long)stats.parent_changes, seconds(stats.last_parent_change));
+  printf("sink lines          %llu (SRV %llu, SUM %llu, HND %llu, GAK %llu, LNK %llu)\n",
+    (unsigned long long)stats.sink_lines, (unsigned long long)stats.sink_srv, (unsigned long long)stats.sink_sum,
+    (unsigned long long)stats.sink_hnd, (unsigned long long)stats.sink_gak, (unsigned long long)stats.sink_lnk);
+  printf("sink load           %.1f lines/s (second half), peak %llu lines/s, %.0f bytes/s\n",
+    (double)steady / (seconds_total - seconds_total / 2), (unsigned long long)peak,
+    (double)stats.sink_bytes / seconds(duration));
+  printf("busiest border      %.2f lines/s\n", (double)busiest / seconds(duration));
+  printf("queue occupancy     mean %.3f, borders %.3f, max %d, borders max %d\n",
+    area / nnodes / duration, border_area / networks / duration, max_queue, max_border_queue);
+  printf("frames              %llu, collisions %llu, lost %llu\n",
+    (unsigned long long)stats.frames, (unsigned long long)stats.collisions, (unsigned long long)stats.lost);
+  printf("drops               queue full %llu, busy channel %llu, runicast busy %llu\n",
+    (unsigned long long)stats.queue_drops, (unsigned long long)stats.mac_drops, (unsigned long long)dropped);
+  printf("runicast            %llu acked, %llu timed out, %llu retransmissions\n",
+    (unsigned long long)stats.ruc_acked, (unsigned long long)stats.ruc_timedout,
+    (unsigned long long)stats.ruc_retransmissions);
+  free(joined);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void
+usage(const char *name)
+{
+  fprintf(stderr, "usage : %s [-s sensors] [-n sensors per network] [-c computation nodes per network]\n"
+    "  [-k neighbours] [-l loss] [-t seconds] [-S seed] [-o file] [-i]\n", name);
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  int sensors = 5000, per_network = 200, computation = 4, neighbours = 10, image = 0;
+  struct timespec start, end;
+  struct event e;
+  int opt, i;
+
+  while((opt = getopt(argc, argv, "s:n:c:k:l:t:S:o:i")) != -1)
+  {
+    switch(opt)
+    {
+      case 's': sensors = atoi(optarg); break;
+      case 'n': per_network = atoi(optarg); break;
+      case 'c': computation = atoi(optarg); break;
+      case 'k': neighbours = atoi(optarg); break;
+      case 'l': loss = atof(optarg); break;
+      case 't': duration = strtoull(optarg, NULL, 10) * US_PER_SECOND; break;
+      case 'i': image = 1; break;
+      case 'S': rng_state ^= strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ULL; break;
+      case 'o':
+        if((sink_file = fopen(optarg, "w")) == NULL)
+        {
+          perror(optarg);
+          return 2;
+        }
+        break;
+      default: usage(argv[0]);
+    }
+  }
+  network_size = 1 + computation + per_network;
+  if(sensors <= 0 || per_network <= 0 || computation < 0 || neighbours <= 0
+    || network_size > MAX_NETWORK_NODES || duration == 0 || loss < 0 || loss >= 1)
+  {
+    usage(argv[0]);
+  }
+
+  networks = (sensors + per_network - 1) / per_network;
+  nnodes = networks * network_size;
+  nodes = calloc(nnodes, sizeof(*nodes));
+  sink_per_second = calloc(duration / US_PER_SECOND + 1, sizeof(uint32_t));
+  sink_per_network = calloc(networks, sizeof(uint64_t));
+  for(i = 0 ; i < networks ; i++)
+  {
+    build_network(i, computation, neighbours, image);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  boot_nodes();
+  while(heap_len > 0 && heap[0].t < duration)
+  {
+    e = heap_pop();
+    now = e.t;
+    events++;
+    switch(e.type)
+    {
+      case EV_WAKE:
+        if(nodes[e.node].wake == e.t)
+        {
+          nodes[e.node].wake = NEVER;
+          enter(e.node);
+          leave(e.node);
+        }
+        break;
+      case EV_MAC: mac_attempt(e.node); break;
+      case EV_TX_END: end_tx(e.node); break;
+      case EV_REXMIT: rexmit(e.node, e.gen); break;
+    }
+  }
+  now = duration;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  report((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  if(sink_file != NULL)
+  {
+    fclose(sink_file);
+  }
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stddef.h>
+
+/*
+ * Interface between the simulator (sim.c) and the firmwares (sim_node.c).
+ *
+ * Each firmware is linked once, with its own copy of the shim, as a "role".
+ * The state of a node is the memory of its role : to run a node, the
+ * simulator loads its state in the role, calls the role, then saves it back.
+ * All the nodes of a role share the code and the addresses, so the pointers
+ * in the state (lists, timers, processes) stay valid.
+ */
+
+struct sim_role {
+  const char *name;
+
+  // Size of the state of a node, saved and loaded by copy
+  size_t (*state_size)(void);
+  void (*save)(void *state);
+  void (*load)(const void *state);
+
+  // Start the firmware, with this node id and random seed
+  void (*boot)(int id, unsigned short seed);
+
+  // Set the clock (ticks), and run the processes until they wait.
+  // Returns 1 and the time of the next timer in *next, 0 if there is none.
+  int (*run)(unsigned long clock, unsigned long *next);
+
+  // A packet for the node (from : node id), on the broadcast or the runicast connection
+  void (*receive_broadcast)(int from, const char *data, int len, int rssi);
+  void (*receive_runicast)(int from, const char *data, int len, int seqno);
+
+  // End of the runicast being sent
+  void (*runicast_done)(int to, int acked, int retransmissions);
+
+  // Parent of the node, 0 if it is not connected (the border is its own parent)
+  int (*parent)(void);
+
+  // Runicasts not sent because one was already being sent
+  unsigned int (*runicast_dropped)(void);
+
+  // 1 if the node decides for children (computation role)
+  int (*computation)(void);
+};
+
+extern const struct sim_role sim_sensor;
+extern const struct sim_role sim_computation;
+extern const struct sim_role sim_border;
+extern const struct sim_role sim_node;
+
+// Called by the role of the node being run : a packet sent (to : node id, 0
+// for a broadcast, retransmissions : most retransmissions of a runicast), and
+// a line printed on its serial line
+void sim_send(int to, const char *data, int len, int retransmissions);
+void sim_serial(const char *line);
+
+#endif /* SIM_H_ */
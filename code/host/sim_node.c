@@ -0,0 +1,160 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "sim.h"
+
+/*
+ * One role of the simulator : a firmware, compiled with
+ *   -DSIM_ROLE=sim_sensor -DSIM_FIRMWARE='"../z1_sensor.c"'
+ * and linked with the shim (see the sim target of the Makefile). The .data
+ * and .bss sections of the role are renamed SIM_ROLE_data and SIM_ROLE_bss :
+ * they hold the whole state of a node, so nothing else in this file may be
+ * a variable.
+ */
+
+// The serial line of the firmware goes to the simulator
+int sim_printf(const char *format, ...);
+#define printf sim_printf
+
+#include SIM_FIRMWARE
+
+#define SIM_SECTION_(prefix, role, part) prefix##role##_##part
+#define SIM_SECTION(prefix, role, part) SIM_SECTION_(prefix, role, part)
+
+extern char SIM_SECTION(__start_, SIM_ROLE, data)[], SIM_SECTION(__stop_, SIM_ROLE, data)[];
+extern char SIM_SECTION(__start_, SIM_ROLE, bss)[], SIM_SECTION(__stop_, SIM_ROLE, bss)[];
+
+#define DATA_START SIM_SECTION(__start_, SIM_ROLE, data)
+#define DATA_SIZE ((size_t)(SIM_SECTION(__stop_, SIM_ROLE, data) - DATA_START))
+#define BSS_START SIM_SECTION(__start_, SIM_ROLE, bss)
+#define BSS_SIZE ((size_t)(SIM_SECTION(__stop_, SIM_ROLE, bss) - BSS_START))
+
+int
+sim_printf(const char *format, ...)
+{
+  char line[PACKETBUF_SIZE * 2];
+  va_list ap;
+  int len;
+
+  va_start(ap, format);
+  len = vsnprintf(line, sizeof(line), format, ap);
+  va_end(ap);
+  sim_serial(line);
+  return len;
+}
+
+static size_t
+state_size(void)
+{
+  return DATA_SIZE + BSS_SIZE;
+}
+
+static void
+save(void *state)
+{
+  memcpy(state, DATA_START, DATA_SIZE);
+  memcpy((char *)state + DATA_SIZE, BSS_START, BSS_SIZE);
+}
+
+static void
+load(const void *state)
+{
+  memcpy(DATA_START, state, DATA_SIZE);
+  memcpy(BSS_START, (const char *)state + DATA_SIZE, BSS_SIZE);
+}
+
+static void
+send_hook(void *c, const linkaddr_t *to, int is_broadcast)
+{
+  sim_send(is_broadcast ? 0 : to->u8[0], packetbuf_dataptr(), packetbuf_datalen(),
+    is_broadcast ? 0 : ((struct runicast_conn *)c)->max_rxmit);
+}
+
+static void
+boot(int id, unsigned short seed)
+{
+  linkaddr_node_addr.u8[0] = id;
+  random_init(seed);
+  shim_send_hook = send_hook;
+  shim_autostart(autostart_processes);
+}
+
+static int
+run(unsigned long clock, unsigned long *next)
+{
+  clock_time_t t;
+
+  // The 16 bits clock of the node wraps, the simulator time does not
+  shim_clock = (clock_time_t)clock;
+  shim_run();
+  if(!shim_next_timer(&t))
+  {
+    return 0;
+  }
+  *next = clock + (clock_time_t)(t - shim_clock);
+  return 1;
+}
+
+static void
+receive_broadcast(int from, const char *data, int len, int rssi)
+{
+  linkaddr_t addr = { { (unsigned char)from, 0 } };
+
+  packetbuf_copyfrom(data, len);
+  packetbuf_set_attr(PACKETBUF_ATTR_RSSI, rssi);
+  if(broadcast.u != NULL && broadcast.u->recv != NULL)
+  {
+    broadcast.u->recv(&broadcast, &addr);
+  }
+}
+
+static void
+receive_runicast(int from, const char *data, int len, int seqno)
+{
+  linkaddr_t addr = { { (unsigned char)from, 0 } };
+
+  packetbuf_copyfrom(data, len);
+  if(runicast.u != NULL && runicast.u->recv != NULL)
+  {
+    runicast.u->recv(&runicast, &addr, seqno);
+  }
+}
+
+static void
+runicast_done(int to, int acked, int retransmissions)
+{
+  linkaddr_t addr = { { (unsigned char)to, 0 } };
+
+  shim_runicast_done(&runicast, &addr, acked, retransmissions);
+}
+
+static int
+parent(void)
+{
+#ifdef SIM_NO_PARENT
+  return linkaddr_node_addr.u8[0];
+#else
+  return not_connected ? 0 : parent_node.u8[0];
+#endif
+}
+
+static unsigned int
+runicast_dropped(void)
+{
+  return shim_runicast_dropped;
+}
+
+static int
+computation(void)
+{
+#ifdef SIM_COMPUTATION
+  return SIM_COMPUTATION;
+#else
+  return 0;
+#endif
+}
+
+const struct sim_role SIM_ROLE = {
+  SIM_FIRMWARE, state_size, save, load, boot, run,
+  receive_broadcast, receive_runicast, runicast_done, parent, runicast_dropped, computation
+};
@@ -0,0 +1,48 @@
+#ifndef TEST_H_
+#define TEST_H_
+
+#include <stdio.h>
+
+/*
+ * Minimal test runner of the host tests : a failed CHECK prints its line and
+ * the test goes on, the program returns the number of failures.
+ */
+
+static int test_failures = 0;
+static int test_checks = 0;
+
+#define CHECK(cond) \
+  do { \
+    test_checks++; \
+    if(!(cond)) { \
+      test_failures++; \
+      printf("%s:%d: CHECK failed : %s\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while(0)
+
+// Check the last packet sent (NUL terminated) and its recipient
+#define CHECK_SENT(recipient, message) \
+  do { \
+    CHECK(shim_last_sent() != NULL); \
+    if(shim_last_sent() != NULL) { \
+      CHECK(shim_last_sent()->to.u8[0] == (recipient)); \
+      CHECK(strcmp(shim_last_sent()->data, (message)) == 0); \
+    } \
+  } while(0)
+
+// Run a test, after the test_reset() of the test program
+#define RUN(test) \
+  do { \
+    int failures = test_failures; \
+    test_reset(); \
+    test(); \
+    printf("%-40s %s\n", #test, failures == test_failures ? "ok" : "FAILED"); \
+  } while(0)
+
+#define TEST_END() \
+  do { \
+    printf("%d checks, %d failures\n", test_checks, test_failures); \
+    return test_failures != 0; \
+  } while(0)
+
+#endif /* TEST_H_ */
@@ -0,0 +1,688 @@
+#include "../sky_computation.c"
+
+#include "test.h"
+#include <math.h>
+
+// Routes and children tables of the computation node (sky_computation.c)
+
+#define NODE_ID 1
+#define PARENT_ID 2
+
+static void
+test_reset(void)
+{
+  list_init(routes_list);
+  list_init(children_list);
+  memb_init(&routes_memb);
+  memb_init(&children_memb);
+  number_of_children = 0;
+  handback_pending = 0;
+  dedup_count = 0;
+  retx_count = 0;
+  retx_load = 0;
+  slots_count = 0;
+  slots_started = 0;
+  slots_parent = 0;
+  memset(group_queue, 0, sizeof(group_queue));
+  group_dropped = 0;
+  links_count = 0;
+  links_started = 0;
+  promote_count = 0;
+  promote_pending = 0;
+  promote_last = 0;
+  computation_role = 1; // The tests run the computation role, the single image starts as a relay
+  order_seqno = 20;
+  persist_dirty = 0;
+  shim_cfs_format();
+  shim_clear_sent();
+  shim_clock = 0;
+
+  linkaddr_node_addr.u8[0] = NODE_ID;
+  msg_id_to_addr(&parent_node, PARENT_ID);
+  not_connected = 0;
+  runicast_open(&runicast, 144, &runicast_callbacks);
+}
+
+static struct routes *
+add_route(int id, int is_child, int score_traffic, int hops)
+{
+  struct routes *route = memb_alloc(&routes_memb);
+
+  memset(&route->id, 0, ROUTE_RECORD_SIZE);
+  route->id = id;
+  route->is_child = is_child;
+  route->traffic = score_traffic;
+  route->hops = hops;
+  list_add(routes_list, route);
+  return route;
+}
+
+static struct children *
+add_child(int id)
+{
+  struct children *child = memb_alloc(&children_memb);
+
+  add_route(id, 0, 1, 0);
+  memset(&child->id, 0, CHILD_RECORD_SIZE);
+  child->id = id;
+  child->last_order = SEQNO_MAX;
+  list_add(children_list, child);
+  number_of_children++;
+  return child;
+}
+
+static struct routes *
+find_route(int id)
+{
+  struct routes *route;
+
+  for(route = list_head(routes_list); route != NULL && route->id != id; route = list_item_next(route));
+  return route;
+}
+
+static struct children *
+find_child(int id)
+{
+  struct children *child;
+
+  for(child = list_head(children_list); child != NULL && child->id != id; child = list_item_next(child));
+  return child;
+}
+
+// The children and the routes agree : a route is a child (0) or a collecting
+// child (2) if and only if it has a slot, and number_of_children counts the slots
+static void
+check_tables(void)
+{
+  struct routes *route;
+  struct children *child;
+
+  CHECK(number_of_children == list_length(children_list));
+  CHECK(number_of_children <= MAX_CHILDREN);
+  CHECK(memb_numfree(&children_memb) == MAX_CHILDREN - number_of_children);
+  CHECK(memb_numfree(&routes_memb) == MAX_ROUTES - list_length(routes_list));
+  for(child = list_head(children_list); child != NULL; child = list_item_next(child))
+  {
+    route = find_route(child->id);
+    CHECK(route != NULL && route->is_child != 1);
+  }
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+  {
+    CHECK(route->is_child == 1 || find_child(route->id) != NULL);
+  }
+}
+
+// applied : seqno of the last order of this node executed by id (99 : none yet)
+static void
+receive_srv(int from, int id, int seqno, int air, int valve, int applied, const char *path)
+{
+  char message[PACKETBUF_SIZE];
+
+  snprintf(message, sizeof(message), "SRV%02d%03d%02d%d%03d%02d%s", air, id, seqno, valve,
+    applied == SEQNO_MAX - 1 ? ORIGIN_SERVER : linkaddr_node_addr.u8[0], applied, path);
+  shim_deliver_runicast(&runicast, from, message);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void
+test_get_slope(void)
+{
+  uint8_t flat[NUMBER_OF_SAVED_VALUES] = {30, 30, 30, 30, 30};
+  uint8_t rising[NUMBER_OF_SAVED_VALUES] = {20, 22, 24, 26, 28};
+  uint8_t falling[NUMBER_OF_SAVED_VALUES] = {28, 26, 24, 22, 20};
+
+  // -b/a of the least squares line a + b.x
+  CHECK(get_slope(flat) == 0.0f);
+  CHECK(fabsf(get_slope(rising) - (-2.0f / 18.0f)) < 1e-5f);
+  CHECK(fabsf(get_slope(falling) - (2.0f / 30.0f)) < 1e-5f);
+}
+
+static void
+test_valve_needed(void)
+{
+  struct children *child = add_child(10);
+  int i;
+
+#if DECISION_MODE == DECISION_FORECAST
+  // A rising slope is acted on before it crosses SLOPE_THRESHOLD (at 1.125)
+  for(i = 0 ; !valve_needed(child, i * 0.125f) ; i++);
+  CHECK(i < 9);
+
+  // A borderline slope neither opens a closed valve, nor closes an open one
+  child->forecast_ready = 0;
+  for(i = 0 ; i < 20 ; i++)
+  {
+    CHECK(!valve_needed(child, i % 2 ? 1.05f : 0.95f));
+  }
+  child->is_open = 1;
+  for(i = 0 ; i < 20 ; i++)
+  {
+    CHECK(valve_needed(child, i % 2 ? 1.05f : 0.95f));
+  }
+#else
+  for(i = 0 ; !valve_needed(child, i * 0.125f) ; i++);
+  CHECK(i == 9);
+  CHECK(!valve_needed(child, 0.95f) && valve_needed(child, 1.05f));
+#endif
+}
+
+static void
+test_remove_child_unknown(void)
+{
+  add_child(10);
+  add_route(11, 1, 5, 1);
+  remove_child(11);
+  remove_child(99);
+  CHECK(number_of_children == 1);
+  CHECK(find_child(10) != NULL);
+  CHECK(find_route(11)->is_child == 1);
+  check_tables();
+}
+
+static void
+test_remove_child_reuses_slot(void)
+{
+  struct children *child = add_child(10);
+
+  child->nvalues = NUMBER_OF_SAVED_VALUES;
+  child->is_open = 1;
+  add_route(11, 1, 2, 1);
+  add_route(12, 1, 9, 1);
+
+  // The best scored candidate (12) takes the slot, and collects data again
+  remove_child(10);
+  CHECK(number_of_children == 1);
+  CHECK(find_child(10) == NULL);
+  CHECK(find_child(12) == child);
+  CHECK(child->nvalues == 0 && child->is_open == 0 && child->handoff == 1);
+  CHECK(find_route(12)->is_child == 2);
+  CHECK(find_route(11)->is_child == 1);
+  CHECK(persist_dirty);
+}
+
+static void
+test_remove_child_frees_slot(void)
+{
+  add_child(10);
+  add_child(11);
+
+  remove_child(10);
+  CHECK(number_of_children == 1);
+  CHECK(find_child(10) == NULL && find_child(11) != NULL);
+  CHECK(memb_numfree(&children_memb) == MAX_CHILDREN - 1);
+
+  // Last child
+  remove_child(11);
+  CHECK(number_of_children == 0);
+  CHECK(list_head(children_list) == NULL);
+  CHECK(memb_numfree(&children_memb) == MAX_CHILDREN);
+}
+
+static void
+test_remove_child_far_candidate(void)
+{
+  add_child(10);
+
+  // Too far to be source routed by this node
+  add_route(11, 1, 15, MAX_CHILD_PATH_HOPS + 1);
+  remove_child(10);
+  CHECK(number_of_children == 0);
+  CHECK(find_route(11)->is_child == 1);
+}
+
+static void
+test_remove_old_routes_child_and_candidate(void)
+{
+  // The child and its only candidate stop at the same time, in both orders
+  add_child(10)->nvalues = 3;
+  add_route(11, 1, 5, 1);
+  find_route(10)->age = INACTIVE_MESSAGE;
+  find_route(11)->age = INACTIVE_MESSAGE;
+  remove_old_routes();
+  CHECK(list_head(routes_list) == NULL);
+  CHECK(number_of_children == 0);
+  check_tables();
+
+  test_reset();
+  add_route(11, 1, 5, 1);
+  add_child(10);
+  find_route(10)->age = INACTIVE_MESSAGE;
+  find_route(11)->age = INACTIVE_MESSAGE;
+  remove_old_routes();
+  CHECK(list_head(routes_list) == NULL);
+  CHECK(number_of_children == 0);
+  check_tables();
+}
+
+static void
+test_remove_old_routes_ages(void)
+{
+  add_child(10);
+  add_route(11, 1, 5, 1);
+  add_route(12, 1, 5, 1);
+  find_route(10)->age = INACTIVE_MESSAGE;
+  find_route(11)->age = INACTIVE_MESSAGE - 1;
+
+  // 10 is replaced by the best candidate still alive
+  remove_old_routes();
+  CHECK(find_route(10) == NULL);
+  CHECK(find_route(11)->age == INACTIVE_MESSAGE);
+  CHECK(find_route(12)->age == 1);
+  CHECK(number_of_children == 1);
+  check_tables();
+
+  remove_old_routes();
+  CHECK(find_route(11) == NULL);
+  CHECK(list_length(routes_list) == 1);
+  check_tables();
+
+  // Only the SRV age the routes, not the control messages
+  shim_deliver_runicast(&runicast, 12, "SUM0120");
+  shim_deliver_runicast(&runicast, 12, "GAK1201012");
+  CHECK(find_route(12)->age == 2);
+  receive_srv(13, 13, 0, 30, 0, 99, "");
+  CHECK(find_route(12)->age == 3);
+}
+
+// The reports go up to the parent, but not back to it (transient loop)
+static void
+test_uplink_loop(void)
+{
+  shim_deliver_runicast(&runicast, 12, "SUM0120");
+  CHECK_SENT(PARENT_ID, "SUM0120");
+  shim_clear_sent();
+  shim_deliver_runicast(&runicast, PARENT_ID, "SUM0120");
+  shim_deliver_runicast(&runicast, PARENT_ID, "LNK0120");
+  shim_deliver_runicast(&runicast, PARENT_ID, "HNDR00705000000000000000");
+  receive_srv(PARENT_ID, 50, 0, 30, 0, 99, "");
+  CHECK(shim_sent_count == 0);
+}
+
+static void
+test_srv_new_nodes(void)
+{
+  int i;
+
+  // The first MAX_CHILDREN nodes become collecting children, the next ones
+  // are not children : all are forwarded while the server decides them
+  for(i = 0 ; i < MAX_CHILDREN + 2 ; i++)
+  {
+    shim_clear_sent();
+    receive_srv(50 + i, 50 + i, 0, 30, 0, 99, "");
+    CHECK(find_route(50 + i)->is_child == (i >= MAX_CHILDREN ? 1 : 2));
+    CHECK(shim_sent_count == 1);
+  }
+  CHECK(number_of_children == MAX_CHILDREN);
+  check_tables();
+
+  // Forwarded with this node in its path
+  CHECK_SENT(PARENT_ID, "SRV3006100000099001");
+
+  // A retransmission is neither stored nor forwarded again
+  shim_clear_sent();
+  receive_srv(50, 50, 0, 30, 0, 99, "");
+  CHECK(find_child(50)->nvalues == 1);
+  receive_srv(61, 61, 0, 30, 0, 99, "");
+  CHECK(shim_sent_count == 0);
+}
+
+// A new child asks the server for its state, and decides at once with it
+static void
+test_srv_handoff(void)
+{
+  char state[PACKETBUF_SIZE];
+  struct children *child;
+
+  receive_srv(50, 50, 0, 30, 1, 99, "");
+  child = find_child(50);
+  CHECK(child != NULL && child->handoff == 1 && find_route(50)->is_child == 2);
+  shim_clear_sent();
+  send_handoff(&runicast);
+  CHECK(shim_sent_count == 1 && strncmp(shim_last_sent()->data, "HNDR001050", 10) == 0);
+
+  // The server opened the valve OPEN_TIME - 1 SRV ago, flat readings
+  snprintf(state, sizeof(state), "HNDS0010501%02d%d3030303030", OPEN_TIME - 1, NUMBER_OF_SAVED_VALUES);
+  shim_deliver_runicast(&runicast, PARENT_ID, state);
+  CHECK(child->is_open == 1 && child->nvalues == NUMBER_OF_SAVED_VALUES && child->handoff_wait == 0);
+  CHECK(find_route(50)->is_child == 0);
+
+  // The next SRV is decided here : open long enough, closed
+  shim_clear_sent();
+  receive_srv(50, 50, 1, 30, 1, 99, "");
+  CHECK_SENT(50, "COM00500012001");
+  CHECK(child->is_open == 0);
+  check_tables();
+}
+
+static void
+test_srv_missed_order(void)
+{
+  struct children *child = add_child(10);
+
+  child->is_open = 1;
+  child->last_order = 5;
+
+  // The child did not execute the order 5 : sent again, with a new seqno
+  receive_srv(7, 10, 3, 30, 0, 4, "007");
+  CHECK_SENT(7, "COM10100012003");
+  CHECK(child->last_order == 20);
+
+  // Executed, the valve state is right
+  shim_clear_sent();
+  receive_srv(7, 10, 4, 30, 1, 20, "007");
+  CHECK(shim_sent_count == 0);
+
+  // The last COM executed is the order 17 of the server, not the one of this
+  // node : the order 17 of this node was lost
+  child->is_open = 0;
+  child->last_order = 17;
+  shim_deliver_runicast(&runicast, 7, "SRV3001005100017007");
+  CHECK_SENT(7, "COM00100012105");
+  shim_clear_sent();
+
+  // Not asked to the server yet : nothing is known about the valve
+  child = add_child(11);
+  child->handoff = 1;
+  child->is_open = 1;
+  receive_srv(11, 11, 0, 30, 0, 99, "");
+  CHECK(shim_sent_count == 0);
+
+  // Asked, the state did not come back : the valve opened by the server is
+  // the one of the child, not a missed order to close it
+  child->is_open = 0;
+  send_handoff(&runicast);
+  CHECK(child->handoff == 0 && child->handoff_wait == 1);
+  shim_clear_sent();
+  receive_srv(11, 11, 1, 30, 1, 7, "");
+  CHECK(shim_sent_count == 0);
+  CHECK(child->is_open == 1 && child->handoff_wait == 0);
+
+  // Then a missed order is sent again
+  receive_srv(11, 11, 2, 30, 0, 7, "");
+  CHECK_SENT(11, "COM10110012202");
+}
+
+static void
+test_checkpoint(void)
+{
+  struct children *child;
+  int fd;
+
+  add_route(11, 1, 5, 3)->volatility = 7;
+  child = add_child(10);
+  child->nvalues = 2;
+  child->last_values[1] = 42;
+  child->is_open = 1;
+  child->last_order = 33;
+  child->path[0] = 7;
+  child->path_hops = 1;
+  save_state();
+  CHECK(!persist_dirty);
+
+  // Warm restart
+  list_init(routes_list);
+  list_init(children_list);
+  memb_init(&routes_memb);
+  memb_init(&children_memb);
+  number_of_children = 0;
+  not_connected = 1;
+  restore_state();
+  CHECK(!not_connected && parent_node.u8[0] == PARENT_ID);
+  CHECK(list_length(routes_list) == 2 && number_of_children == 1);
+  CHECK(find_route(11)->is_child == 1 && find_route(11)->hops == 3 && find_route(11)->volatility == 7);
+  child = find_child(10);
+  CHECK(child != NULL && child->nvalues == 2 && child->last_values[1] == 42);
+  CHECK(child->is_open == 1 && child->last_order == 33 && child->path[0] == 7);
+  check_tables();
+
+  // A checkpoint with a bad CRC is ignored
+  fd = cfs_open(persist_files[persist_generation % 2], CFS_READ | CFS_WRITE);
+  cfs_seek(fd, -1, CFS_SEEK_END);
+  cfs_write(fd, "x", 1);
+  cfs_close(fd);
+  list_init(routes_list);
+  list_init(children_list);
+  memb_init(&routes_memb);
+  memb_init(&children_memb);
+  number_of_children = 0;
+  restore_state();
+  CHECK(list_head(routes_list) == NULL && number_of_children == 0);
+}
+
+// Budget of the runicasts from the statistics of their link, backoff and
+// loss of the parent after consecutive timeouts
+static void
+test_retx(void)
+{
+  linkaddr_t good, bad;
+  int i;
+
+  msg_id_to_addr(&good, 30);
+  msg_id_to_addr(&bad, 31);
+  CHECK(retx_budget(&good) == RETX_DEFAULT);
+  for(i = 0 ; i < 8 ; i++)
+  {
+    retx_done(&good, 0, 0);
+    retx_done(&bad, 3, 0);
+  }
+  CHECK(retx_budget(&good) == RETX_MIN);
+  CHECK(retx_budget(&bad) == RETX_MAX);
+
+  // A busy runicast lowers the budgets
+  retx_load = 2 * RETX_LOAD_STEP;
+  CHECK(retx_budget(&bad) == RETX_MAX - 2);
+  CHECK(retx_budget(&good) == RETX_MIN);
+  retx_load = 0;
+
+  // The first timeout of the parent is only a backoff, the second one is a lost link
+  shim_runicast_done(&runicast, &parent_node, 0, RETX_DEFAULT);
+  CHECK(!not_connected && !retx_ready(&parent_node));
+  shim_clock += 2 * RETX_BACKOFF;
+  CHECK(retx_ready(&parent_node));
+  shim_runicast_done(&runicast, &parent_node, 0, RETX_DEFAULT);
+  CHECK(not_connected);
+
+  // Long after its last runicast, a link is not in backoff (the clock of the
+  // Sky/Z1 wraps after 512 s)
+  shim_clock += 300 * CLOCK_SECOND;
+  CHECK(retx_ready(&good) && retx_ready(&bad));
+}
+
+static void
+test_slots(void)
+{
+  // A new neighbor gets the first slot after the one of this node
+  receive_srv(50, 50, 0, 30, 0, 99, "");
+  CHECK(slots_step(&runicast) == 1);
+  CHECK(slots_step(&runicast) == 0);
+  CHECK_SENT(50, "SLT037");
+
+  // A forwarded SRV does not tell the phase of its sensor
+  receive_srv(50, 70, 0, 30, 0, 99, "");
+  CHECK(slots_step(&runicast) == 0);
+
+  // In its slot, then out of it SLOTS_MISSES times : told again
+  shim_clock = SLOTS_PERIOD + SLOTS_LENGTH;
+  CHECK(slots_received(&(linkaddr_t){{50}}, 50) == 0);
+  shim_clock = 2 * SLOTS_PERIOD + 5 * SLOTS_LENGTH;
+  CHECK(slots_received(&(linkaddr_t){{50}}, 50) == 0);
+  shim_clock = 3 * SLOTS_PERIOD + 5 * SLOTS_LENGTH;
+  CHECK(slots_received(&(linkaddr_t){{50}}, 50) == 1);
+  shim_clear_sent();
+  slots_step(&runicast);
+  CHECK_SENT(50, "SLT450");
+
+  // The child waits for the slot, or the same one of the next period
+  slots_follow(&parent_node, 10);
+  CHECK(slots_wait() == CLOCK_SECOND);
+  shim_clock += 2 * CLOCK_SECOND;
+  CHECK(slots_wait() == SLOTS_PERIOD - CLOCK_SECOND);
+}
+
+// The counters are sent to the parent once per LINKS_PERIOD, the first time
+// at a random time of the first period
+static void
+check_links_period(clock_time_t start)
+{
+  linkaddr_t to;
+  int i;
+
+  links_count = 0;
+  links_started = 0;
+  shim_clear_sent();
+  shim_clock = start;
+  msg_id_to_addr(&to, 7);
+  links_forwarded(LINKS_COM, &to, 1);
+  for(i = 0 ; i < LINKS_PERIOD / CLOCK_SECOND && !links_report(&runicast, &parent_node) ; i++)
+  {
+    shim_clock += CLOCK_SECOND;
+  }
+  CHECK(i < LINKS_PERIOD / CLOCK_SECOND);
+  CHECK_SENT(PARENT_ID, "LNK0011007000001000000");
+  CHECK(links_count == 0);
+
+  // Nothing during the period, then the next counters at its end
+  links_forwarded(LINKS_SRV, &parent_node, 1);
+  shim_clock += LINKS_PERIOD - 1;
+  CHECK(links_report(&runicast, &parent_node) == 0);
+  shim_clock += 1;
+  CHECK(links_report(&runicast, &parent_node) == 1);
+  CHECK_SENT(PARENT_ID, "LNK0011002001000000000");
+}
+
+// The clock of the Sky/Z1 wraps after 512 s, less than two LINKS_PERIOD :
+// the first period (just before the wrap), then the first or the second one
+// (half a period before) cross it
+static void
+test_links_report(void)
+{
+  check_links_period(0);
+  check_links_period((clock_time_t)-CLOCK_SECOND);
+  check_links_period((clock_time_t)-(LINKS_PERIOD / 2));
+}
+
+// A second group order received during the fan-out of the first one is
+// forwarded after it, and both are acknowledged
+static void
+test_group_queue(void)
+{
+  shim_deliver_runicast(&runicast, PARENT_ID, "GCM11201005121004");
+  shim_deliver_runicast(&runicast, PARENT_ID, "GCM11301006131004");
+  shim_clear_sent();
+  CHECK(group_step(&runicast, &parent_node) == 1);
+  CHECK_SENT(4, "GCM11201005120");
+  CHECK(group_step(&runicast, &parent_node) == 1);
+  CHECK_SENT(4, "GCM11301006130");
+  CHECK(group_dropped == 0);
+
+  shim_deliver_runicast(&runicast, 4, "GAK1201005");
+  shim_deliver_runicast(&runicast, 4, "GAK1301006");
+  shim_clock += 10 * CLOCK_SECOND;
+  CHECK(group_step(&runicast, &parent_node) == 1);
+  CHECK_SENT(PARENT_ID, "GAK1201005");
+  CHECK(group_step(&runicast, &parent_node) == 0);
+  CHECK_SENT(PARENT_ID, "GAK1301006");
+}
+
+// A full node asks the relay of the most nodes it cannot decide to decide them
+static void
+test_promotion(void)
+{
+  struct routes *route;
+  int i;
+
+  for(i = 0 ; i < MAX_CHILDREN ; i++)
+  {
+    add_child(10 + i);
+  }
+  for(i = 0 ; i < PROMOTE_MIN_SRV ; i++)
+  {
+    receive_srv(40, 60 + i % 4, i / 4, 30, 0, 99, "040");
+    receive_srv(41, 70, i, 30, 0, 99, "041");
+
+    // The children keep reporting too, their routes do not expire
+    for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+    {
+      route->age = 0;
+    }
+  }
+  receive_srv(41, 70, PROMOTE_MIN_SRV, 30, 0, 99, "041");
+  check_tables();
+
+  // 41 relays more SRV, but of one node only : 40 and 41 are both candidates,
+  // the busiest one is chosen
+  rebalance_children();
+  CHECK(promote_pending == 41);
+  shim_clear_sent();
+  CHECK(send_promotion(&runicast) == 1);
+  CHECK_SENT(41, "ROL1041");
+  CHECK(send_promotion(&runicast) == 0);
+
+  // Not asked twice in a row, and the counts start again each period
+  for(i = 0 ; i < PROMOTE_MIN_SRV ; i++)
+  {
+    receive_srv(41, 70, 30 + i, 30, 0, 99, "041");
+  }
+  rebalance_children();
+  CHECK(promote_pending == 0);
+}
+
+#if NODE_IMAGE
+// Role of the single image : a relay forwards every SRV, a demoted node gives
+// its children back, a promoted node without children goes back to relaying
+static void
+test_role(void)
+{
+  add_child(10);
+  shim_deliver_runicast(&runicast, PARENT_ID, "ROL0001");
+  CHECK(computation_role == 0 && persist_dirty);
+  shim_clear_sent();
+  send_handoff(&runicast);
+  CHECK(shim_sent_count == 1 && strncmp(shim_last_sent()->data, "HNDB001010", 10) == 0);
+  CHECK(number_of_children == 0);
+  check_tables();
+
+  shim_clear_sent();
+  receive_srv(50, 50, 3, 30, 0, 99, "");
+  CHECK_SENT(PARENT_ID, "SRV3005003000099001");
+  CHECK(list_head(routes_list) == NULL);
+
+  // A ROL for another node follows its source route
+  shim_deliver_runicast(&runicast, PARENT_ID, "ROL1050");
+  CHECK_SENT(50, "ROL1050");
+
+  shim_deliver_runicast(&runicast, PARENT_ID, "ROL1001");
+  CHECK(computation_role == 1);
+  shim_clock += REBALANCE_PERIOD;
+  rebalance_children();
+  CHECK(computation_role == 0);
+}
+#endif
+
+int
+main(void)
+{
+  RUN(test_get_slope);
+  RUN(test_valve_needed);
+  RUN(test_remove_child_unknown);
+  RUN(test_remove_child_reuses_slot);
+  RUN(test_remove_child_frees_slot);
+  RUN(test_remove_child_far_candidate);
+  RUN(test_remove_old_routes_child_and_candidate);
+  RUN(test_remove_old_routes_ages);
+  RUN(test_uplink_loop);
+  RUN(test_srv_new_nodes);
+  RUN(test_srv_handoff);
+  RUN(test_srv_missed_order);
+  RUN(test_checkpoint);
+  RUN(test_retx);
+  RUN(test_slots);
+  RUN(test_group_queue);
+  RUN(test_links_report);
+  RUN(test_promotion);
+#if NODE_IMAGE
+  RUN(test_role);
+#endif
+  TEST_END();
+}
@@ -0,0 +1,314 @@
+#include "contiki.h"
+#include "net/rime/rime.h"
+
+#include "node_log.h"
+#include "node_message.h"
+#include "node_dedup.h"
+
+#include "test.h"
+
+// Codec of the messages (node_message.h) and duplicate cache (node_dedup.h)
+
+static void
+test_reset(void)
+{
+  packetbuf_clear();
+  dedup_count = 0;
+  dedup_suppressed_srv = 0;
+  dedup_suppressed_com = 0;
+}
+
+static void
+set_packet(const char *message)
+{
+  packetbuf_copyfrom(message, strlen(message));
+}
+
+static int
+packet_is(const char *message)
+{
+  return packetbuf_datalen() == strlen(message)
+    && memcmp(packetbuf_dataptr(), message, packetbuf_datalen()) == 0;
+}
+
+static void
+test_srv(void)
+{
+  struct msg_srv srv;
+
+  msg_build_srv(50, 2, 7, 1, 9, 12);
+  CHECK(packet_is("SRV5000207100912"));
+  CHECK(msg_type() == MSG_SRV);
+
+  // The relays 7 then 4 record their id
+  CHECK(msg_srv_append_hop(7) == 0);
+  CHECK(msg_srv_append_hop(4) == 0);
+  CHECK(packet_is("SRV5000207100912007004"));
+  CHECK(msg_parse_srv(&srv) == 0);
+  CHECK(srv.air_quality == 50 && srv.id == 2 && srv.seqno == 7);
+  CHECK(srv.valve == 1 && srv.origin == 9 && srv.applied == 12);
+  CHECK(srv.path_hops == 2);
+  CHECK(msg_srv_hop(&srv, 0) == 7 && msg_srv_hop(&srv, 1) == 4);
+}
+
+static void
+test_srv_full_path(void)
+{
+  int i;
+
+  msg_build_srv(50, 2, 7, 0, ORIGIN_SERVER, 0);
+  for(i = 0 ; i < MAX_PATH_HOPS ; i++)
+  {
+    CHECK(msg_srv_append_hop(100 + i) == 0);
+  }
+  CHECK(msg_srv_append_hop(1) < 0);
+  CHECK(packetbuf_datalen() == SRV_LEN + MAX_PATH_HOPS * ID_SIZE);
+  CHECK(msg_type() == MSG_SRV);
+}
+
+static void
+test_srv_malformed(void)
+{
+  struct msg_srv srv;
+
+  // Too short, path not made of whole ids, not digits
+  set_packet("SRV50002071000");
+  CHECK(msg_type() == MSG_BAD);
+  CHECK(msg_parse_srv(&srv) < 0);
+  set_packet("SRV500020710001200");
+  CHECK(msg_type() == MSG_BAD);
+  set_packet("SRV5x00207100012");
+  CHECK(msg_parse_srv(&srv) < 0);
+  set_packet("SRV5000207100012a04");
+  CHECK(msg_parse_srv(&srv) < 0);
+  set_packet("XYZ5000207100012");
+  CHECK(msg_type() == MSG_BAD);
+  set_packet("SR");
+  CHECK(msg_type() == MSG_BAD);
+}
+
+static void
+test_com_source_route(void)
+{
+  struct msg_com com;
+
+  // Order for 5, behind the relays 7 then 4 (path of its SRV)
+  msg_build_com(1, 5, 9, 12, 7);
+  msg_com_append_hop(7);
+  msg_com_append_hop(4);
+  CHECK(packet_is("COM10050091207007004"));
+
+  // Each hop removes the last id of the route
+  CHECK(msg_parse_com(&com) == 0);
+  CHECK(com.order == 1 && com.id == 5 && com.origin == 9 && com.seqno == 12 && com.trace == 7);
+  CHECK(msg_com_next_hop(&com) == 4);
+  CHECK(packet_is("COM10050091207007"));
+  CHECK(msg_parse_com(&com) == 0);
+  CHECK(msg_com_next_hop(&com) == 7);
+  CHECK(packet_is("COM10050091207"));
+  CHECK(msg_parse_com(&com) == 0);
+  CHECK(msg_com_next_hop(&com) == 5);
+  CHECK(packet_is("COM10050091207"));
+
+  // Only open (1) and close (0) orders
+  set_packet("COM20050091207");
+  CHECK(msg_type() == MSG_COM);
+  CHECK(msg_parse_com(&com) < 0);
+}
+
+static void
+test_hnd(void)
+{
+  struct msg_hnd hnd;
+  const uint8_t values[HND_MAX_VALUES] = {12, 13, 14, 15, 16};
+
+  msg_build_hnd(HND_STATE, 7, 5, 1, 3, 5, values);
+  msg_hnd_append_hop(4);
+  CHECK(packet_is("HNDS00700510351213141516004"));
+  CHECK(msg_parse_hnd(&hnd) == 0);
+  CHECK(hnd.kind == HND_STATE && hnd.node == 7 && hnd.child == 5);
+  CHECK(hnd.open == 1 && hnd.timer == 3 && hnd.nvalues == 5);
+  CHECK(msg_hnd_value(&hnd, 0) == 12 && msg_hnd_value(&hnd, 4) == 16);
+  CHECK(msg_hnd_next_hop(&hnd) == 4);
+  CHECK(msg_parse_hnd(&hnd) == 0);
+  CHECK(msg_hnd_next_hop(&hnd) == 7);
+
+  // More values than a hand-off can carry
+  set_packet("HNDS00700510361213141516");
+  CHECK(msg_parse_hnd(&hnd) < 0);
+  set_packet("HNDX00700510351213141516");
+  CHECK(msg_parse_hnd(&hnd) < 0);
+}
+
+static void
+test_sum(void)
+{
+  int i;
+
+  msg_build_sum(7);
+  CHECK(msg_sum_add(5, 10, 20, 15, 12, 1, 5) == 0);
+  CHECK(packet_is("SUM0071005102015+012105"));
+  CHECK(msg_type() == MSG_SUM);
+
+  msg_build_sum(7);
+  for(i = 0 ; i < SUM_MAX_ENTRIES ; i++)
+  {
+    CHECK(msg_sum_add(i, 10, 20, 15, -3, 0, 1) == 0);
+  }
+  CHECK(msg_sum_add(9, 10, 20, 15, 0, 0, 1) < 0);
+  CHECK(msg_type() == MSG_SUM);
+}
+
+static void
+test_lnk(void)
+{
+  int i;
+
+  msg_build_lnk(4);
+  CHECK(msg_lnk_add(1, 40, 0, 3, 0) == 0);
+  CHECK(msg_lnk_add(5, 0, 2, 0, 1) == 0);
+  CHECK(packet_is("LNK0042001040000003000005000002000001"));
+  CHECK(msg_type() == MSG_LNK);
+
+  // The counters saturate, the entries are limited
+  msg_build_lnk(4);
+  CHECK(msg_lnk_add(1, 1500, 0, 0, 0) == 0);
+  CHECK(packet_is("LNK0041001999000000000"));
+  for(i = 1 ; i < LNK_MAX_ENTRIES ; i++)
+  {
+    CHECK(msg_lnk_add(i + 1, 1, 1, 1, 1) == 0);
+  }
+  CHECK(msg_lnk_add(9, 1, 1, 1, 1) < 0);
+  CHECK(msg_type() == MSG_LNK);
+}
+
+static void
+test_gcm(void)
+{
+  struct msg_gcm gcm;
+  struct msg_gcm_entry e;
+  const char *end;
+  int len;
+
+  // Order 1 for 5 and 6, both behind the relay 4
+  set_packet("GCM11202005121004006131004");
+  CHECK(msg_type() == MSG_GCM);
+  CHECK(msg_parse_gcm(&gcm) == 0);
+  CHECK(gcm.order == 1 && gcm.seqno == 12 && gcm.count == 2);
+  end = (const char *)packetbuf_dataptr() + packetbuf_datalen();
+  len = msg_gcm_entry(gcm.entries, end, &e);
+  CHECK(len == GCM_ENTRY_LEN + ID_SIZE);
+  CHECK(e.id == 5 && e.trace == 12 && e.nhops == 1);
+  len = msg_gcm_entry(gcm.entries + len, end, &e);
+  CHECK(e.id == 6 && e.trace == 13 && e.nhops == 1);
+
+  // Branch of 5, its route without the relay 4
+  msg_gcm_entry(gcm.entries, end, &e);
+  msg_build_gcm(1, 12);
+  msg_gcm_add(&e, e.nhops - 1);
+  CHECK(packet_is("GCM11201005120"));
+  CHECK(msg_parse_gcm(&gcm) == 0);
+
+  // Entries that do not match the count
+  set_packet("GCM112030051210040061310");
+  CHECK(msg_parse_gcm(&gcm) < 0);
+
+  // Only open (1) and close (0) orders
+  set_packet("GCM21201005121004");
+  CHECK(msg_parse_gcm(&gcm) < 0);
+}
+
+static void
+test_gak(void)
+{
+  struct msg_gak gak;
+
+  msg_build_gak(12);
+  msg_gak_add(5);
+  msg_gak_add(6);
+  CHECK(packet_is("GAK1202005006"));
+  CHECK(msg_parse_gak(&gak) == 0);
+  CHECK(gak.seqno == 12 && gak.count == 2);
+  CHECK(msg_read_num(gak.ids + ID_SIZE, ID_SIZE) == 6);
+  set_packet("GAK120300500");
+  CHECK(msg_type() == MSG_BAD);
+}
+
+static void
+test_slt(void)
+{
+  msg_build_slt(375);
+  CHECK(packet_is("SLT375"));
+  CHECK(msg_type() == MSG_SLT);
+  CHECK(msg_parse_slt() == 375);
+  set_packet("SLT37");
+  CHECK(msg_type() == MSG_BAD);
+  CHECK(msg_parse_slt() < 0);
+}
+
+static void
+test_rol(void)
+{
+  struct msg_rol rol;
+
+  msg_build_rol(ROL_COMPUTATION, 5);
+  CHECK(packet_is("ROL1005"));
+
+  // Promotion of 5 by the server, behind the relay 7
+  set_packet("ROL1005007");
+  CHECK(msg_type() == MSG_ROL);
+  CHECK(msg_parse_rol(&rol) == 0);
+  CHECK(rol.role == ROL_COMPUTATION && rol.id == 5 && rol.route_hops == 1);
+  CHECK(msg_rol_next_hop(&rol) == 7);
+  CHECK(packet_is("ROL1005"));
+  CHECK(msg_parse_rol(&rol) == 0);
+  CHECK(msg_rol_next_hop(&rol) == 5);
+
+  set_packet("ROL2005");
+  CHECK(msg_parse_rol(&rol) < 0);
+  set_packet("ROL10050");
+  CHECK(msg_type() == MSG_BAD);
+}
+
+static void
+test_dedup(void)
+{
+  int i;
+
+  CHECK(!dedup_is_duplicate(MSG_SRV, 5, 5, 7));
+  CHECK(dedup_is_duplicate(MSG_SRV, 5, 5, 7));
+  CHECK(!dedup_is_duplicate(MSG_COM, 5, ORIGIN_SERVER, 7));
+  CHECK(!dedup_is_duplicate(MSG_SRV, 6, 6, 7));
+  CHECK(dedup_suppressed_srv == 1 && dedup_suppressed_com == 0);
+
+  // Same seqno for the same node, from a computation node : another order
+  CHECK(!dedup_is_duplicate(MSG_COM, 5, 9, 7));
+
+  // (SRV, 5, 7) is the least recently seen after DEDUP_CACHE_SIZE - 1 others
+  CHECK(dedup_is_duplicate(MSG_COM, 5, ORIGIN_SERVER, 7));
+  CHECK(dedup_is_duplicate(MSG_COM, 5, 9, 7));
+  for(i = 0 ; i < DEDUP_CACHE_SIZE - 1 ; i++)
+  {
+    CHECK(!dedup_is_duplicate(MSG_SRV, 100 + i, 100 + i, 0));
+  }
+  CHECK(!dedup_is_duplicate(MSG_SRV, 5, 5, 7));
+  CHECK(dedup_count == DEDUP_CACHE_SIZE);
+}
+
+int
+main(void)
+{
+  RUN(test_srv);
+  RUN(test_srv_full_path);
+  RUN(test_srv_malformed);
+  RUN(test_com_source_route);
+  RUN(test_hnd);
+  RUN(test_sum);
+  RUN(test_lnk);
+  RUN(test_gcm);
+  RUN(test_gak);
+  RUN(test_slt);
+  RUN(test_rol);
+  RUN(test_dedup);
+  TEST_END();
+}
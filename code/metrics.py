@@ -0,0 +1,179 @@
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+import threading
+import time
+
+METRICS_PORT = 9100 # Local HTTP endpoint, GET /metrics
+DECISION_BUCKETS = (0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0) # Seconds
+LINK_COUNTERS = ("srv", "com", "rexmit", "drops") # Fields of a LNK entry
+LINKS_PERIOD = 300.0 # Seconds between two LNK of a node (LINKS_PERIOD of node_links.h)
+
+class Metrics:
+    # Telemetry of the server, in the Prometheus text format
+    # The main loop updates it, the HTTP thread reads it (hence the lock)
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.srv_received = 0
+        self.bad_messages = 0
+        self.duplicates = 0
+        self.com_sent = 0
+        self.com_dropped = 0 # No path or no border to reach the sensor
+        self.orders_decided = 0 # Orders decided by the last tick
+        self.gcm_sent = 0
+        self.group_acked = 0 # Targets of a GCM that acknowledged it
+        self.group_retried = 0 # Targets of a GCM ordered again by a COM
+        self.com_missed = 0 # Orders reported as not executed by the SRV, sent again
+        self.open_valves = 0
+        self.ingest_rate = 0.0 # SRV per second during the last tick
+        self.last_seen = {} # sensor id -> time of its last SRV or summary
+        self.summaries = {} # sensor id -> last summary of its computation node
+        self.summarized_samples = 0
+        self.link_totals = {} # (node id, neighbor id) -> counters of the link since the start
+        self.link_load = {} # (node id, neighbor id) -> frames per minute during its last report
+        self.decision_buckets = [0] * len(DECISION_BUCKETS)
+        self.decision_count = 0
+        self.decision_sum = 0.0
+        self.tick_srv = 0
+        self.tick_start = time.time()
+
+    def srv(self, sensor_id, now):
+        with self.lock:
+            self.srv_received += 1
+            self.tick_srv += 1
+            self.last_seen[sensor_id] = now
+
+    def summary(self, entry, now):
+        # Sensor decided by a computation node, seen through its summaries
+        with self.lock:
+            self.summaries[entry["id"]] = entry
+            self.summarized_samples += entry["samples"]
+            self.last_seen[entry["id"]] = now
+
+    def forget_summary(self, sensor_id):
+        # Sensor given back to the server
+        with self.lock:
+            self.summaries.pop(sensor_id, None)
+
+    def links(self, node_id, entries):
+        # Traffic of the links of a node during one LINKS_PERIOD. The frames on
+        # the air (retransmissions included) give the load of the link.
+        with self.lock:
+            for entry in entries:
+                totals = self.link_totals.setdefault((node_id, entry["to"]), dict.fromkeys(LINK_COUNTERS, 0))
+                for counter in LINK_COUNTERS:
+                    totals[counter] += entry[counter]
+                self.link_load[(node_id, entry["to"])] = (entry["srv"] + entry["com"] + entry["rexmit"]) * 60 / LINKS_PERIOD
+
+    def bad_message(self):
+        with self.lock:
+            self.bad_messages += 1
+
+    def duplicate(self):
+        with self.lock:
+            self.duplicates += 1
+
+    def tick(self, now, latency, open_valves, decided):
+        # Called after each evaluation of the sensors
+        with self.lock:
+            for i, bound in enumerate(DECISION_BUCKETS):
+                if latency <= bound:
+                    self.decision_buckets[i] += 1
+            self.decision_count += 1
+            self.decision_sum += latency
+            self.open_valves = open_valves
+            self.orders_decided = decided
+            if now > self.tick_start:
+                self.ingest_rate = self.tick_srv / (now - self.tick_start)
+            self.tick_srv = 0
+            self.tick_start = now
+
+    def orders_sent(self, sent, dropped):
+        with self.lock:
+            self.com_sent += sent
+            self.com_dropped += dropped
+
+    def groups(self, sent=0, acked=0, retried=0):
+        with self.lock:
+            self.gcm_sent += sent
+            self.group_acked += acked
+            self.group_retried += retried
+
+    def orders_missed(self, count):
+        with self.lock:
+            self.com_missed += count
+
+    def render(self, now):
+        with self.lock:
+            lines = [
+                "# TYPE server_srv_received_total counter",
+                "server_srv_received_total {}".format(self.srv_received),
+                "# TYPE server_ingest_rate gauge",
+                "server_ingest_rate {:.3f}".format(self.ingest_rate),
+                "# TYPE server_bad_messages_total counter",
+                "server_bad_messages_total {}".format(self.bad_messages),
+                "# TYPE server_duplicates_total counter",
+                "server_duplicates_total {}".format(self.duplicates),
+                "# TYPE server_com_sent_total counter",
+                "server_com_sent_total {}".format(self.com_sent),
+                "# TYPE server_com_dropped_total counter",
+                "server_com_dropped_total {}".format(self.com_dropped),
+                "# TYPE server_com_missed_total counter",
+                "server_com_missed_total {}".format(self.com_missed),
+                "# TYPE server_gcm_sent_total counter",
+                "server_gcm_sent_total {}".format(self.gcm_sent),
+                "# TYPE server_group_acked_total counter",
+                "server_group_acked_total {}".format(self.group_acked),
+                "# TYPE server_group_retried_total counter",
+                "server_group_retried_total {}".format(self.group_retried),
+                "# TYPE server_orders_decided gauge",
+                "server_orders_decided {}".format(self.orders_decided),
+                "# TYPE server_summarized_samples_total counter",
+                "server_summarized_samples_total {}".format(self.summarized_samples),
+                "# TYPE server_open_valves gauge",
+                "server_open_valves {}".format(self.open_valves + sum(e["open"] for e in self.summaries.values())),
+                "# TYPE server_decision_seconds histogram",
+            ]
+            for bound, count in zip(DECISION_BUCKETS, self.decision_buckets):
+                lines.append('server_decision_seconds_bucket{{le="{}"}} {}'.format(bound, count))
+            lines.append('server_decision_seconds_bucket{{le="+Inf"}} {}'.format(self.decision_count))
+            lines.append("server_decision_seconds_sum {:.6f}".format(self.decision_sum))
+            lines.append("server_decision_seconds_count {}".format(self.decision_count))
+            # A stale sensor has a growing age
+            lines.append("# TYPE server_sensor_last_seen_seconds gauge")
+            for sensor_id, seen in sorted(self.last_seen.items()):
+                lines.append('server_sensor_last_seen_seconds{{sensor="{}"}} {:.1f}'.format(sensor_id, now - seen))
+            # Fleet view of the sensors decided by the computation nodes
+            for name, field in (("mean", "mean"), ("min", "min"), ("max", "max"), ("slope", "slope"), ("valve_open", "open")):
+                lines.append("# TYPE server_summary_{} gauge".format(name))
+                for sensor_id, entry in sorted(self.summaries.items()):
+                    lines.append('server_summary_{}{{sensor="{}"}} {}'.format(name, sensor_id, int(entry[field]) if field == "open" else entry[field]))
+            # Load map of the links, from the LNK of the relays
+            lines.append("# TYPE server_link_frames_total counter")
+            for (node_id, neighbor_id), totals in sorted(self.link_totals.items()):
+                for counter in LINK_COUNTERS:
+                    lines.append('server_link_frames_total{{from="{}",to="{}",kind="{}"}} {}'.format(node_id, neighbor_id, counter, totals[counter]))
+            lines.append("# TYPE server_link_load_per_minute gauge")
+            for (node_id, neighbor_id), load in sorted(self.link_load.items()):
+                lines.append('server_link_load_per_minute{{from="{}",to="{}"}} {:.2f}'.format(node_id, neighbor_id, load))
+        return "\n".join(lines) + "\n"
+
+def start_metrics_server(metrics, port=METRICS_PORT):
+    # Serve the metrics from a background thread, the main loop is not blocked
+    class Handler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            if self.path != "/metrics":
+                self.send_error(404)
+                return
+            body = metrics.render(time.time()).encode('utf-8')
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain; version=0.0.4")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args): #No log line for every scrape
+            pass
+
+    httpd = ThreadingHTTPServer(('127.0.0.1', port), Handler)
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+    return httpd
@@ -0,0 +1,93 @@
+#ifndef NODE_DEDUP_H_
+#define NODE_DEDUP_H_
+
+#include "contiki.h"
+#include "node_message.h"
+
+#include <string.h>
+
+/*
+ * Duplicate suppression cache.
+ *
+ * When the ACK of a runicast is lost, the sender retransmits a message that
+ * was already received, and every relay would forward it again up to the
+ * server. SRV and COM messages carry a sequence number chosen by their origin
+ * (the sensor of a SRV, the server or the computation node of a COM), so a
+ * (type, node id, origin, seqno) that was seen recently is a duplicate.
+ *
+ * The cache is a small LRU : the most recent entry is the first one, and the
+ * least recently seen one is dropped when the cache is full.
+ * Include it only once per firmware (it holds the cache itself).
+ */
+
+// Number of (type, id, origin, seqno) remembered
+#ifndef DEDUP_CACHE_SIZE
+#define DEDUP_CACHE_SIZE 16
+#endif
+
+struct dedup_entry {
+  uint8_t type;
+  uint8_t id;
+  uint8_t origin;
+  uint8_t seqno;
+};
+
+static struct dedup_entry dedup_cache[DEDUP_CACHE_SIZE];
+static uint8_t dedup_count = 0;
+
+// Number of suppressed duplicates, per message type
+static uint16_t dedup_suppressed_srv = 0;
+static uint16_t dedup_suppressed_com = 0;
+
+// Returns 1 if (type, id, origin, seqno) was already seen, else remembers it and returns 0
+static inline int
+dedup_is_duplicate(enum msg_type type, uint8_t id, uint8_t origin, uint8_t seqno)
+{
+  struct dedup_entry entry;
+  uint8_t i;
+  int found = 0;
+
+  for(i = 0 ; i < dedup_count ; i++)
+  {
+    if(dedup_cache[i].type == type && dedup_cache[i].id == id
+      && dedup_cache[i].origin == origin && dedup_cache[i].seqno == seqno)
+    {
+      found = 1;
+      break;
+    }
+  }
+
+  if(found)
+  {
+    // Already seen, this entry becomes the most recent one
+    entry = dedup_cache[i];
+    if(type == MSG_SRV)
+    {
+      dedup_suppressed_srv++;
+    }
+    else
+    {
+      dedup_suppressed_com++;
+    }
+  }
+  else
+  {
+    // New entry, the oldest one is dropped if the cache is full
+    entry.type = type;
+    entry.id = id;
+    entry.origin = origin;
+    entry.seqno = seqno;
+    if(dedup_count < DEDUP_CACHE_SIZE)
+    {
+      dedup_count++;
+    }
+    i = dedup_count - 1;
+  }
+
+  memmove(&dedup_cache[1], &dedup_cache[0], i * sizeof(struct dedup_entry));
+  dedup_cache[0] = entry;
+
+  return found;
+}
+
+#endif /* NODE_DEDUP_H_ */
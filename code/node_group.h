@@ -0,0 +1,318 @@
+#ifndef NODE_GROUP_H_
+#define NODE_GROUP_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+#include "node_log.h"
+#include "node_message.h"
+#include "node_retx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Group orders (GCM) and their aggregated acknowledgements (GAK).
+ *
+ * A GCM carries the same order for several valves, each with its source
+ * route. A node keeps a copy of the GCM it received, and sends one GCM per
+ * next hop with only the entries of this branch : the message is duplicated
+ * at the branch points of the tree only.
+ *
+ * Every node that forwarded a GCM (or is one of its targets) collects the
+ * GAKs of its branches during a delay that grows with the depth of its
+ * subtree, and sends one GAK with all of them to its parent. The border
+ * gives it to the server, that orders again the valves that did not answer.
+ *
+ * The runicast can only send one message at a time, so the fan-out and the
+ * GAKs are sent out of the packet handlers by group_step(). GROUP_QUEUE_SIZE
+ * group orders can be in progress at the same time (the server sends the next
+ * one before the GAKs of the previous one), each with its own GAK.
+ * Include it only once per firmware (it holds the group state).
+ */
+
+// Unit of the delay before sending the aggregated GAK
+#ifndef GROUP_ACK_DELAY
+#define GROUP_ACK_DELAY (CLOCK_SECOND / 2)
+#endif
+
+// Period of group_step() while there is something to send
+#define GROUP_STEP_PERIOD (CLOCK_SECOND / 8)
+
+// Group orders in progress, the oldest first
+#ifndef GROUP_QUEUE_SIZE
+#define GROUP_QUEUE_SIZE 2
+#endif
+
+struct group_order {
+  // GCM being fanned out (copy of the received one), len = 0 if none, and
+  // its entries already sent
+  char buf[MSG_MAX_LEN];
+  uint8_t len;
+  uint16_t done;
+
+  // GAK being aggregated
+  uint8_t ack_pending;
+  uint8_t ack_seqno;
+  uint8_t ack_count;
+  uint8_t ack_ids[GCM_MAX_ENTRIES];
+  clock_time_t ack_deadline;
+};
+
+static struct group_order group_queue[GROUP_QUEUE_SIZE];
+
+// Group orders dropped because the queue was full (see STATS_COMMAND)
+static uint16_t group_dropped = 0;
+
+// Next hop of a GCM entry (last hop of its route, or the target itself)
+static inline int
+group_next_hop(const struct msg_gcm_entry *e)
+{
+  return e->nhops == 0 ? e->id : msg_read_num(e->route + (e->nhops - 1) * ID_SIZE, ID_SIZE);
+}
+
+// Add a node to the aggregated GAK of a group order
+static inline void
+group_ack(struct group_order *g, int id)
+{
+  uint8_t i;
+
+  for(i = 0 ; i < g->ack_count ; i++)
+  {
+    if(g->ack_ids[i] == id)
+    {
+      return;
+    }
+  }
+  if(g->ack_count < GCM_MAX_ENTRIES)
+  {
+    g->ack_ids[g->ack_count++] = id;
+  }
+}
+
+// Group order whose GAK is aggregated with this seqno, NULL if none
+static inline struct group_order *
+group_find(int seqno)
+{
+  uint8_t i;
+
+  for(i = 0 ; i < GROUP_QUEUE_SIZE ; i++)
+  {
+    if(group_queue[i].ack_pending && group_queue[i].ack_seqno == seqno)
+    {
+      return &group_queue[i];
+    }
+  }
+  return NULL;
+}
+
+// 1 while a group order has something left to send
+static inline int
+group_busy(void)
+{
+  uint8_t i;
+
+  for(i = 0 ; i < GROUP_QUEUE_SIZE ; i++)
+  {
+    if(group_queue[i].len != 0 || group_queue[i].ack_pending)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Handle the GCM in packetbuf (already parsed). The branches are sent later
+// by group_step(). Returns 1 if this node is one of the targets (its trace in
+// *trace), else 0.
+static inline int
+group_receive(const struct msg_gcm *gcm, int *trace)
+{
+  const char *end = (const char *)packetbuf_dataptr() + packetbuf_datalen();
+  const char *entry = gcm->entries;
+  struct group_order *g;
+  struct msg_gcm_entry e;
+  int i, len, depth = 0, target = 0;
+  uint16_t done = 0;
+
+  for(i = 0 ; i < gcm->count ; i++, entry += len)
+  {
+    // Checked by msg_parse_gcm
+    if((len = msg_gcm_entry(entry, end, &e)) < 0)
+    {
+      return 0;
+    }
+    if(e.id == linkaddr_node_addr.u8[0])
+    {
+      target = 1;
+      *trace = e.trace;
+      done |= 1U << i;
+    }
+    else if(e.nhops + 1 > depth)
+    {
+      depth = e.nhops + 1;
+    }
+  }
+
+  // Same group order again (another branch of a loop) : only the target counts
+  g = group_find(gcm->seqno);
+  if(g != NULL)
+  {
+    if(target)
+    {
+      group_ack(g, linkaddr_node_addr.u8[0]);
+    }
+    return target;
+  }
+
+  // A free place in the queue : a GCM that does not fit is not forwarded,
+  // the server orders its targets again with COMs when their GAK is missing
+  for(i = 0 ; i < GROUP_QUEUE_SIZE && g == NULL ; i++)
+  {
+    if(group_queue[i].len == 0 && !group_queue[i].ack_pending)
+    {
+      g = &group_queue[i];
+    }
+  }
+  if(g == NULL || packetbuf_datalen() > MSG_MAX_LEN)
+  {
+    group_dropped++;
+    LOG_WARN(ORDER, "[ORDER] Busy, group order %d not forwarded\n", gcm->seqno);
+    return target;
+  }
+
+  // Keep the GCM for the fan-out
+  if(depth > 0)
+  {
+    g->len = packetbuf_datalen();
+    memcpy(g->buf, packetbuf_dataptr(), g->len);
+    g->done = done;
+  }
+
+  // Aggregate the GAKs of the subtree, the deepest nodes send theirs first
+  g->ack_pending = 1;
+  g->ack_seqno = gcm->seqno;
+  g->ack_count = 0;
+  g->ack_deadline = clock_time() + GROUP_ACK_DELAY * (1 + 2 * depth);
+  if(target)
+  {
+    group_ack(g, linkaddr_node_addr.u8[0]);
+  }
+  return target;
+}
+
+// Handle the GAK in packetbuf : returns 1 if it is aggregated, 0 if it must
+// be forwarded as it is (not a group order forwarded by this node)
+static inline int
+group_receive_ack(const struct msg_gak *gak)
+{
+  struct group_order *g = group_find(gak->seqno);
+  int i;
+
+  if(g == NULL)
+  {
+    return 0;
+  }
+  for(i = 0 ; i < gak->count ; i++)
+  {
+    group_ack(g, msg_read_num(gak->ids + i * ID_SIZE, ID_SIZE));
+  }
+  return 1;
+}
+
+// Send the next branch of a GCM (the oldest first), or an aggregated GAK when
+// its delay is over (to the parent, or on the serial line if parent is NULL).
+// Returns 1 while there is something left to send.
+static inline int
+group_step(struct runicast_conn *c, const linkaddr_t *parent)
+{
+  struct group_order *g;
+  struct msg_gcm_entry e;
+  const char *end;
+  const char *entry;
+  linkaddr_t next_hop;
+  int i, len, hop = -1, count;
+  uint8_t j, k;
+
+  if(runicast_is_transmitting(c))
+  {
+    return 1;
+  }
+
+  for(k = 0 ; k < GROUP_QUEUE_SIZE ; k++)
+  {
+    g = &group_queue[k];
+    if(g->len == 0)
+    {
+      continue;
+    }
+    // One GCM with all the entries that have the same next hop
+    end = g->buf + g->len;
+    count = msg_read_num(g->buf + GCM_COUNT_OFFSET, COUNT_SIZE);
+    for(i = 0, entry = g->buf + GCM_LEN ; i < count ; i++, entry += len)
+    {
+      // Checked by msg_parse_gcm when it was queued, dropped if not
+      if((len = msg_gcm_entry(entry, end, &e)) < 0)
+      {
+        hop = -1;
+        break;
+      }
+      if(g->done & (1U << i))
+      {
+        continue;
+      }
+      if(hop < 0)
+      {
+        hop = group_next_hop(&e);
+        msg_build_gcm(msg_read_num(g->buf + GCM_ORDER_OFFSET, ORDER_SIZE),
+          msg_read_num(g->buf + GCM_SEQNO_OFFSET, SEQNO_SIZE));
+      }
+      if(group_next_hop(&e) == hop)
+      {
+        msg_gcm_add(&e, e.nhops > 0 ? e.nhops - 1 : 0);
+        g->done |= 1U << i;
+      }
+    }
+    if(hop < 0)
+    {
+      g->len = 0;
+      continue;
+    }
+    msg_id_to_addr(&next_hop, hop);
+    retx_send(c, &next_hop);
+    LOG_DBG(ORDER, "[ORDER] Group order %d forwarded to %d\n", msg_read_num(g->buf + GCM_SEQNO_OFFSET, SEQNO_SIZE), hop);
+    return 1;
+  }
+
+  for(k = 0 ; k < GROUP_QUEUE_SIZE ; k++)
+  {
+    g = &group_queue[k];
+    if(!g->ack_pending || CLOCK_LT(clock_time(), g->ack_deadline))
+    {
+      continue;
+    }
+    g->ack_pending = 0;
+    if(g->ack_count == 0)
+    {
+      continue;
+    }
+    msg_build_gak(g->ack_seqno);
+    for(j = 0 ; j < g->ack_count ; j++)
+    {
+      msg_gak_add(g->ack_ids[j]);
+    }
+    if(parent == NULL)
+    {
+      printf("%.*s\n", packetbuf_datalen(), (char *)packetbuf_dataptr());
+    }
+    else
+    {
+      retx_send(c, parent);
+    }
+    LOG_DBG(ORDER, "[ORDER] %d acknowledgements of the group order %d sent\n", g->ack_count, g->ack_seqno);
+    return group_busy();
+  }
+
+  return group_busy();
+}
+
+#endif /* NODE_GROUP_H_ */
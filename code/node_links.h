@@ -0,0 +1,202 @@
+#ifndef NODE_LINKS_H_
+#define NODE_LINKS_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+#include "lib/random.h"
+#include "node_message.h"
+#include "node_retx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Per-link traffic counters.
+ *
+ * Each node counts, for every neighbor it sends to, the SRV and COM it
+ * forwarded, the runicast retransmissions and the frames dropped (runicast
+ * busy, or no ACK after the last retransmission). Every LINKS_PERIOD, the
+ * counters of the period are sent to the parent in a LNK (only if something
+ * was sent), and they restart from 0. The relays forward the LNK as it is,
+ * and the server adds them up into a load map of the links : the nodes that
+ * relay the most are the ones that empty their battery first.
+ *
+ * The report is sent out of the packet handlers by links_report(), like the
+ * summaries and the group orders.
+ * Include it only once per firmware (it holds the counters).
+ */
+
+// Period of the reports
+#ifndef LINKS_PERIOD
+#define LINKS_PERIOD (5 * 60 * CLOCK_SECOND)
+#endif
+
+enum links_kind {
+  LINKS_SRV,
+  LINKS_COM
+};
+
+// Counters of a neighbor during the current period
+struct links_entry {
+  uint8_t id;
+  uint16_t srv;
+  uint16_t com;
+  uint16_t rexmit;
+  uint16_t drops;
+};
+
+// A node sends to its parent and to the next hops of the COMs : a LNK holds
+// all of them
+static struct links_entry links_table[LNK_MAX_ENTRIES];
+static uint8_t links_count = 0;
+
+// Start and length of the current period. The first one ends at a random
+// time, so the nodes that boot together do not report together.
+static clock_time_t links_last;
+static clock_time_t links_wait;
+static uint8_t links_started = 0;
+
+// Neighbors not counted because the table was full (since the boot)
+static uint16_t links_overflow = 0;
+
+// Counters of a neighbor, added if it is new. NULL if the table is full.
+static inline struct links_entry *
+links_find(const linkaddr_t *to)
+{
+  struct links_entry *entry;
+  uint8_t i;
+
+  for(i = 0 ; i < links_count ; i++)
+  {
+    if(links_table[i].id == to->u8[0])
+    {
+      return &links_table[i];
+    }
+  }
+  if(links_count == LNK_MAX_ENTRIES)
+  {
+    links_overflow++;
+    return NULL;
+  }
+  entry = &links_table[links_count++];
+  memset(entry, 0, sizeof(*entry));
+  entry->id = to->u8[0];
+  return entry;
+}
+
+static inline void
+links_add(uint16_t *counter, uint16_t n)
+{
+  *counter = *counter + n > LNK_COUNTER_MAX ? LNK_COUNTER_MAX : *counter + n;
+}
+
+// Count a message forwarded to a neighbor. sent : result of runicast_send,
+// 0 if the runicast was busy and the message is lost
+static inline void
+links_forwarded(enum links_kind kind, const linkaddr_t *to, int sent)
+{
+  struct links_entry *entry = links_find(to);
+
+  if(entry == NULL)
+  {
+    return;
+  }
+  if(!sent)
+  {
+    links_add(&entry->drops, 1);
+  }
+  else if(kind == LINKS_SRV)
+  {
+    links_add(&entry->srv, 1);
+  }
+  else
+  {
+    links_add(&entry->com, 1);
+  }
+}
+
+// Count the end of a runicast to a neighbor (from the sent and timedout
+// callbacks of the runicast)
+static inline void
+links_done(const linkaddr_t *to, uint8_t retransmissions, int timedout)
+{
+  struct links_entry *entry;
+
+  // Nothing to report for a link without any problem
+  if(retransmissions == 0 && !timedout)
+  {
+    return;
+  }
+  entry = links_find(to);
+  if(entry == NULL)
+  {
+    return;
+  }
+  links_add(&entry->rexmit, retransmissions);
+  if(timedout)
+  {
+    links_add(&entry->drops, 1);
+  }
+}
+
+// Send the counters of the period to the parent when it is over.
+// Called out of the packet handlers : packetbuf and the runicast must be free.
+// Returns 1 if sent. If the runicast refuses the LNK, the counters are kept
+// and the report is tried again at the next call.
+static inline int
+links_report(struct runicast_conn *c, const linkaddr_t *parent)
+{
+  uint8_t i;
+
+  if(!links_started)
+  {
+    links_last = clock_time();
+    links_wait = random_rand() % (LINKS_PERIOD / CLOCK_SECOND) * CLOCK_SECOND;
+    links_started = 1;
+  }
+  // (clock_time_t) : the difference wraps like the clock
+  if((clock_time_t)(clock_time() - links_last) < links_wait || runicast_is_transmitting(c) || !retx_ready(parent))
+  {
+    return 0;
+  }
+  if(links_count == 0)
+  {
+    links_last = clock_time();
+    links_wait = LINKS_PERIOD;
+    return 0;
+  }
+
+  msg_build_lnk(linkaddr_node_addr.u8[0]);
+  for(i = 0 ; i < links_count ; i++)
+  {
+    msg_lnk_add(links_table[i].id, links_table[i].srv, links_table[i].com,
+      links_table[i].rexmit, links_table[i].drops);
+  }
+  if(!retx_send(c, parent))
+  {
+    return 0;
+  }
+  links_last = clock_time();
+  links_wait = LINKS_PERIOD;
+  links_count = 0;
+  return 1;
+}
+
+// Counters of the current period (see STATS_COMMAND)
+static inline void
+links_dump(void)
+{
+  uint8_t i;
+
+  for(i = 0 ; i < links_count ; i++)
+  {
+    printf("[LINKS] To %d : %u SRV, %u COM forwarded, %u retransmissions, %u drops\n", links_table[i].id,
+      links_table[i].srv, links_table[i].com, links_table[i].rexmit, links_table[i].drops);
+  }
+  if(links_overflow > 0)
+  {
+    printf("[LINKS] %u neighbors not counted (table full)\n", links_overflow);
+  }
+}
+
+#endif /* NODE_LINKS_H_ */
@@ -0,0 +1,109 @@
+#ifndef NODE_LOG_H_
+#define NODE_LOG_H_
+
+#include "contiki.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Leveled logging shared by the three firmwares.
+ *
+ * Every log call names a module (SETUP, DATA, FWD, ROUTING, ORDER, SLOPE, TRACE)
+ * and a level. The level of each module is a compile-time constant, so a
+ * disabled call is a dead branch that the compiler removes together with its
+ * format string : no UART write and no ROM cost.
+ *
+ * Levels can be changed from the Makefile, for example :
+ *   CFLAGS += -DLOG_CONF_LEVEL=LOG_LEVEL_WARN -DLOG_LEVEL_ROUTING=LOG_LEVEL_DBG
+ */
+
+// Log levels, from the quietest to the most verbose
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERR  1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DBG  4
+
+// Default level of every module
+#ifndef LOG_CONF_LEVEL
+#define LOG_CONF_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Per module levels (default to LOG_CONF_LEVEL, except TRACE)
+#ifndef LOG_LEVEL_SETUP
+#define LOG_LEVEL_SETUP LOG_CONF_LEVEL
+#endif
+#ifndef LOG_LEVEL_DATA
+#define LOG_LEVEL_DATA LOG_CONF_LEVEL
+#endif
+#ifndef LOG_LEVEL_FWD
+#define LOG_LEVEL_FWD LOG_CONF_LEVEL
+#endif
+#ifndef LOG_LEVEL_ROUTING
+#define LOG_LEVEL_ROUTING LOG_CONF_LEVEL
+#endif
+#ifndef LOG_LEVEL_ORDER
+#define LOG_LEVEL_ORDER LOG_CONF_LEVEL
+#endif
+#ifndef LOG_LEVEL_SLOPE
+#define LOG_LEVEL_SLOPE LOG_CONF_LEVEL
+#endif
+// Tracing is off unless asked : -DLOG_LEVEL_TRACE=LOG_LEVEL_INFO
+#ifndef LOG_LEVEL_TRACE
+#define LOG_LEVEL_TRACE LOG_LEVEL_NONE
+#endif
+
+#define LOG_WITH_LEVEL(module, level, ...) \
+  do { \
+    if((level) <= LOG_LEVEL_##module) { \
+      printf(__VA_ARGS__); \
+    } \
+  } while(0)
+
+#define LOG_ERR(module, ...)  LOG_WITH_LEVEL(module, LOG_LEVEL_ERR, __VA_ARGS__)
+#define LOG_WARN(module, ...) LOG_WITH_LEVEL(module, LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(module, ...) LOG_WITH_LEVEL(module, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DBG(module, ...)  LOG_WITH_LEVEL(module, LOG_LEVEL_DBG, __VA_ARGS__)
+
+/*
+ * Latency tracing (see trace_latency.py).
+ * A SRV is traced by (origin id, seqno), and the COM it triggers carries this
+ * seqno as trace id. Every stage crossed by the SRV and the COM prints a line
+ * "[TRACE] stage origin trace node clock" ; the Cooja timestamps of these
+ * lines give the latency of each hop and of each stage.
+ */
+#define LOG_TRACE(stage, origin, trace) \
+  LOG_INFO(TRACE, "[TRACE] %s %d %d %d %lu\n", stage, origin, trace, \
+    linkaddr_node_addr.u8[0], (unsigned long)clock_time())
+
+/*
+ * On-demand route dump.
+ * Typing ROUTE_DUMP_COMMAND on the serial line of a node prints its routing
+ * table, at most once every ROUTE_DUMP_MIN_INTERVAL (printing a full table
+ * blocks the UART for a while).
+ */
+#define ROUTE_DUMP_COMMAND "routes"
+
+// Typing STATS_COMMAND prints the counters of the node
+#define STATS_COMMAND "stats"
+
+#ifndef ROUTE_DUMP_MIN_INTERVAL
+#define ROUTE_DUMP_MIN_INTERVAL (10 * CLOCK_SECOND)
+#endif
+
+// Returns 1 if a dump is allowed now (and remembers it), 0 if rate-limited
+static inline int
+route_dump_allowed(clock_time_t *last_dump)
+{
+  clock_time_t now = clock_time();
+
+  if(*last_dump != 0 && (clock_time_t)(now - *last_dump) < ROUTE_DUMP_MIN_INTERVAL)
+  {
+    return 0;
+  }
+  *last_dump = now;
+  return 1;
+}
+
+#endif /* NODE_LOG_H_ */
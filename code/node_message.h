@@ -0,0 +1,886 @@
+#ifndef NODE_MESSAGE_H_
+#define NODE_MESSAGE_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+
+#include <string.h>
+
+/*
+ * Codec of the radio messages (see message_structure.txt).
+ *
+ * Messages are parsed and built directly in packetbuf : nothing is copied to
+ * the stack, and a received message can be forwarded as it is (or after
+ * rewriting some fields in place) with runicast_send().
+ * The payload is not NUL-terminated, every access is checked against
+ * packetbuf_datalen().
+ */
+
+// Size of the Rime ID in the messages
+#define ID_SIZE 3
+
+// Size of the other fields
+#define TYPE_SIZE 3
+#define AIR_QUALITY_SIZE 2
+#define ORDER_SIZE 1
+#define SEQNO_SIZE 2
+#define LOAD_SIZE 2
+#define KIND_SIZE 1
+#define TIMER_SIZE 2
+#define NVALUES_SIZE 1
+
+// Load of a border, in SRV per LOAD_PERIOD (saturates at LOAD_MAX)
+#define LOAD_MAX 99
+
+// Sequence numbers wrap at SEQNO_MAX (SEQNO_SIZE digits)
+#define SEQNO_MAX 100
+
+// Origin of the orders decided by the server (the nodes have ids from 1)
+#define ORIGIN_SERVER 0
+
+// Max number of hops recorded in a SRV path / COM source route
+#define MAX_PATH_HOPS 16
+
+// NDA : "NDA"
+#define NDA_LEN TYPE_SIZE
+
+// NDR : "NDR[recipient][load]"
+// load : load of the border reached through the sender of the NDR
+#define NDR_ID_OFFSET TYPE_SIZE
+#define NDR_LOAD_OFFSET (NDR_ID_OFFSET + ID_SIZE)
+#define NDR_LEN (NDR_LOAD_OFFSET + LOAD_SIZE)
+
+// SRV : "SRV[air_quality][node_id][seqno][valve][origin][applied][path]"
+// valve : state of the valve of node_id (1 = open), origin and applied :
+// origin and seqno of the last COM it executed. The controllers use them to
+// resend the lost orders.
+// The path is empty when the sensor sends the SRV, every relay appends its id
+#define SRV_AIR_OFFSET TYPE_SIZE
+#define SRV_ID_OFFSET (SRV_AIR_OFFSET + AIR_QUALITY_SIZE)
+#define SRV_SEQNO_OFFSET (SRV_ID_OFFSET + ID_SIZE)
+#define SRV_VALVE_OFFSET (SRV_SEQNO_OFFSET + SEQNO_SIZE)
+#define SRV_ORIGIN_OFFSET (SRV_VALVE_OFFSET + ORDER_SIZE)
+#define SRV_APPLIED_OFFSET (SRV_ORIGIN_OFFSET + ID_SIZE)
+#define SRV_LEN (SRV_APPLIED_OFFSET + SEQNO_SIZE)
+
+// COM : "COM[order][node_id][origin][seqno][trace][source route]"
+// origin : id of the computation node that decided the order (ORIGIN_SERVER
+// for the server), each origin numbers its own orders : the duplicates and
+// the executed orders are told apart by (origin, seqno)
+// trace : seqno of the SRV of node_id that triggered the order (latency tracing)
+// The source route is the path of a SRV of node_id : the next hop is always
+// the last id, and it is removed before sending. Empty route = direct child.
+#define COM_ORDER_OFFSET TYPE_SIZE
+#define COM_ID_OFFSET (COM_ORDER_OFFSET + ORDER_SIZE)
+#define COM_ORIGIN_OFFSET (COM_ID_OFFSET + ID_SIZE)
+#define COM_SEQNO_OFFSET (COM_ORIGIN_OFFSET + ID_SIZE)
+#define COM_TRACE_OFFSET (COM_SEQNO_OFFSET + SEQNO_SIZE)
+#define COM_LEN (COM_TRACE_OFFSET + SEQNO_SIZE)
+
+// HND : "HND[kind][node_id][child_id][open][timer][nvalues][values][path or source route]"
+// Hand-off of a child between the server and the computation node node_id :
+// its valve state, its timer (SRV since the opening) and its last readings
+// (nvalues used out of HND_MAX_VALUES, oldest first).
+// The uplink kinds record their path like a SRV, the downlink kind is source
+// routed like a COM.
+#define HND_REQUEST 'R' // Uplink : node_id adopts child_id, and asks for its state
+#define HND_BACK 'B'    // Uplink : node_id gives child_id back to the server, with its state
+#define HND_STATE 'S'   // Downlink : state of child_id, answer to a HND_REQUEST
+#define HND_MAX_VALUES 5
+#define HND_KIND_OFFSET TYPE_SIZE
+#define HND_NODE_OFFSET (HND_KIND_OFFSET + KIND_SIZE)
+#define HND_CHILD_OFFSET (HND_NODE_OFFSET + ID_SIZE)
+#define HND_OPEN_OFFSET (HND_CHILD_OFFSET + ID_SIZE)
+#define HND_TIMER_OFFSET (HND_OPEN_OFFSET + ORDER_SIZE)
+#define HND_NVALUES_OFFSET (HND_TIMER_OFFSET + TIMER_SIZE)
+#define HND_VALUES_OFFSET (HND_NVALUES_OFFSET + NVALUES_SIZE)
+#define HND_LEN (HND_VALUES_OFFSET + HND_MAX_VALUES * AIR_QUALITY_SIZE)
+
+// SUM : "SUM[node_id][count][entries]", entry : "[child_id][min][max][mean][slope][open][samples]"
+// Summary of the children of the computation node node_id, sent to the server
+// instead of their SRV. min / max / mean of the last readings, slope of the
+// decision * 100 ("+012" or "-150", saturates at 999), valve of the child, and
+// number of SRV of the child since the last summary.
+#define SUM_SLOPE_SIZE 4
+#define SUM_SAMPLES_SIZE 2
+#define SUM_MAX_ENTRIES 5
+#define SUM_NODE_OFFSET TYPE_SIZE
+#define SUM_COUNT_OFFSET (SUM_NODE_OFFSET + ID_SIZE)
+#define SUM_LEN (SUM_COUNT_OFFSET + NVALUES_SIZE)
+#define SUM_ENTRY_LEN (ID_SIZE + 3 * AIR_QUALITY_SIZE + SUM_SLOPE_SIZE + ORDER_SIZE + SUM_SAMPLES_SIZE)
+
+// GCM : "GCM[order][seqno][count][entries]", entry : "[node_id][trace][nhops][source route]"
+// Group order : the same order for count valves, sent down the tree in one
+// wave (see node_group.h). Each entry has its own source route (nhops ids, the
+// next hop is the last one), a node sends one GCM per next hop with the
+// entries of this branch only.
+#define COUNT_SIZE 2
+#define NHOPS_SIZE 1
+#define GCM_MAX_ENTRIES 16
+#define GCM_ORDER_OFFSET TYPE_SIZE
+#define GCM_SEQNO_OFFSET (GCM_ORDER_OFFSET + ORDER_SIZE)
+#define GCM_COUNT_OFFSET (GCM_SEQNO_OFFSET + SEQNO_SIZE)
+#define GCM_LEN (GCM_COUNT_OFFSET + COUNT_SIZE)
+#define GCM_ENTRY_LEN (ID_SIZE + SEQNO_SIZE + NHOPS_SIZE)
+
+// GAK : "GAK[seqno][count][node ids]"
+// Acknowledgement of the group order seqno by count nodes, aggregated on the
+// way up by the nodes that forwarded the GCM
+#define GAK_SEQNO_OFFSET TYPE_SIZE
+#define GAK_COUNT_OFFSET (GAK_SEQNO_OFFSET + SEQNO_SIZE)
+#define GAK_LEN (GAK_COUNT_OFFSET + COUNT_SIZE)
+
+// LNK : "LNK[node_id][count][entries]", entry : "[neighbor_id][srv][com][rexmit][drops]"
+// Traffic of node_id to each of its neighbors since its last LNK (see
+// node_links.h) : SRV and COM forwarded, runicast retransmissions, and frames
+// dropped. The counters saturate at LNK_COUNTER_MAX.
+#define LNK_COUNTER_SIZE 3
+#define LNK_COUNTER_MAX 999
+#define LNK_MAX_ENTRIES 5
+#define LNK_NODE_OFFSET TYPE_SIZE
+#define LNK_COUNT_OFFSET (LNK_NODE_OFFSET + ID_SIZE)
+#define LNK_LEN (LNK_COUNT_OFFSET + NVALUES_SIZE)
+#define LNK_ENTRY_LEN (ID_SIZE + 4 * LNK_COUNTER_SIZE)
+
+// SLT : "SLT[wait]"
+// Reporting slot given by a parent to a child (see node_slots.h) : the next
+// SRV of the child is due in wait tenths of a second, then every period
+#define SLT_WAIT_SIZE 3
+#define SLT_WAIT_OFFSET TYPE_SIZE
+#define SLT_LEN (SLT_WAIT_OFFSET + SLT_WAIT_SIZE)
+
+// ROL : "ROL[role][node_id][source route]"
+// Role of node_id, a node of the single image (see sky_node.c) : ROL_COMPUTATION
+// promotes it, ROL_RELAY demotes it (it gives its children back to the server).
+// Sent by the server or by a loaded computation node, source routed like a COM.
+#define ROL_RELAY 0
+#define ROL_COMPUTATION 1
+#define ROL_ROLE_OFFSET TYPE_SIZE
+#define ROL_ID_OFFSET (ROL_ROLE_OFFSET + ORDER_SIZE)
+#define ROL_LEN (ROL_ID_OFFSET + ID_SIZE)
+
+#define PATH_MAX_LEN (MAX_PATH_HOPS * ID_SIZE)
+
+// Longest message : the 127 bytes of a Sky/Z1 frame also carry the 802.15.4
+// header and CRC (11 bytes), the Rime channel and runicast attributes and the
+// ContikiMAC header, with a margin. The GCM of the server are cut to it, the
+// other messages fit by construction.
+#define MSG_MAX_LEN 90
+typedef char msg_max_len_check[(SRV_LEN + PATH_MAX_LEN <= MSG_MAX_LEN && HND_LEN + PATH_MAX_LEN <= MSG_MAX_LEN
+  && SUM_LEN + SUM_MAX_ENTRIES * SUM_ENTRY_LEN <= MSG_MAX_LEN
+  && LNK_LEN + LNK_MAX_ENTRIES * LNK_ENTRY_LEN <= MSG_MAX_LEN) ? 1 : -1];
+
+enum msg_type {
+  MSG_BAD = 0,
+  MSG_NDA,
+  MSG_NDR,
+  MSG_SRV,
+  MSG_COM,
+  MSG_HND,
+  MSG_SUM,
+  MSG_GCM,
+  MSG_GAK,
+  MSG_LNK,
+  MSG_SLT,
+  MSG_ROL
+};
+
+struct msg_ndr {
+  int recipient;
+  int load;
+};
+
+struct msg_srv {
+  int air_quality;
+  int id;
+  int seqno;
+  int valve;
+  int origin;
+  int applied;
+
+  // Recorded path (in packetbuf) and its number of hops
+  const char *path;
+  int path_hops;
+};
+
+struct msg_com {
+  int order;
+  int id;
+  int origin;
+  int seqno;
+  int trace;
+
+  // Number of hops left in the source route
+  int route_hops;
+};
+
+struct msg_rol {
+  int role;
+  int id;
+
+  // Number of hops left in the source route
+  int route_hops;
+};
+
+struct msg_hnd {
+  char kind;
+  int node;
+  int child;
+  int open;
+  int timer;
+  int nvalues;
+
+  // Readings (in packetbuf), see msg_hnd_value
+  const char *values;
+
+  // Number of hops of the path (uplink) or left in the source route (downlink)
+  int hops;
+};
+
+struct msg_gcm {
+  int order;
+  int seqno;
+  int count;
+
+  // Entries (in packetbuf), see msg_gcm_entry
+  const char *entries;
+};
+
+struct msg_gcm_entry {
+  int id;
+  int trace;
+  int nhops;
+
+  // Source route of the entry (nhops ids)
+  const char *route;
+};
+
+struct msg_gak {
+  int seqno;
+  int count;
+
+  // Acknowledged ids (in packetbuf)
+  const char *ids;
+};
+
+// Read a fixed width decimal field, returns -1 if it is not only digits
+static inline int
+msg_read_num(const char *field, int width)
+{
+  int value = 0;
+  int i;
+
+  for(i = 0 ; i < width ; i++)
+  {
+    if(field[i] < '0' || field[i] > '9')
+    {
+      return -1;
+    }
+    value = value * 10 + (field[i] - '0');
+  }
+  return value;
+}
+
+// Write a fixed width, zero padded, decimal field
+static inline void
+msg_write_num(char *field, int width, int value)
+{
+  int i;
+
+  for(i = width - 1 ; i >= 0 ; i--)
+  {
+    field[i] = '0' + value % 10;
+    value = value / 10;
+  }
+}
+
+// Checks the length of a message with a list of hops after its fixed part
+static inline int
+msg_hops_len_ok(uint16_t len, uint16_t fixed_len)
+{
+  return len >= fixed_len && len <= fixed_len + PATH_MAX_LEN
+    && (len - fixed_len) % ID_SIZE == 0;
+}
+
+// Checks that a list of hops is only made of digits
+static inline int
+msg_hops_ok(const char *hops, int nhops)
+{
+  int i;
+
+  for(i = 0 ; i < nhops ; i++)
+  {
+    if(msg_read_num(hops + i * ID_SIZE, ID_SIZE) < 0)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Type of the message in packetbuf, MSG_BAD if the length does not match
+static inline enum msg_type
+msg_type(void)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  if(len < TYPE_SIZE)
+  {
+    return MSG_BAD;
+  }
+  if(memcmp(buf, "SRV", TYPE_SIZE) == 0)
+  {
+    return msg_hops_len_ok(len, SRV_LEN) ? MSG_SRV : MSG_BAD;
+  }
+  if(memcmp(buf, "COM", TYPE_SIZE) == 0)
+  {
+    return msg_hops_len_ok(len, COM_LEN) ? MSG_COM : MSG_BAD;
+  }
+  if(memcmp(buf, "HND", TYPE_SIZE) == 0)
+  {
+    return msg_hops_len_ok(len, HND_LEN) ? MSG_HND : MSG_BAD;
+  }
+  if(memcmp(buf, "SUM", TYPE_SIZE) == 0)
+  {
+    return (len >= SUM_LEN && len <= SUM_LEN + SUM_MAX_ENTRIES * SUM_ENTRY_LEN
+      && (len - SUM_LEN) % SUM_ENTRY_LEN == 0) ? MSG_SUM : MSG_BAD;
+  }
+  if(memcmp(buf, "GCM", TYPE_SIZE) == 0)
+  {
+    return len >= GCM_LEN ? MSG_GCM : MSG_BAD;
+  }
+  if(memcmp(buf, "GAK", TYPE_SIZE) == 0)
+  {
+    return (len >= GAK_LEN && (len - GAK_LEN) % ID_SIZE == 0) ? MSG_GAK : MSG_BAD;
+  }
+  if(memcmp(buf, "LNK", TYPE_SIZE) == 0)
+  {
+    return (len >= LNK_LEN && len <= LNK_LEN + LNK_MAX_ENTRIES * LNK_ENTRY_LEN
+      && (len - LNK_LEN) % LNK_ENTRY_LEN == 0) ? MSG_LNK : MSG_BAD;
+  }
+  if(memcmp(buf, "NDA", TYPE_SIZE) == 0)
+  {
+    return len == NDA_LEN ? MSG_NDA : MSG_BAD;
+  }
+  if(memcmp(buf, "NDR", TYPE_SIZE) == 0)
+  {
+    return len == NDR_LEN ? MSG_NDR : MSG_BAD;
+  }
+  if(memcmp(buf, "SLT", TYPE_SIZE) == 0)
+  {
+    return len == SLT_LEN ? MSG_SLT : MSG_BAD;
+  }
+  if(memcmp(buf, "ROL", TYPE_SIZE) == 0)
+  {
+    return msg_hops_len_ok(len, ROL_LEN) ? MSG_ROL : MSG_BAD;
+  }
+  return MSG_BAD;
+}
+
+// Parse the SRV in packetbuf, returns 0 on success and -1 if malformed
+static inline int
+msg_parse_srv(struct msg_srv *srv)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  if(!msg_hops_len_ok(len, SRV_LEN))
+  {
+    return -1;
+  }
+  srv->path = buf + SRV_LEN;
+  srv->path_hops = (len - SRV_LEN) / ID_SIZE;
+  srv->air_quality = msg_read_num(buf + SRV_AIR_OFFSET, AIR_QUALITY_SIZE);
+  srv->id = msg_read_num(buf + SRV_ID_OFFSET, ID_SIZE);
+  srv->seqno = msg_read_num(buf + SRV_SEQNO_OFFSET, SEQNO_SIZE);
+  srv->valve = msg_read_num(buf + SRV_VALVE_OFFSET, ORDER_SIZE);
+  srv->origin = msg_read_num(buf + SRV_ORIGIN_OFFSET, ID_SIZE);
+  srv->applied = msg_read_num(buf + SRV_APPLIED_OFFSET, SEQNO_SIZE);
+  if(srv->air_quality < 0 || srv->id < 0 || srv->seqno < 0 || srv->valve < 0 || srv->origin < 0 || srv->applied < 0
+    || !msg_hops_ok(srv->path, srv->path_hops))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Parse the COM in packetbuf, returns 0 on success and -1 if malformed
+static inline int
+msg_parse_com(struct msg_com *com)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  if(!msg_hops_len_ok(len, COM_LEN))
+  {
+    return -1;
+  }
+  com->route_hops = (len - COM_LEN) / ID_SIZE;
+  com->order = msg_read_num(buf + COM_ORDER_OFFSET, ORDER_SIZE);
+  com->id = msg_read_num(buf + COM_ID_OFFSET, ID_SIZE);
+  com->origin = msg_read_num(buf + COM_ORIGIN_OFFSET, ID_SIZE);
+  com->seqno = msg_read_num(buf + COM_SEQNO_OFFSET, SEQNO_SIZE);
+  com->trace = msg_read_num(buf + COM_TRACE_OFFSET, SEQNO_SIZE);
+  if((com->order != 0 && com->order != 1) || com->id < 0 || com->origin < 0 || com->seqno < 0 || com->trace < 0
+    || !msg_hops_ok(buf + COM_LEN, com->route_hops))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Parse the HND in packetbuf, returns 0 on success and -1 if malformed
+static inline int
+msg_parse_hnd(struct msg_hnd *hnd)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+  int i;
+
+  if(!msg_hops_len_ok(len, HND_LEN))
+  {
+    return -1;
+  }
+  hnd->kind = buf[HND_KIND_OFFSET];
+  hnd->hops = (len - HND_LEN) / ID_SIZE;
+  hnd->node = msg_read_num(buf + HND_NODE_OFFSET, ID_SIZE);
+  hnd->child = msg_read_num(buf + HND_CHILD_OFFSET, ID_SIZE);
+  hnd->open = msg_read_num(buf + HND_OPEN_OFFSET, ORDER_SIZE);
+  hnd->timer = msg_read_num(buf + HND_TIMER_OFFSET, TIMER_SIZE);
+  hnd->nvalues = msg_read_num(buf + HND_NVALUES_OFFSET, NVALUES_SIZE);
+  hnd->values = buf + HND_VALUES_OFFSET;
+  if((hnd->kind != HND_REQUEST && hnd->kind != HND_BACK && hnd->kind != HND_STATE)
+    || hnd->node < 0 || hnd->child < 0 || hnd->open < 0 || hnd->timer < 0
+    || hnd->nvalues < 0 || hnd->nvalues > HND_MAX_VALUES
+    || !msg_hops_ok(buf + HND_LEN, hnd->hops))
+  {
+    return -1;
+  }
+  for(i = 0 ; i < HND_MAX_VALUES ; i++)
+  {
+    if(msg_read_num(hnd->values + i * AIR_QUALITY_SIZE, AIR_QUALITY_SIZE) < 0)
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Parse the ROL in packetbuf, returns 0 on success and -1 if malformed
+static inline int
+msg_parse_rol(struct msg_rol *rol)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  if(!msg_hops_len_ok(len, ROL_LEN))
+  {
+    return -1;
+  }
+  rol->route_hops = (len - ROL_LEN) / ID_SIZE;
+  rol->role = msg_read_num(buf + ROL_ROLE_OFFSET, ORDER_SIZE);
+  rol->id = msg_read_num(buf + ROL_ID_OFFSET, ID_SIZE);
+  if((rol->role != ROL_RELAY && rol->role != ROL_COMPUTATION) || rol->id < 0
+    || !msg_hops_ok(buf + ROL_LEN, rol->route_hops))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Reading i of a HND (oldest first), -1 if malformed
+static inline int
+msg_hnd_value(const struct msg_hnd *hnd, int i)
+{
+  return msg_read_num(hnd->values + i * AIR_QUALITY_SIZE, AIR_QUALITY_SIZE);
+}
+
+// Read the GCM entry at entry, returns its length or -1 if malformed
+static inline int
+msg_gcm_entry(const char *entry, const char *end, struct msg_gcm_entry *e)
+{
+  if(end - entry < GCM_ENTRY_LEN)
+  {
+    return -1;
+  }
+  e->id = msg_read_num(entry, ID_SIZE);
+  e->trace = msg_read_num(entry + ID_SIZE, SEQNO_SIZE);
+  e->nhops = msg_read_num(entry + ID_SIZE + SEQNO_SIZE, NHOPS_SIZE);
+  e->route = entry + GCM_ENTRY_LEN;
+  if(e->id < 0 || e->trace < 0 || e->nhops < 0
+    || end - e->route < e->nhops * ID_SIZE || !msg_hops_ok(e->route, e->nhops))
+  {
+    return -1;
+  }
+  return GCM_ENTRY_LEN + e->nhops * ID_SIZE;
+}
+
+// Parse the GCM in packetbuf (and all its entries), returns 0 on success and -1 if malformed
+static inline int
+msg_parse_gcm(struct msg_gcm *gcm)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  const char *end = buf + packetbuf_datalen();
+  const char *entry;
+  struct msg_gcm_entry e;
+  int i, len;
+
+  if(packetbuf_datalen() < GCM_LEN)
+  {
+    return -1;
+  }
+  gcm->order = msg_read_num(buf + GCM_ORDER_OFFSET, ORDER_SIZE);
+  gcm->seqno = msg_read_num(buf + GCM_SEQNO_OFFSET, SEQNO_SIZE);
+  gcm->count = msg_read_num(buf + GCM_COUNT_OFFSET, COUNT_SIZE);
+  gcm->entries = buf + GCM_LEN;
+  if((gcm->order != 0 && gcm->order != 1) || gcm->seqno < 0 || gcm->count < 0 || gcm->count > GCM_MAX_ENTRIES)
+  {
+    return -1;
+  }
+  for(i = 0, entry = gcm->entries ; i < gcm->count ; i++, entry += len)
+  {
+    if((len = msg_gcm_entry(entry, end, &e)) < 0)
+    {
+      return -1;
+    }
+  }
+  return entry == end ? 0 : -1;
+}
+
+// Parse the GAK in packetbuf, returns 0 on success and -1 if malformed
+static inline int
+msg_parse_gak(struct msg_gak *gak)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  if(len < GAK_LEN || (len - GAK_LEN) % ID_SIZE != 0)
+  {
+    return -1;
+  }
+  gak->seqno = msg_read_num(buf + GAK_SEQNO_OFFSET, SEQNO_SIZE);
+  gak->count = msg_read_num(buf + GAK_COUNT_OFFSET, COUNT_SIZE);
+  gak->ids = buf + GAK_LEN;
+  if(gak->seqno < 0 || gak->count != (len - GAK_LEN) / ID_SIZE || !msg_hops_ok(gak->ids, gak->count))
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Id of the hop i of the path of a SRV, -1 if malformed
+static inline int
+msg_srv_hop(const struct msg_srv *srv, int i)
+{
+  return msg_read_num(srv->path + i * ID_SIZE, ID_SIZE);
+}
+
+// Append a hop to the SRV path or COM route in packetbuf (in place)
+// Returns -1 if the list is already full
+static inline int
+msg_append_hop(uint16_t fixed_len, int id)
+{
+  uint16_t len = packetbuf_datalen();
+
+  if(len + ID_SIZE > fixed_len + PATH_MAX_LEN)
+  {
+    return -1;
+  }
+  msg_write_num((char *)packetbuf_dataptr() + len, ID_SIZE, id);
+  packetbuf_set_datalen(len + ID_SIZE);
+  return 0;
+}
+
+// Record this node in the path of the SRV in packetbuf, -1 if the path is full
+static inline int
+msg_srv_append_hop(int id)
+{
+  return msg_append_hop(SRV_LEN, id);
+}
+
+// Add a hop to the source route of the COM in packetbuf, -1 if the route is full
+static inline int
+msg_com_append_hop(int id)
+{
+  return msg_append_hop(COM_LEN, id);
+}
+
+// Next hop of a source routed message in packetbuf : the last hop of its
+// route, that is removed (in place), or the recipient itself when the route is empty
+static inline int
+msg_next_hop(int *route_hops, int recipient)
+{
+  uint16_t len = packetbuf_datalen();
+
+  if(*route_hops == 0)
+  {
+    return recipient;
+  }
+  (*route_hops)--;
+  packetbuf_set_datalen(len - ID_SIZE);
+  return msg_read_num((const char *)packetbuf_dataptr() + len - ID_SIZE, ID_SIZE);
+}
+
+// Next hop of the COM in packetbuf (see msg_next_hop)
+static inline int
+msg_com_next_hop(struct msg_com *com)
+{
+  return msg_next_hop(&com->route_hops, com->id);
+}
+
+// Next hop of the HND_STATE in packetbuf (see msg_next_hop)
+static inline int
+msg_hnd_next_hop(struct msg_hnd *hnd)
+{
+  return msg_next_hop(&hnd->hops, hnd->node);
+}
+
+// Next hop of the ROL in packetbuf (see msg_next_hop)
+static inline int
+msg_rol_next_hop(struct msg_rol *rol)
+{
+  return msg_next_hop(&rol->route_hops, rol->id);
+}
+
+// Record this node in the path of the uplink HND in packetbuf, -1 if the path is full
+static inline int
+msg_hnd_append_hop(int id)
+{
+  return msg_append_hop(HND_LEN, id);
+}
+
+// Rime address of a node id (the id is the first byte of the address)
+static inline void
+msg_id_to_addr(linkaddr_t *addr, int id)
+{
+  linkaddr_copy(addr, &linkaddr_null);
+  addr->u8[0] = id;
+}
+
+// Parse the NDR in packetbuf, returns 0 on success and -1 if malformed
+static inline int
+msg_parse_ndr(struct msg_ndr *ndr)
+{
+  const char *buf = (const char *)packetbuf_dataptr();
+
+  if(packetbuf_datalen() != NDR_LEN)
+  {
+    return -1;
+  }
+  ndr->recipient = msg_read_num(buf + NDR_ID_OFFSET, ID_SIZE);
+  ndr->load = msg_read_num(buf + NDR_LOAD_OFFSET, LOAD_SIZE);
+  return (ndr->recipient < 0 || ndr->load < 0) ? -1 : 0;
+}
+
+// Parse the SLT in packetbuf, returns its wait (tenths of a second) or -1 if malformed
+static inline int
+msg_parse_slt(void)
+{
+  if(packetbuf_datalen() != SLT_LEN)
+  {
+    return -1;
+  }
+  return msg_read_num((const char *)packetbuf_dataptr() + SLT_WAIT_OFFSET, SLT_WAIT_SIZE);
+}
+
+// Start a new message of len bytes in packetbuf, returns the payload
+static inline char *
+msg_new(const char *type, uint16_t len)
+{
+  char *buf;
+
+  packetbuf_clear();
+  buf = (char *)packetbuf_dataptr();
+  memcpy(buf, type, TYPE_SIZE);
+  packetbuf_set_datalen(len);
+  return buf;
+}
+
+static inline void
+msg_build_nda(void)
+{
+  msg_new("NDA", NDA_LEN);
+}
+
+static inline void
+msg_build_ndr(int recipient, int load)
+{
+  char *buf = msg_new("NDR", NDR_LEN);
+  msg_write_num(buf + NDR_ID_OFFSET, ID_SIZE, recipient);
+  msg_write_num(buf + NDR_LOAD_OFFSET, LOAD_SIZE, load > LOAD_MAX ? LOAD_MAX : load);
+}
+
+static inline void
+msg_build_slt(int wait)
+{
+  char *buf = msg_new("SLT", SLT_LEN);
+  msg_write_num(buf + SLT_WAIT_OFFSET, SLT_WAIT_SIZE, wait);
+}
+
+// Without source route : to a neighbor
+static inline void
+msg_build_rol(int role, int id)
+{
+  char *buf = msg_new("ROL", ROL_LEN);
+  msg_write_num(buf + ROL_ROLE_OFFSET, ORDER_SIZE, role);
+  msg_write_num(buf + ROL_ID_OFFSET, ID_SIZE, id);
+}
+
+static inline void
+msg_build_srv(int air_quality, int id, int seqno, int valve, int origin, int applied)
+{
+  char *buf = msg_new("SRV", SRV_LEN);
+  msg_write_num(buf + SRV_AIR_OFFSET, AIR_QUALITY_SIZE, air_quality);
+  msg_write_num(buf + SRV_ID_OFFSET, ID_SIZE, id);
+  msg_write_num(buf + SRV_SEQNO_OFFSET, SEQNO_SIZE, seqno);
+  msg_write_num(buf + SRV_VALVE_OFFSET, ORDER_SIZE, valve);
+  msg_write_num(buf + SRV_ORIGIN_OFFSET, ID_SIZE, origin);
+  msg_write_num(buf + SRV_APPLIED_OFFSET, SEQNO_SIZE, applied);
+}
+
+static inline void
+msg_build_com(int order, int id, int origin, int seqno, int trace)
+{
+  char *buf = msg_new("COM", COM_LEN);
+  msg_write_num(buf + COM_ORDER_OFFSET, ORDER_SIZE, order);
+  msg_write_num(buf + COM_ID_OFFSET, ID_SIZE, id);
+  msg_write_num(buf + COM_ORIGIN_OFFSET, ID_SIZE, origin);
+  msg_write_num(buf + COM_SEQNO_OFFSET, SEQNO_SIZE, seqno);
+  msg_write_num(buf + COM_TRACE_OFFSET, SEQNO_SIZE, trace);
+}
+
+// values : nvalues readings, oldest first (the unused ones are sent as 0)
+static inline void
+msg_build_hnd(char kind, int node, int child, int open, int timer, int nvalues, const uint8_t *values)
+{
+  char *buf = msg_new("HND", HND_LEN);
+  int i;
+
+  buf[HND_KIND_OFFSET] = kind;
+  msg_write_num(buf + HND_NODE_OFFSET, ID_SIZE, node);
+  msg_write_num(buf + HND_CHILD_OFFSET, ID_SIZE, child);
+  msg_write_num(buf + HND_OPEN_OFFSET, ORDER_SIZE, open);
+  msg_write_num(buf + HND_TIMER_OFFSET, TIMER_SIZE, timer);
+  msg_write_num(buf + HND_NVALUES_OFFSET, NVALUES_SIZE, nvalues);
+  for(i = 0 ; i < HND_MAX_VALUES ; i++)
+  {
+    msg_write_num(buf + HND_VALUES_OFFSET + i * AIR_QUALITY_SIZE, AIR_QUALITY_SIZE, i < nvalues ? values[i] : 0);
+  }
+}
+
+// Start a summary without entries (see msg_sum_add)
+static inline void
+msg_build_sum(int node)
+{
+  char *buf = msg_new("SUM", SUM_LEN);
+  msg_write_num(buf + SUM_NODE_OFFSET, ID_SIZE, node);
+  msg_write_num(buf + SUM_COUNT_OFFSET, NVALUES_SIZE, 0);
+}
+
+// Add the entry of a child to the summary in packetbuf, -1 if it is full
+static inline int
+msg_sum_add(int child, int min, int max, int mean, int slope, int open, int samples)
+{
+  char *buf = (char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+  int count = msg_read_num(buf + SUM_COUNT_OFFSET, NVALUES_SIZE);
+  char *entry = buf + len;
+
+  if(count >= SUM_MAX_ENTRIES)
+  {
+    return -1;
+  }
+  msg_write_num(entry, ID_SIZE, child);
+  msg_write_num(entry + ID_SIZE, AIR_QUALITY_SIZE, min);
+  msg_write_num(entry + ID_SIZE + AIR_QUALITY_SIZE, AIR_QUALITY_SIZE, max);
+  msg_write_num(entry + ID_SIZE + 2 * AIR_QUALITY_SIZE, AIR_QUALITY_SIZE, mean);
+  entry += ID_SIZE + 3 * AIR_QUALITY_SIZE;
+  entry[0] = slope < 0 ? '-' : '+';
+  slope = slope < 0 ? -slope : slope;
+  msg_write_num(entry + 1, SUM_SLOPE_SIZE - 1, slope > 999 ? 999 : slope);
+  msg_write_num(entry + SUM_SLOPE_SIZE, ORDER_SIZE, open);
+  msg_write_num(entry + SUM_SLOPE_SIZE + ORDER_SIZE, SUM_SAMPLES_SIZE, samples > 99 ? 99 : samples);
+  msg_write_num(buf + SUM_COUNT_OFFSET, NVALUES_SIZE, count + 1);
+  packetbuf_set_datalen(len + SUM_ENTRY_LEN);
+  return 0;
+}
+
+// Start a group order without entries (see msg_gcm_add)
+static inline void
+msg_build_gcm(int order, int seqno)
+{
+  char *buf = msg_new("GCM", GCM_LEN);
+  msg_write_num(buf + GCM_ORDER_OFFSET, ORDER_SIZE, order);
+  msg_write_num(buf + GCM_SEQNO_OFFSET, SEQNO_SIZE, seqno);
+  msg_write_num(buf + GCM_COUNT_OFFSET, COUNT_SIZE, 0);
+}
+
+// Add an entry to the group order in packetbuf, with the first nhops ids of route
+static inline void
+msg_gcm_add(const struct msg_gcm_entry *e, int nhops)
+{
+  char *buf = (char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  msg_write_num(buf + len, ID_SIZE, e->id);
+  msg_write_num(buf + len + ID_SIZE, SEQNO_SIZE, e->trace);
+  msg_write_num(buf + len + ID_SIZE + SEQNO_SIZE, NHOPS_SIZE, nhops);
+  memcpy(buf + len + GCM_ENTRY_LEN, e->route, nhops * ID_SIZE);
+  msg_write_num(buf + GCM_COUNT_OFFSET, COUNT_SIZE, msg_read_num(buf + GCM_COUNT_OFFSET, COUNT_SIZE) + 1);
+  packetbuf_set_datalen(len + GCM_ENTRY_LEN + nhops * ID_SIZE);
+}
+
+// Start a group acknowledgement without ids (see msg_gak_add)
+static inline void
+msg_build_gak(int seqno)
+{
+  char *buf = msg_new("GAK", GAK_LEN);
+  msg_write_num(buf + GAK_SEQNO_OFFSET, SEQNO_SIZE, seqno);
+  msg_write_num(buf + GAK_COUNT_OFFSET, COUNT_SIZE, 0);
+}
+
+static inline void
+msg_gak_add(int id)
+{
+  char *buf = (char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+
+  msg_write_num(buf + len, ID_SIZE, id);
+  msg_write_num(buf + GAK_COUNT_OFFSET, COUNT_SIZE, msg_read_num(buf + GAK_COUNT_OFFSET, COUNT_SIZE) + 1);
+  packetbuf_set_datalen(len + ID_SIZE);
+}
+
+// Start a link report without entries (see msg_lnk_add)
+static inline void
+msg_build_lnk(int node)
+{
+  char *buf = msg_new("LNK", LNK_LEN);
+  msg_write_num(buf + LNK_NODE_OFFSET, ID_SIZE, node);
+  msg_write_num(buf + LNK_COUNT_OFFSET, NVALUES_SIZE, 0);
+}
+
+// Add the counters of a link to the report in packetbuf, -1 if it is full
+static inline int
+msg_lnk_add(int neighbor, int srv, int com, int rexmit, int drops)
+{
+  char *buf = (char *)packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+  int count = msg_read_num(buf + LNK_COUNT_OFFSET, NVALUES_SIZE);
+  char *entry = buf + len;
+
+  if(count >= LNK_MAX_ENTRIES)
+  {
+    return -1;
+  }
+  msg_write_num(entry, ID_SIZE, neighbor);
+  msg_write_num(entry + ID_SIZE, LNK_COUNTER_SIZE, srv > LNK_COUNTER_MAX ? LNK_COUNTER_MAX : srv);
+  msg_write_num(entry + ID_SIZE + LNK_COUNTER_SIZE, LNK_COUNTER_SIZE, com > LNK_COUNTER_MAX ? LNK_COUNTER_MAX : com);
+  msg_write_num(entry + ID_SIZE + 2 * LNK_COUNTER_SIZE, LNK_COUNTER_SIZE, rexmit > LNK_COUNTER_MAX ? LNK_COUNTER_MAX : rexmit);
+  msg_write_num(entry + ID_SIZE + 3 * LNK_COUNTER_SIZE, LNK_COUNTER_SIZE, drops > LNK_COUNTER_MAX ? LNK_COUNTER_MAX : drops);
+  msg_write_num(buf + LNK_COUNT_OFFSET, NVALUES_SIZE, count + 1);
+  packetbuf_set_datalen(len + LNK_ENTRY_LEN);
+  return 0;
+}
+
+#endif /* NODE_MESSAGE_H_ */
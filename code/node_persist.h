@@ -0,0 +1,210 @@
+#ifndef NODE_PERSIST_H_
+#define NODE_PERSIST_H_
+
+#include "contiki.h"
+#include "cfs/cfs.h"
+#include "lib/crc16.h"
+
+#include <string.h>
+
+/*
+ * Checkpoint of the network state in the external flash (Coffee file system).
+ *
+ * After a reboot, a node reads its last checkpoint and uses it at once : it
+ * does not wait for a NDR to have a parent, nor for a SRV of each node to
+ * have its routes back. The restored state is validated lazily, by the
+ * traffic : a parent that does not ACK anymore is dropped by the runicast
+ * timeout, and a route that is not refreshed ages out as usual.
+ *
+ * Wear : a checkpoint is only written when the state changed (persist_dirty),
+ * and at most once every PERSIST_MIN_INTERVAL. The two files are written in
+ * turn : the new checkpoint is complete (with its CRC) before the old one is
+ * removed, so a reset during a write never loses both.
+ *
+ * A checkpoint is "header, records written by the firmware, CRC16".
+ * Include it only once per firmware (it holds the checkpoint state).
+ */
+
+#ifndef PERSIST_MIN_INTERVAL
+#define PERSIST_MIN_INTERVAL (5 * 60 * CLOCK_SECOND)
+#endif
+
+// Changed when the records of a firmware change, an old checkpoint is then ignored
+#ifndef PERSIST_VERSION
+#define PERSIST_VERSION 1
+#endif
+
+#define PERSIST_MAGIC 0x5E
+
+struct persist_header {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t generation;
+};
+
+static const char *persist_files[2] = {"state0", "state1"};
+
+// Generation of the last checkpoint, its file is persist_files[generation % 2]
+static uint8_t persist_generation = 0;
+
+// Set by the firmware when its state changed since the last checkpoint
+static uint8_t persist_dirty = 0;
+static clock_time_t persist_last = 0;
+
+// CRC of the checkpoint being written or read
+static unsigned short persist_crc;
+
+// Returns 1 if a checkpoint should be written now
+static inline int
+persist_due(void)
+{
+  return persist_dirty && (persist_last == 0 || (clock_time_t)(clock_time() - persist_last) >= PERSIST_MIN_INTERVAL);
+}
+
+// Write a record of the checkpoint, returns -1 on error
+static inline int
+persist_write(int fd, const void *data, int len)
+{
+  persist_crc = crc16_data((const unsigned char *)data, len, persist_crc);
+  return cfs_write(fd, data, len) == len ? 0 : -1;
+}
+
+// Read a record of the checkpoint, returns -1 on error
+static inline int
+persist_read(int fd, void *data, int len)
+{
+  if(cfs_read(fd, data, len) != len)
+  {
+    return -1;
+  }
+  persist_crc = crc16_data((const unsigned char *)data, len, persist_crc);
+  return 0;
+}
+
+// Start a new checkpoint, returns its file descriptor (-1 on error)
+static inline int
+persist_begin_write(void)
+{
+  struct persist_header header;
+  const char *file = persist_files[(persist_generation + 1) % 2];
+  int fd;
+
+  cfs_remove(file);
+  fd = cfs_open(file, CFS_WRITE);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  header.magic = PERSIST_MAGIC;
+  header.version = PERSIST_VERSION;
+  header.generation = (uint8_t)(persist_generation + 1);
+  persist_crc = 0;
+  if(persist_write(fd, &header, sizeof(header)) < 0)
+  {
+    cfs_close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// End the checkpoint (CRC), and remove the previous one. Returns -1 on error
+static inline int
+persist_end_write(int fd, int error)
+{
+  unsigned short crc = persist_crc;
+
+  if(!error && cfs_write(fd, &crc, sizeof(crc)) != sizeof(crc))
+  {
+    error = 1;
+  }
+  cfs_close(fd);
+  if(error)
+  {
+    // The previous checkpoint is still there
+    cfs_remove(persist_files[(persist_generation + 1) % 2]);
+    return -1;
+  }
+  persist_generation++;
+  cfs_remove(persist_files[(persist_generation + 1) % 2]);
+  persist_dirty = 0;
+  persist_last = clock_time();
+  return 0;
+}
+
+// Check the CRC of a checkpoint file, returns its generation or -1 if invalid
+static inline int
+persist_check(const char *file)
+{
+  struct persist_header header;
+  unsigned char chunk[16];
+  unsigned short crc;
+  int fd, len, n;
+
+  fd = cfs_open(file, CFS_READ);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  len = cfs_seek(fd, 0, CFS_SEEK_END) - sizeof(crc);
+  cfs_seek(fd, 0, CFS_SEEK_SET);
+  persist_crc = 0;
+  if(len < (int)sizeof(header) || persist_read(fd, &header, sizeof(header)) < 0
+    || header.magic != PERSIST_MAGIC || header.version != PERSIST_VERSION)
+  {
+    cfs_close(fd);
+    return -1;
+  }
+  for(len -= sizeof(header) ; len > 0 ; len -= n)
+  {
+    n = len < (int)sizeof(chunk) ? len : (int)sizeof(chunk);
+    if(persist_read(fd, chunk, n) < 0)
+    {
+      cfs_close(fd);
+      return -1;
+    }
+  }
+  n = cfs_read(fd, &crc, sizeof(crc));
+  cfs_close(fd);
+  return (n == sizeof(crc) && crc == persist_crc) ? header.generation : -1;
+}
+
+// Open the most recent valid checkpoint, positioned after its header
+// Returns its file descriptor, or -1 if there is none
+static inline int
+persist_begin_read(void)
+{
+  struct persist_header header;
+  int generation[2];
+  int i, fd;
+
+  generation[0] = persist_check(persist_files[0]);
+  generation[1] = persist_check(persist_files[1]);
+  if(generation[0] < 0 && generation[1] < 0)
+  {
+    return -1;
+  }
+  // The generation wraps, the newest is the one just after the other
+  if(generation[0] < 0 || generation[1] < 0)
+  {
+    i = generation[0] < 0 ? 1 : 0;
+  }
+  else
+  {
+    i = (uint8_t)(generation[1] - generation[0]) < 0x80 ? 1 : 0;
+  }
+  fd = cfs_open(persist_files[i], CFS_READ);
+  if(fd < 0)
+  {
+    return -1;
+  }
+  if(cfs_read(fd, &header, sizeof(header)) != sizeof(header))
+  {
+    cfs_close(fd);
+    return -1;
+  }
+  // The next checkpoint goes to the other file
+  persist_generation = header.generation;
+  return fd;
+}
+
+#endif /* NODE_PERSIST_H_ */
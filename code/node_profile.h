@@ -0,0 +1,159 @@
+#ifndef NODE_PROFILE_H_
+#define NODE_PROFILE_H_
+
+#include "contiki.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Cycle profiling of the packet handlers.
+ *
+ * The runicast ACKs are handled after the receive callback returns, so a slow
+ * handler delays them. Each profiled handler is timed with the rtimer (about
+ * 30 us per tick on the Sky and the Z1), and keeps its min / avg / max and a
+ * histogram in RAM. Typing PROFILE_COMMAND on the serial line prints them and
+ * starts a new measure.
+ *
+ * Disabled by default : the macros are empty, nothing is left in the firmware.
+ * Enable it from the Makefile :
+ *   CFLAGS += -DPROFILE_ENABLED=1
+ * Include it only once per firmware (it holds the counters).
+ */
+
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 0
+#endif
+
+#define PROFILE_COMMAND "profile"
+
+// Profiled handlers (not all of them exist on every node)
+enum profile_handler {
+  PROFILE_RECV_RUC,
+  PROFILE_RECV_BDCST,
+  PROFILE_GET_SLOPE,
+  PROFILE_SEND_ORDER,
+  PROFILE_HANDLERS
+};
+
+#if PROFILE_ENABLED
+
+#include "sys/rtimer.h"
+
+// Histogram : bucket i counts the durations under 2^(PROFILE_FIRST_BUCKET + i)
+// ticks, the last one the longer durations
+#define PROFILE_BUCKETS 8
+#ifndef PROFILE_FIRST_BUCKET
+#define PROFILE_FIRST_BUCKET 3
+#endif
+
+struct profile_counter {
+  rtimer_clock_t min;
+  rtimer_clock_t max;
+  uint32_t total;
+  uint16_t count;
+  uint16_t histogram[PROFILE_BUCKETS];
+};
+
+static struct profile_counter profile_counters[PROFILE_HANDLERS];
+
+static const char * const profile_names[PROFILE_HANDLERS] = {
+  "recv_ruc", "recv_bdcst", "get_slope", "send_order"
+};
+
+static inline void
+profile_record(enum profile_handler handler, rtimer_clock_t ticks)
+{
+  struct profile_counter *p = &profile_counters[handler];
+  uint8_t bucket = 0;
+
+  // The counters stop when count would wrap, the average stays right
+  if(p->count == 0xFFFF)
+  {
+    return;
+  }
+  if(p->count == 0 || ticks < p->min)
+  {
+    p->min = ticks;
+  }
+  if(ticks > p->max)
+  {
+    p->max = ticks;
+  }
+  p->total += ticks;
+  p->count++;
+  while(bucket < PROFILE_BUCKETS - 1 && ticks >= (1U << (PROFILE_FIRST_BUCKET + bucket)))
+  {
+    bucket++;
+  }
+  p->histogram[bucket]++;
+}
+
+// One line per handler called since the last dump, then the counters restart
+static inline void
+profile_dump(void)
+{
+  struct profile_counter *p;
+  uint8_t i, j;
+
+  for(i = 0 ; i < PROFILE_HANDLERS ; i++)
+  {
+    p = &profile_counters[i];
+    if(p->count == 0)
+    {
+      continue;
+    }
+    printf("[PROFILE] %s count %u min %u avg %lu max %u ticks (%lu/s), histogram",
+      profile_names[i], p->count, (unsigned)p->min, (unsigned long)(p->total / p->count),
+      (unsigned)p->max, (unsigned long)RTIMER_SECOND);
+    for(j = 0 ; j < PROFILE_BUCKETS ; j++)
+    {
+      printf(" %u", p->histogram[j]);
+    }
+    printf("\n");
+  }
+  memset(profile_counters, 0, sizeof(profile_counters));
+}
+
+// Time a function from its start (PROFILE_BEGIN, with the declarations) to a
+// PROFILE_END before its return
+#define PROFILE_BEGIN(handler) rtimer_clock_t profile_start_##handler = RTIMER_NOW()
+#define PROFILE_END(handler) profile_record(handler, RTIMER_NOW() - profile_start_##handler)
+
+// Time a call, for the functions that return in many places
+#define PROFILE_CALL(handler, call) \
+  do { \
+    rtimer_clock_t profile_start = RTIMER_NOW(); \
+    call; \
+    profile_record(handler, RTIMER_NOW() - profile_start); \
+  } while(0)
+
+// Receive callbacks : PROFILE_RUNICAST_RECV(handler, recv_ruc) defines a timed
+// wrapper, that the callbacks structure gives as PROFILED(recv_ruc)
+#define PROFILE_RUNICAST_RECV(handler, fn) \
+  static void \
+  profiled_##fn(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno) \
+  { \
+    PROFILE_CALL(handler, fn(c, from, seqno)); \
+  }
+#define PROFILE_BROADCAST_RECV(handler, fn) \
+  static void \
+  profiled_##fn(struct broadcast_conn *c, const linkaddr_t *from) \
+  { \
+    PROFILE_CALL(handler, fn(c, from)); \
+  }
+#define PROFILED(fn) profiled_##fn
+
+#else /* PROFILE_ENABLED */
+
+#define profile_dump()
+#define PROFILE_BEGIN(handler)
+#define PROFILE_END(handler)
+#define PROFILE_CALL(handler, call) call
+#define PROFILE_RUNICAST_RECV(handler, fn)
+#define PROFILE_BROADCAST_RECV(handler, fn)
+#define PROFILED(fn) fn
+
+#endif /* PROFILE_ENABLED */
+
+#endif /* NODE_PROFILE_H_ */
@@ -0,0 +1,248 @@
+#ifndef NODE_RETX_H_
+#define NODE_RETX_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+#include "lib/random.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Retransmission budget and backoff of the runicast, per neighbor.
+ *
+ * Each runicast gives the ETX of its link (transmissions per delivered frame,
+ * a timeout counts double). The budget of the next runicast to a neighbor
+ * follows it : RETX_MIN on a clean link, up to RETX_MAX on a lossy one, and
+ * RETX_DEFAULT (the old fixed value) for an unknown neighbor. When the
+ * runicast is often busy (the queue of this node is full), the budget is
+ * lowered : a long retransmission blocks the messages behind it.
+ *
+ * After a timeout, the neighbor is in backoff for a random time that doubles
+ * with each consecutive timeout : the periodic messages of the node wait for
+ * retx_ready(), so the nodes of a congested area do not all retry together.
+ * The link is only lost (parent search) after RETX_LOST_TIMEOUTS of them.
+ *
+ * retx_send() replaces runicast_send(), the sent and timedout callbacks of the
+ * runicast call retx_done().
+ * Include it only once per firmware (it holds the link table).
+ */
+
+// Budgets (retransmissions of a runicast)
+#define RETX_MIN 2
+#define RETX_DEFAULT 4
+#ifndef RETX_MAX
+#define RETX_MAX 6
+#endif
+
+// ETX in 1/RETX_ETX_ONE, moving average over about RETX_ETX_WEIGHT runicasts.
+// The budget grows by RETX_ETX_GAIN per expected transmission above 1.
+#define RETX_ETX_ONE 16
+#define RETX_ETX_WEIGHT 4
+#define RETX_ETX_GAIN 2
+
+// Queue load : runicasts refused (busy) during the last RETX_LOAD_PERIOD, the
+// budget is lowered by 1 per RETX_LOAD_STEP of them
+#define RETX_LOAD_PERIOD (60 * CLOCK_SECOND)
+#define RETX_LOAD_STEP 4
+
+// Backoff after a timeout : RETX_BACKOFF << (consecutive timeouts - 1), up to
+// RETX_BACKOFF_MAX_SHIFT, plus a random part of the same length
+#define RETX_BACKOFF (4 * CLOCK_SECOND)
+#define RETX_BACKOFF_MAX_SHIFT 3
+#ifndef RETX_LOST_TIMEOUTS
+#define RETX_LOST_TIMEOUTS 2
+#endif
+
+// Neighbors with statistics, the least recently used one is replaced
+#ifndef RETX_NEIGHBORS
+#define RETX_NEIGHBORS 4
+#endif
+
+struct retx_link {
+  uint8_t id;
+  uint8_t etx;
+  uint8_t timeouts;
+  // Backoff : its start and its length (0 if none), a time kept as a start
+  // and a length stays right after the wrap of the 16 bits clock
+  clock_time_t backoff_start;
+  clock_time_t backoff;
+  clock_time_t used;
+};
+
+static struct retx_link retx_links[RETX_NEIGHBORS];
+static uint8_t retx_count = 0;
+
+static uint16_t retx_refused = 0;
+static uint16_t retx_load = 0;
+static clock_time_t retx_load_start;
+
+// Distribution of the chosen budgets, and events (since the boot, see retx_dump)
+static uint16_t retx_budgets[RETX_MAX + 1];
+static uint16_t retx_backoffs = 0;
+static uint16_t retx_lost = 0;
+
+static inline struct retx_link *
+retx_find(const linkaddr_t *to)
+{
+  uint8_t i;
+
+  for(i = 0 ; i < retx_count ; i++)
+  {
+    if(retx_links[i].id == to->u8[0])
+    {
+      return &retx_links[i];
+    }
+  }
+  return NULL;
+}
+
+// Statistics of a neighbor, added (with no ETX yet) if it is new
+static inline struct retx_link *
+retx_add(const linkaddr_t *to)
+{
+  struct retx_link *link = retx_find(to);
+  uint8_t i;
+
+  if(link != NULL)
+  {
+    return link;
+  }
+  if(retx_count < RETX_NEIGHBORS)
+  {
+    link = &retx_links[retx_count++];
+  }
+  else
+  {
+    link = &retx_links[0];
+    for(i = 1 ; i < RETX_NEIGHBORS ; i++)
+    {
+      if(CLOCK_LT(retx_links[i].used, link->used))
+      {
+        link = &retx_links[i];
+      }
+    }
+  }
+  memset(link, 0, sizeof(*link));
+  link->id = to->u8[0];
+  return link;
+}
+
+static inline uint8_t
+retx_link_budget(const struct retx_link *link)
+{
+  int budget, congestion;
+
+  if(link == NULL || link->etx == 0)
+  {
+    budget = RETX_DEFAULT;
+  }
+  else
+  {
+    budget = RETX_MIN + (link->etx - RETX_ETX_ONE) * RETX_ETX_GAIN / RETX_ETX_ONE;
+    budget = budget > RETX_MAX ? RETX_MAX : budget;
+  }
+  congestion = retx_load / RETX_LOAD_STEP;
+  budget = budget - congestion < RETX_MIN ? RETX_MIN : budget - congestion;
+  return budget;
+}
+
+// Budget of the next runicast to a neighbor
+static inline uint8_t
+retx_budget(const linkaddr_t *to)
+{
+  return retx_link_budget(retx_find(to));
+}
+
+// runicast_send() with the budget of the neighbor. Returns its result.
+static inline int
+retx_send(struct runicast_conn *c, const linkaddr_t *to)
+{
+  uint8_t budget = retx_budget(to);
+  int sent;
+
+  if((clock_time_t)(clock_time() - retx_load_start) >= RETX_LOAD_PERIOD)
+  {
+    retx_load = retx_refused;
+    retx_refused = 0;
+    retx_load_start = clock_time();
+  }
+  sent = runicast_send(c, to, budget);
+  if(!sent)
+  {
+    retx_refused++;
+    return 0;
+  }
+  retx_add(to)->used = clock_time();
+  retx_budgets[budget]++;
+  return sent;
+}
+
+// End of a runicast (from the sent and timedout callbacks). Returns 1 if the
+// link is lost : RETX_LOST_TIMEOUTS consecutive timeouts.
+static inline int
+retx_done(const linkaddr_t *to, uint8_t retransmissions, int timedout)
+{
+  struct retx_link *link = retx_add(to);
+  uint16_t sample = (retransmissions + 1) * (timedout ? 2 : 1) * RETX_ETX_ONE;
+  clock_time_t backoff;
+
+  if(sample > 0xFF)
+  {
+    sample = 0xFF;
+  }
+  link->etx = link->etx == 0 ? sample : link->etx + ((int)sample - link->etx) / RETX_ETX_WEIGHT;
+  link->used = clock_time();
+  if(!timedout)
+  {
+    link->timeouts = 0;
+    link->backoff = 0;
+    return 0;
+  }
+
+  if(link->timeouts < 0xFF)
+  {
+    link->timeouts++;
+  }
+  backoff = RETX_BACKOFF << (link->timeouts - 1 < RETX_BACKOFF_MAX_SHIFT ? link->timeouts - 1 : RETX_BACKOFF_MAX_SHIFT);
+  link->backoff_start = clock_time();
+  link->backoff = backoff + random_rand() % backoff;
+  retx_backoffs++;
+  if(link->timeouts >= RETX_LOST_TIMEOUTS)
+  {
+    retx_lost++;
+    link->timeouts = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// 0 while a neighbor is in backoff : the periodic messages to it wait
+static inline int
+retx_ready(const linkaddr_t *to)
+{
+  struct retx_link *link = retx_find(to);
+
+  return link == NULL || (clock_time_t)(clock_time() - link->backoff_start) >= link->backoff;
+}
+
+// Budgets chosen since the boot (see STATS_COMMAND)
+static inline void
+retx_dump(void)
+{
+  uint8_t i;
+
+  printf("[RETX] Budgets :");
+  for(i = 0 ; i <= RETX_MAX ; i++)
+  {
+    printf(" %u:%u", i, retx_budgets[i]);
+  }
+  printf(", %u refused (busy) last period, %u backoffs, %u links lost\n", retx_load, retx_backoffs, retx_lost);
+  for(i = 0 ; i < retx_count ; i++)
+  {
+    printf("[RETX] To %d : ETX %u/%u, budget %u\n", retx_links[i].id, retx_links[i].etx, RETX_ETX_ONE,
+      retx_link_budget(&retx_links[i]));
+  }
+}
+
+#endif /* NODE_RETX_H_ */
@@ -0,0 +1,261 @@
+#ifndef NODE_SLOTS_H_
+#define NODE_SLOTS_H_
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+#include "node_message.h"
+#include "node_retx.h"
+
+#include <stdio.h>
+
+/*
+ * Reporting slots given by a parent to its children.
+ *
+ * The sensors report every SLOTS_PERIOD from a random start : the children of
+ * a parent end up sending together, and collide at it. A parent splits the
+ * period in SLOTS_COUNT slots. Slot 0 starts with its own SRV (any fixed time
+ * for a node without readings), and each child whose own SRV it receives gets
+ * one of the others : a SLT tells the child how long to wait for its slot,
+ * the child keeps the period from there. The readings of a subtree arrive one
+ * after the other, and a relay forwards the ones of its children right after
+ * its own. A child that reports out of its slot SLOTS_MISSES times in a row
+ * (clock drift, its parent changed its phase) is told again.
+ *
+ * Parent : slots_received() for each SRV, slots_own_report() at the start of
+ * each period, and slots_step() sends the SLTs out of the packet handlers.
+ * Child : slots_follow() for a SLT of its parent (its own children move with it), then slots_wait() is the
+ * time to its slot.
+ * Include it only once per firmware (it holds the slots table).
+ */
+
+#define SLOTS_PERIOD (60 * CLOCK_SECOND)
+#define SLOTS_COUNT 16
+#define SLOTS_LENGTH (SLOTS_PERIOD / SLOTS_COUNT)
+
+// A SRV out of its slot by more than SLOTS_TOLERANCE (a runicast retransmission is 1 s)
+#define SLOTS_TOLERANCE (SLOTS_LENGTH / 2)
+#define SLOTS_MISSES 2
+
+// A child silent during SLOTS_EXPIRE frees its slot
+#define SLOTS_EXPIRE (3 * SLOTS_PERIOD)
+
+// Period of slots_step() while there is something to send
+#define SLOTS_STEP_PERIOD (CLOCK_SECOND / 4)
+
+// One child per slot, the others keep their own phase
+#define SLOTS_CHILDREN (SLOTS_COUNT - 1)
+
+struct slots_child {
+  uint8_t id;
+  uint8_t slot : 4;
+  uint8_t misses : 2;
+  uint8_t pending : 1;
+  clock_time_t last;
+};
+
+static struct slots_child slots_children[SLOTS_CHILDREN];
+static uint8_t slots_count = 0;
+
+// Start of the current period of this node (its own slot)
+static clock_time_t slots_phase;
+static uint8_t slots_started = 0;
+
+// Time of the slot given by the parent (see slots_wait), and its id : a
+// parent is never a child, even if the routes loop for a while
+static clock_time_t slots_next;
+static uint8_t slots_parent = 0;
+
+// Counters since the boot (see slots_dump)
+static uint16_t slots_sent = 0;
+static uint16_t slots_resyncs = 0;
+static uint16_t slots_followed = 0;
+
+// Time since the start of the current period
+static inline clock_time_t
+slots_offset(void)
+{
+  if(!slots_started)
+  {
+    slots_phase = clock_time();
+    slots_started = 1;
+  }
+  while((clock_time_t)(clock_time() - slots_phase) >= SLOTS_PERIOD)
+  {
+    slots_phase += SLOTS_PERIOD;
+  }
+  return clock_time() - slots_phase;
+}
+
+// Start of a period of this node, when it sends (or would send) its own SRV
+static inline void
+slots_own_report(void)
+{
+  slots_phase = clock_time();
+  slots_started = 1;
+}
+
+// A SRV of the sensor id received from a neighbor : only the own SRV of a
+// child tell its phase. Returns 1 if a SLT must be sent (see slots_step).
+static inline int
+slots_received(const linkaddr_t *from, int id)
+{
+  struct slots_child *child = NULL, *free = NULL;
+  uint16_t used = 1;
+  clock_time_t offset;
+  int error;
+  uint8_t i;
+
+  if(id != from->u8[0] || id == slots_parent)
+  {
+    return 0;
+  }
+  offset = slots_offset();
+  for(i = 0 ; i < slots_count ; i++)
+  {
+    if(slots_children[i].id == id)
+    {
+      child = &slots_children[i];
+    }
+    else if((clock_time_t)(clock_time() - slots_children[i].last) >= SLOTS_EXPIRE)
+    {
+      free = &slots_children[i];
+    }
+    else
+    {
+      used |= 1 << slots_children[i].slot;
+    }
+  }
+
+  // New child : the first free slot
+  if(child == NULL)
+  {
+    if(free == NULL && slots_count < SLOTS_CHILDREN)
+    {
+      free = &slots_children[slots_count++];
+    }
+    if(free == NULL)
+    {
+      return 0;
+    }
+    child = free;
+    child->id = id;
+    for(child->slot = 1 ; used & (1 << child->slot) ; child->slot++);
+    child->misses = 0;
+    child->pending = 1;
+    child->last = clock_time();
+    return 1;
+  }
+
+  child->last = clock_time();
+  error = (int)offset - (int)(child->slot * SLOTS_LENGTH);
+  if(error > (int)(SLOTS_PERIOD / 2))
+  {
+    error -= SLOTS_PERIOD;
+  }
+  else if(error < -(int)(SLOTS_PERIOD / 2))
+  {
+    error += SLOTS_PERIOD;
+  }
+  if(error <= (int)SLOTS_TOLERANCE && error >= -(int)SLOTS_TOLERANCE)
+  {
+    child->misses = 0;
+  }
+  else if(++child->misses >= SLOTS_MISSES)
+  {
+    child->misses = 0;
+    child->pending = 1;
+    slots_resyncs++;
+  }
+  return child->pending;
+}
+
+// Send the next SLT to give, out of the packet handlers (packetbuf and the
+// runicast must be free). Returns 1 while some are left.
+static inline int
+slots_step(struct runicast_conn *c)
+{
+  struct slots_child *child = NULL;
+  clock_time_t wait;
+  linkaddr_t to;
+  uint8_t i;
+
+  for(i = 0 ; i < slots_count && child == NULL ; i++)
+  {
+    if(slots_children[i].pending)
+    {
+      child = &slots_children[i];
+    }
+  }
+  if(child == NULL)
+  {
+    return 0;
+  }
+  if(runicast_is_transmitting(c))
+  {
+    return 1;
+  }
+  wait = (child->slot * SLOTS_LENGTH + SLOTS_PERIOD - slots_offset()) % SLOTS_PERIOD;
+  msg_build_slt((uint32_t)wait * 10 / CLOCK_SECOND);
+  msg_id_to_addr(&to, child->id);
+  if(retx_send(c, &to))
+  {
+    child->pending = 0;
+    slots_sent++;
+  }
+  return 1;
+}
+
+// SLT of the parent : the slot of this node starts in wait tenths of a second.
+// Returns 1 if SLTs must be sent to its own children (see slots_step).
+static inline int
+slots_follow(const linkaddr_t *parent, int wait)
+{
+  uint8_t i;
+
+  // The parent was a child : its slot is free
+  slots_parent = parent->u8[0];
+  for(i = 0 ; i < slots_count ; i++)
+  {
+    if(slots_children[i].id == slots_parent)
+    {
+      slots_children[i] = slots_children[--slots_count];
+      break;
+    }
+  }
+
+  slots_next = clock_time() + (clock_time_t)((uint32_t)wait * CLOCK_SECOND / 10);
+  slots_followed++;
+
+  // The period of this node now ends at the slot, and the slots of its
+  // children move with it : they are all told again
+  slots_phase = slots_next - SLOTS_PERIOD;
+  slots_started = 1;
+  for(i = 0 ; i < slots_count ; i++)
+  {
+    slots_children[i].misses = 0;
+    slots_children[i].pending = 1;
+  }
+  return slots_count > 0;
+}
+
+// Time to the slot given by the parent (the same slot of the next period if
+// it is already over)
+static inline clock_time_t
+slots_wait(void)
+{
+  while(!CLOCK_LT(clock_time(), slots_next))
+  {
+    slots_next += SLOTS_PERIOD;
+  }
+  return slots_next - clock_time();
+}
+
+// Slots given and followed since the boot (see STATS_COMMAND)
+static inline void
+slots_dump(void)
+{
+  printf("[SLOTS] %u children with a slot, %u SLT sent, %u resyncs, %u slots followed\n",
+    slots_count, slots_sent, slots_resyncs, slots_followed);
+}
+
+#endif /* NODE_SLOTS_H_ */
@@ -0,0 +1,183 @@
+import decision
+from decision import SensorTable, decide
+from server import DEDUP_WINDOW, TICK_PERIOD, is_duplicate, parse_message
+from collections import deque
+from trace_latency import parse_time
+from multiprocessing import Pool
+import itertools
+import os
+import subprocess
+import sys
+import time
+
+# Replay of recorded SRV through the decisions, faster than real time, to tune
+# their parameters without waiting for live data
+#
+# Usage : python3 replay.py capture [--cooja] [--jobs N] [--alarm A] [server.NAME=v1,v2,...] [firmware.NAME=v1,v2,...]
+#   capture : "time [network] SRV..." per line, the file of "server.py --capture" or the -o
+#             file of the simulator (host/sim), or with --cooja a Cooja log (the SRV printed by the border)
+#   server.NAME : SLOPE_THRESHOLD, VALVE_OPENING_TIME or VALUE_LEN of decision.py, FORECAST (0 / 1)
+#   firmware.NAME : OPEN_TIME or SLOPE_THRESHOLD of sky_computation.c, DECISION_MODE (0 / 1),
+#                   replayed by host/replay_computation (make -C host replay)
+#
+# Every combination of the values of a side is a setting, replayed in its own
+# process (--jobs, all the CPUs by default). Without any parameter, both sides
+# are replayed with their defaults.
+# The server side decides every sensor like server.py, one evaluation per
+# TICK_PERIOD. The firmware side decides every sensor of a network like a
+# computation node that has all of them as children. The orders are supposed
+# executed at once. For each setting :
+#   orders : open / close orders sent
+#   open : valve-open time, in % of the time of the sensors (from their first SRV to the end)
+#   delay : reaction delay, from a reading at or above the alarm level with a closed valve
+#           to the opening of the valve (mean and max), missed : alarms still waiting at the end
+
+ALARM_LEVEL = 80 # Default alarm level of the reaction delay (air quality)
+SERVER_PARAMS = ("SLOPE_THRESHOLD", "VALVE_OPENING_TIME", "VALUE_LEN", "FORECAST")
+FIRMWARE_PARAMS = {"OPEN_TIME": "-o", "SLOPE_THRESHOLD": "-s", "DECISION_MODE": None} # -> option of the binary
+SERVER_DEFAULTS = {name: getattr(decision, name, 0) for name in SERVER_PARAMS}
+HOST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "host")
+
+records = [] # (time, network, SRV), sorted by time, given to each replay process
+
+def load_records(capture):
+    # Initializer of the replay processes : they do not inherit the records
+    # with the spawn and forkserver start methods
+    global records
+    records = capture
+
+def read_capture(path, cooja=False):
+    # SRV of a capture : list of (time, network, message), without the duplicates
+    # (a SRV received by two borders), like server.py
+    srv = []
+    seen = {}
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 2 or fields[-1][:3] != "SRV" or parse_message(fields[-1])[1] is None:
+                continue
+            try:
+                when = parse_time(fields[0]) if cooja else float(fields[0])
+                network = int(fields[1]) if len(fields) == 3 and not cooja else 0
+            except ValueError: #Log line
+                continue
+            _, target_id, seqno, *_ = parse_message(fields[-1])
+            if not is_duplicate(seen.setdefault((network, target_id), deque(maxlen=DEDUP_WINDOW)), seqno):
+                srv.append((when, network, fields[-1]))
+    srv.sort(key=lambda record: record[0])
+    return srv
+
+def parse_grid(args, side, params):
+    # "side.NAME=v1,v2" arguments -> list of settings (dict NAME -> value)
+    values = {}
+    for arg in args:
+        if arg.startswith(side + ".") and "=" in arg:
+            name, choices = arg[len(side) + 1:].split("=", 1)
+            if name not in params:
+                sys.exit("Unknown parameter {} (known : {})".format(arg, ", ".join(params)))
+            values[name] = [int(v) if v.lstrip("-").isdigit() else float(v) for v in choices.split(",")]
+    return [dict(zip(values, combination)) for combination in itertools.product(*values.values())]
+
+def replay_server(setting):
+    # Orders of decision.py : list of (time, (network, sensor), order)
+    for name in SERVER_PARAMS[:-1]:
+        setattr(decision, name, setting.get(name, SERVER_DEFAULTS[name]))
+    forecast = bool(setting.get("FORECAST", 0))
+    table = SensorTable()
+    orders = []
+    next_tick = records[0][0] + TICK_PERIOD
+    for when, network, message in records + [(records[-1][0] + TICK_PERIOD, None, None)]:
+        while next_tick <= when:
+            orders += [(next_tick, sensor, order) for sensor, order in decide(table, next_tick, forecast)[0]]
+            next_tick += TICK_PERIOD
+        if message is not None:
+            new_value, target_id = parse_message(message)[:2]
+            table.append((network, int(target_id)), new_value, when)
+    return orders
+
+def replay_firmware(setting):
+    # Orders of the computation node, one replay per network
+    binary = os.path.join(HOST_DIR, "replay_computation_forecast" if setting.get("DECISION_MODE") else "replay_computation")
+    args = [binary] + [arg for name, value in setting.items() if FIRMWARE_PARAMS[name] for arg in (FIRMWARE_PARAMS[name], str(value))]
+    orders = []
+    for network in sorted({record[1] for record in records}):
+        capture = "".join("{:.6f} {}\n".format(when, message) for when, net, message in records if net == network)
+        output = subprocess.run(args, input=capture, capture_output=True, text=True, check=True).stdout
+        for line in output.splitlines():
+            when, target_id, order = line.split()
+            orders.append((float(when), (network, int(target_id)), order))
+    return orders
+
+def evaluate(orders, alarm):
+    # Orders sent, valve-open time and reaction delay of a replay
+    end = records[-1][0]
+    first, opened, alarms, delays = {}, {}, {}, []
+    open_time = 0.0
+    readings = ((when, 0, (network, int(parse_message(message)[1])), parse_message(message)[0]) for when, network, message in records)
+    for when, kind, sensor, value in sorted(itertools.chain(readings, ((when, 1, sensor, order) for when, sensor, order in orders)), key=lambda e: e[:2]):
+        if kind == 0: #Reading, an order of the same time comes after it
+            first.setdefault(sensor, when)
+            if value >= alarm and sensor not in opened:
+                alarms.setdefault(sensor, when)
+        elif value == "open" and sensor not in opened:
+            opened[sensor] = when
+            if sensor in alarms:
+                delays.append(when - alarms.pop(sensor))
+        elif value == "close" and sensor in opened:
+            open_time += when - opened.pop(sensor)
+    open_time += sum(end - when for when in opened.values())
+    sensor_time = sum(end - when for when in first.values())
+    return {
+        "opens": sum(1 for order in orders if order[2] == "open"),
+        "closes": sum(1 for order in orders if order[2] == "close"),
+        "open": 100.0 * open_time / sensor_time if sensor_time > 0 else 0.0,
+        "delay": sum(delays) / len(delays) if delays else float("nan"),
+        "max_delay": max(delays) if delays else float("nan"),
+        "missed": len(alarms),
+    }
+
+def replay(task):
+    side, setting, alarm = task
+    orders = replay_server(setting) if side == "server" else replay_firmware(setting)
+    return side, setting, evaluate(orders, alarm)
+
+if __name__ == '__main__':
+    jobs = int(sys.argv[sys.argv.index("--jobs") + 1]) if "--jobs" in sys.argv else os.cpu_count()
+    alarm = int(sys.argv[sys.argv.index("--alarm") + 1]) if "--alarm" in sys.argv else ALARM_LEVEL
+    args = sys.argv[1:]
+    for option in ("--jobs", "--alarm"): #Options with a value
+        if option in args:
+            del args[args.index(option):args.index(option) + 2]
+    args = [arg for arg in args if not arg.startswith("--")]
+    if not args:
+        sys.exit("Usage : python3 replay.py capture [--cooja] [--jobs N] [--alarm A] [server.NAME=v1,v2,...] [firmware.NAME=v1,v2,...]")
+    records = read_capture(args[0], "--cooja" in sys.argv)
+    if not records:
+        sys.exit("No SRV in {}".format(args[0]))
+
+    server_grid = parse_grid(args[1:], "server", SERVER_PARAMS)
+    firmware_grid = parse_grid(args[1:], "firmware", FIRMWARE_PARAMS)
+    if not any(arg.startswith(("server.", "firmware.")) for arg in args[1:]): #Both sides, with their defaults
+        server_grid, firmware_grid = [{}], [{}]
+    elif not any(arg.startswith("server.") for arg in args[1:]):
+        server_grid = []
+    elif not any(arg.startswith("firmware.") for arg in args[1:]):
+        firmware_grid = []
+    if firmware_grid and not os.path.exists(os.path.join(HOST_DIR, "replay_computation")):
+        sys.exit("The firmware replay is not built : make -C host replay")
+
+    tasks = [("server", setting, alarm) for setting in server_grid] + [("firmware", setting, alarm) for setting in firmware_grid]
+    start = time.time()
+    with Pool(jobs, load_records, (records,)) as pool:
+        results = pool.map(replay, tasks)
+    elapsed = time.time() - start
+
+    duration = records[-1][0] - records[0][0]
+    sensors = len({(network, parse_message(message)[1]) for _, network, message in records})
+    print("{} SRV of {} sensors over {:.0f} s, {} settings replayed in {:.1f} s ({:.0f}x real time, {} jobs)".format(
+        len(records), sensors, duration, len(tasks), elapsed, duration * len(tasks) / max(elapsed, 1e-6), jobs))
+    print("{:<9} {:<48} {:>6} {:>6} {:>7} {:>9} {:>9} {:>7}".format("side", "setting", "opens", "closes", "open %", "delay s", "max s", "missed"))
+    for side, setting, result in results:
+        print("{:<9} {:<48} {:>6} {:>6} {:>7.2f} {:>9.1f} {:>9.1f} {:>7}".format(side,
+            " ".join("{}={}".format(name, value) for name, value in setting.items()) or "defaults",
+            result["opens"], result["closes"], result["open"], result["delay"], result["max_delay"], result["missed"]))
@@ -1,69 +1,418 @@
-from scipy import stats
+from collections import deque
+from decision import SensorTable, decide
+from metrics import Metrics, start_metrics_server
+from workers import WorkerPool
+import atexit
+import random
+import selectors
 import socket
+import sys
 import time
 
-SLOPE_THRESHOLD = 0
-VALVE_OPENING_TIME = 600
-VALUE_LEN = 30
 SOCKET_PORT = 5678
+SEQNO_MAX = 100 # Sequence numbers are coded on 2 digits
+DEDUP_WINDOW = 8 # Number of sequence numbers remembered per sensor
+ID_SIZE = 3 # Node ID are coded on 3 digits
+ORIGIN_SERVER = "000" # Origin of the orders decided by the server (the nodes have ids from 1)
+SRV_LEN = 16 # Sensor reading without its path
+MAX_PATH_HOPS = 16 # Max number of relays recorded in a SRV
+HND_MAX_VALUES = 5 # Readings in a hand-off
+HND_LEN = 24 # Hand-off without its path
+SUM_LEN = 7 # Summary without its entries
+SUM_ENTRY_LEN = 16 # Summary of one sensor
+TICK_PERIOD = 1.0 # Seconds between two evaluations of the sensors
+GROUP_MIN_TARGETS = 2 # Same order for at least this many sensors of a border : one GCM
+GROUP_MAX_HOPS = 9 # Number of relays of a GCM entry is coded on 1 digit
+GCM_LEN = 8 # Group order without its entries
+GCM_ENTRY_LEN = 6 # Entry of a group order without its source route
+GCM_MAX_ENTRIES = 16
+GCM_MAX_LEN = 90 # A group order must fit in one runicast frame (MSG_MAX_LEN of node_message.h)
+LNK_LEN = 7 # Link report without its entries
+LNK_ENTRY_LEN = 15 # Counters of one link
+GROUP_ACK_TIMEOUT = 15.0 # Seconds before ordering again the sensors that did not acknowledge
+ORDER_ACK_TIMEOUT = 30.0 # Seconds before an order not executed by its sensor is considered lost
+PROMOTE_PERIOD = 300.0 # Seconds between two choices of a relay to promote (see choose_promotion)
+PROMOTE_MAX_HOPS = 4 # A computation node source routes its orders to at most this many relays (MAX_CHILD_PATH_HOPS)
+PROMOTE_MIN_SENSORS = 5 # Sensors decided by the server behind a relay, to promote it
+PROMOTE_MIN_CHILDREN = 2 # Children of a promoted node, under which it is demoted
+PROMOTE_RETRY = 3600.0 # Seconds before a relay promoted (or that ignored it) is promoted again
+DEBUG = "--debug" in sys.argv # Print the slope of every evaluated sensor
+TRACE = "--trace" in sys.argv # Print the trace lines of the server stages (see trace_latency.py)
+FORECAST = "--forecast" in sys.argv # Decide on the forecast of the slopes (see decision.py)
+PROMOTE = "--promote" in sys.argv # Promote relays of the single image (sky_node.c) in the busy areas
+# "--workers N" : the decisions are sharded across N processes (see workers.py), --debug has no effect
+WORKERS = int(sys.argv[sys.argv.index("--workers") + 1]) if "--workers" in sys.argv else 0
+# "--capture FILE" : the SRV received are appended to FILE with their time, to be replayed (see replay.py)
+CAPTURE = sys.argv[sys.argv.index("--capture") + 1] if "--capture" in sys.argv else None
 
-def get_slope(values):
-    # Wait 30 data messages before computing the slope
-    if len(values) >= VALUE_LEN:
-        air = [x[0] for x in values]
-        time = [x[1] for x in values]
-        return stats.linregress(air, time)[0] # Thanks scipy
+def parse_message(message):
+    # Message of the form "SRV[air_quality][node_id][seqno][valve][origin][applied][path]"
+    # valve : state of the valve of the sensor, origin and applied : origin and seqno
+    # of the last COM it executed. applied is None if this COM was not decided by the server.
+    # The path is the list of relays (3 digits each), from the sensor to the border
+    if message[:3] == "SRV" and len(message) >= SRV_LEN and (len(message) - SRV_LEN) % ID_SIZE == 0 and message[3:].isdigit():
+        applied = int(message[14:16]) if message[11:14] == ORIGIN_SERVER else None
+        return int(message[3:5]), message[5:8], int(message[8:10]), message[10] == "1", applied, message[SRV_LEN:]
     else:
-        return None
+        return None, None, None, None, None, None
 
-def rotate_value(values, new_value, receive_time):
-    values.append((new_value, receive_time))
-    if len(values) <= VALUE_LEN:
-        return values
+def parse_handoff(message):
+    # Message of the form "HND[kind][node_id][child_id][open][timer][nvalues][values][path]"
+    # kind R : the computation node node_id adopts child_id and asks for its state
+    # kind B : the computation node node_id gives child_id back, with its state
+    if message[:3] == "HND" and message[3:4] in ("R", "B") and len(message) >= HND_LEN \
+            and (len(message) - HND_LEN) % ID_SIZE == 0 and message[4:].isdigit() and int(message[13]) <= HND_MAX_VALUES:
+        values = [int(message[14 + 2 * i:16 + 2 * i]) for i in range(int(message[13]))]
+        return message[3], message[4:7], message[7:10], message[10] == "1", int(message[11:13]), values, message[HND_LEN:]
     else:
-        return values[1:]
+        return None
 
-def parse_message(message):
-    # Message of the form "SRV[air_quality][node_id]"
-    if message[:3] == "SRV" :
-        return int(message[3:5]), message[5:]
-    else:
-        return None, None
+def parse_summary(message):
+    # Message of the form "SUM[node_id][count][entries]", sent by a computation node
+    # for the sensors it decides. Entry : "[child_id][min][max][mean][slope*100][open][samples]"
+    if message[:3] != "SUM" or not message[3:SUM_LEN].isdigit() \
+            or len(message) != SUM_LEN + int(message[SUM_LEN - 1]) * SUM_ENTRY_LEN:
+        return None
+    entries = []
+    for i in range(int(message[SUM_LEN - 1])):
+        entry = message[SUM_LEN + i * SUM_ENTRY_LEN:SUM_LEN + (i + 1) * SUM_ENTRY_LEN]
+        if not entry[:9].isdigit() or entry[9] not in "+-" or not entry[10:].isdigit():
+            return None
+        entries.append({"id": entry[0:3], "min": int(entry[3:5]), "max": int(entry[5:7]), "mean": int(entry[7:9]),
+            "slope": int(entry[9:13]) / 100, "open": entry[13] == "1", "samples": int(entry[14:16])})
+    return entries
+
+def parse_links(message):
+    # Message of the form "LNK[node_id][count][entries]", traffic of node_id to its neighbors
+    # since its last report. Entry : "[neighbor_id][srv][com][rexmit][drops]"
+    if message[:3] != "LNK" or not message[3:].isdigit() \
+            or len(message) != LNK_LEN + int(message[LNK_LEN - 1]) * LNK_ENTRY_LEN:
+        return None
+    entries = []
+    for i in range(int(message[LNK_LEN - 1])):
+        entry = message[LNK_LEN + i * LNK_ENTRY_LEN:LNK_LEN + (i + 1) * LNK_ENTRY_LEN]
+        entries.append({"to": entry[0:3], "srv": int(entry[3:6]), "com": int(entry[6:9]),
+            "rexmit": int(entry[9:12]), "drops": int(entry[12:15])})
+    return message[3:6], entries
+
+def format_handoff(node_id, child_id, is_open, periods, values, path):
+    # State of child_id pushed to the computation node node_id (kind S), source
+    # routed along the path of its request, like a COM
+    return "HNDS{}{}{}{:02d}{}{}{}{}\n".format(node_id, child_id, 1 if is_open else 0, min(periods, 99), len(values),
+        "".join("{:02d}".format(v) for v in values), "00" * (HND_MAX_VALUES - len(values)), path)
+
+def path_is_complete(path):
+    # The relays stop recording the path when it is full
+    return len(path) < MAX_PATH_HOPS * ID_SIZE
+
+def is_duplicate(seen_seqno, seqno):
+    # Same SRV received twice (retransmission after a lost ACK)
+    if seqno in seen_seqno:
+        return True
+    seen_seqno.append(seqno)
+    return False
+
+def format_order(target_id, order, seqno, trace_id, path):
+    # Message of the form "COM[order][node_id][origin][seqno][trace][source route]", one per line
+    # trace_id is the seqno of the last SRV of the node, that triggered the order
+    # The source route is the path of the last SRV of the node, each hop removes
+    # the last relay of the route and sends the COM to it
+    return "COM{}{}{}{:02d}{:02d}{}\n".format(1 if order == "open" else 0, target_id, ORIGIN_SERVER, seqno, trace_id, path)
+
+def format_group_order(order, seqno, targets):
+    # Message of the form "GCM[order][seqno][count][entries]", entry : "[node_id][trace][nhops][source route]"
+    # The nodes of the tree duplicate it at the branch points only (see node_group.h)
+    return "GCM{}{:02d}{:02d}{}\n".format(1 if order == "open" else 0, seqno, len(targets),
+        "".join("{}{:02d}{}{}".format(target_id, trace_id, len(path) // ID_SIZE, path) for target_id, trace_id, path in targets))
+
+def parse_group_ack(message):
+    # Message of the form "GAK[seqno][count][node ids]", the sensors that executed a group order
+    if message[:3] != "GAK" or not message[3:].isdigit() or len(message) != 7 + int(message[5:7]) * ID_SIZE:
+        return None
+    return int(message[3:5]), {message[7 + i * ID_SIZE:7 + (i + 1) * ID_SIZE] for i in range(int(message[5:7]))}
 
-def send_order(target_socket, target_id, order):
-    message = "COM{}{}".format(1 if order == "open" else 0, target_id)
-    target_socket.send(message.encode('utf-8'))
+def group_orders(order, targets, border, groups, now):
+    # Pack the targets (target_id, trace_id, path) in GCMs that fit in a packet
+    # Each GCM is remembered until all its targets acknowledged it
+    messages = []
+    while targets:
+        count, length = 0, GCM_LEN
+        while count < min(len(targets), GCM_MAX_ENTRIES) and length + GCM_ENTRY_LEN + len(targets[count][2]) <= GCM_MAX_LEN:
+            length += GCM_ENTRY_LEN + len(targets[count][2])
+            count += 1
+        seqno = groups["seqno"]
+        groups["seqno"] = (seqno + 1) % SEQNO_MAX
+        groups["pending"][seqno] = {"order": order, "targets": {t[0] for t in targets[:count]}, "deadline": now + GROUP_ACK_TIMEOUT}
+        messages.append(format_group_order(order, seqno, targets[:count]))
+        for target_id, trace_id, _ in targets[:count]:
+            trace("server_tx", target_id, trace_id)
+        targets = targets[count:]
+    return messages
+
+def expired_groups(groups, now):
+    # Orders of the targets that did not acknowledge their group order in time
+    missing = []
+    for seqno in [seqno for seqno, group in groups["pending"].items() if group["deadline"] <= now]:
+        group = groups["pending"].pop(seqno)
+        missing.extend((target_id, group["order"]) for target_id in sorted(group["targets"]))
+    return missing
+
+def trace(stage, origin, trace_id):
+    # Same fields as the trace lines of the nodes, with the time of the server
+    if TRACE:
+        print("[TRACE] {} {} {} server {:.6f}".format(stage, int(origin), trace_id, time.time()))
+
+def order_missed(valve, applied, is_open, sent, now):
+    # The valve reported by a SRV is not in the state decided by the server, and
+    # the last order (seqno, time sent) is not on its way anymore : it was executed
+    # then overridden, or not executed in time. Send it again.
+    # An order of a group has no seqno of its own, only its time counts
+    # applied is None when the last COM executed was not decided by the server
+    if sent is None or valve == is_open:
+        return False
+    seqno, sent_at = sent
+    return (seqno is not None and applied == seqno) or now - sent_at >= ORDER_ACK_TIMEOUT
+
+def send_orders(orders, sensor_border, sensor_path, sensor_trace, order_seqno, order_sent, now, groups=None):
+    # Send the orders of a tick, in one batch per border
+    # Each order goes through the border that received the last SRV of its recipient
+    # The same order for several sensors of a border is sent as GCMs (unless groups is None)
+    # order_sent keeps the seqno and the time of the last order of each sensor
+    # Returns the number of orders sent and dropped (no route to the sensor)
+    batches = {}
+    grouped = {}
+    sent = 0
+    for target_id, order in orders:
+        border = sensor_border.get(target_id) #None if only known through a hand-off
+        if border is None or sensor_path[target_id] is None:
+            continue
+        sent += 1
+        if groups is not None and len(sensor_path[target_id]) // ID_SIZE <= GROUP_MAX_HOPS:
+            grouped.setdefault((border, order), []).append((target_id, sensor_trace[target_id], sensor_path[target_id]))
+            continue
+        seqno = next_order_seqno(order_seqno, target_id)
+        order_sent[target_id] = (seqno, now)
+        batches.setdefault(border, []).append(format_order(target_id, order, seqno, sensor_trace[target_id], sensor_path[target_id]))
+    for (border, order), targets in grouped.items():
+        for target_id, trace_id, _ in targets:
+            order_sent[target_id] = (None, now)
+        if len(targets) >= GROUP_MIN_TARGETS:
+            batches.setdefault(border, []).extend(group_orders(order, targets, border, groups, now))
+            continue
+        for target_id, trace_id, path in targets: #Alone, a COM is shorter
+            seqno = next_order_seqno(order_seqno, target_id)
+            order_sent[target_id] = (seqno, now)
+            batches.setdefault(border, []).append(format_order(target_id, order, seqno, trace_id, path))
+    for border, messages in batches.items():
+        border.sendall("".join(messages).encode('utf-8'))
+        for message in messages:
+            if message[:3] == "COM":
+                trace("server_tx", message[4:7], int(message[12:14]))
+    return sent, len(orders) - sent
+
+def format_role(promote, node_id, path):
+    # Message of the form "ROL[role][node_id][source route]" : promotes (1) or
+    # demotes (0) node_id, source routed along the path of its last SRV
+    return "ROL{}{}{}\n".format(1 if promote else 0, node_id, path)
+
+def choose_promotion(sensor_path, sensor_time, adopted, computation_nodes, last_promotion, now):
+    # Relay with the most sensors decided by the server (recent SRV) within
+    # PROMOTE_MAX_HOPS of them, None if none has PROMOTE_MIN_SENSORS. Only the
+    # single image accepts, a relay that ignored it is not asked before PROMOTE_RETRY.
+    counts = {}
+    for target_id, path in sensor_path.items():
+        if path is None or target_id in adopted or now - sensor_time.get(target_id, 0) > PROMOTE_PERIOD:
+            continue
+        for i in range(min(len(path) // ID_SIZE, PROMOTE_MAX_HOPS)):
+            relay = path[i * ID_SIZE:(i + 1) * ID_SIZE]
+            counts[relay] = counts.get(relay, 0) + 1
+    candidates = [(count, relay) for relay, count in counts.items() if count >= PROMOTE_MIN_SENSORS
+        and relay not in computation_nodes and now - last_promotion.get(relay, -PROMOTE_RETRY) >= PROMOTE_RETRY
+        and sensor_path.get(relay) is not None]
+    return max(candidates)[1] if candidates else None
+
+def expired_promotions(adopted, promoted, now):
+    # Nodes promoted by the server for a whole period that decide less than
+    # PROMOTE_MIN_CHILDREN sensors : demoted, their children go back to the server
+    children = {}
+    for node_id in adopted.values():
+        children[node_id] = children.get(node_id, 0) + 1
+    return [node_id for node_id, since in promoted.items()
+        if now - since >= PROMOTE_PERIOD and children.get(node_id, 0) < PROMOTE_MIN_CHILDREN]
+
+def read_lines(border, buffers):
+    # Complete lines received from a border, None when it is disconnected
+    chunk = border.recv(4096)
+    if not chunk:
+        return None
+    *lines, buffers[border] = (buffers[border] + chunk).split(b'\n')
+    return [line.decode('utf-8', errors='replace').strip() for line in lines]
+
+def next_order_seqno(order_seqno, target_id):
+    # The first seqno is random : after a restart of the server, its orders are
+    # not taken for the duplicates of the ones sent before
+    seqno = order_seqno.get(target_id, random.randrange(SEQNO_MAX))
+    order_seqno[target_id] = (seqno + 1) % SEQNO_MAX
+    return seqno
 
 if __name__ == '__main__':
-    sensor_data = {}
-    sensor_timer = {}
+    # The readings are only stored when they are received, the decisions are
+    # taken every TICK_PERIOD for all the sensors that received new readings
+    # With workers, the table is split across them (started before any thread)
+    table = WorkerPool(WORKERS, FORECAST) if WORKERS else SensorTable()
+    if WORKERS:
+        atexit.register(table.close)
+    sensor_seqno = {}
+    sensor_path = {}
+    sensor_border = {}
+    sensor_trace = {} # Seqno of the last SRV of each sensor
+    sensor_time = {} # Time of the last SRV of each sensor
+    adopted = {} # Computation node of each sensor decided by one (HND R, until its HND B)
+    computation_nodes = set() # Nodes seen deciding (HND R or SUM)
+    promoted = {} # Nodes promoted by the server and not demoted since, with the time of their promotion
+    last_promotion = {} # Time of the last promotion of each node, see choose_promotion
+    order_seqno = {}
+    order_sent = {} # Seqno and time of the last order of each sensor decided by the server
+    missed = {} # Orders to send again, reported as not executed by the SRV
+    groups = {"seqno": random.randrange(SEQNO_MAX), "pending": {}} # Group orders waiting for their acknowledgements
+    metrics = Metrics()
+    start_metrics_server(metrics)
+    capture = open(CAPTURE, "a", buffering=1) if CAPTURE else None
+    # Several borders can be connected at the same time, their streams are merged
+    borders = selectors.DefaultSelector()
+    buffers = {}
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.bind(('', SOCKET_PORT))
     s.listen()
+    borders.register(s, selectors.EVENT_READ)
+    next_tick = time.time() + TICK_PERIOD
+    next_promotion = time.time() + PROMOTE_PERIOD
     while True:
-        c, addr = s.accept()
-        while True:
-            message = c.recv(8)
-            if not message: #Connection closed
-                break
-            message = message.decode('utf-8')
-            now = time.time()
-            new_value, target_id = parse_message(message)
-            if target_id is None or new_value is None: #Bad messages should be logged
+        for key, _ in borders.select(timeout=max(0, next_tick - time.time())):
+            if key.fileobj is s: #New border
+                c, addr = s.accept()
+                borders.register(c, selectors.EVENT_READ)
+                buffers[c] = b''
+                continue
+            c = key.fileobj
+            # One message per line, the other lines of the border are logs
+            messages = read_lines(c, buffers)
+            if messages is None: #Connection closed
+                borders.unregister(c)
+                del buffers[c]
+                c.close()
+                for target_id in sensor_border: #Its sensors wait for a SRV through another border
+                    if sensor_border[target_id] is c:
+                        sensor_border[target_id] = None
                 continue
-            if target_id not in sensor_data: #New node
-                sensor_data[target_id] = []
-                sensor_timer[target_id] = -1
-            sensor_data[target_id] = rotate_value(sensor_data[target_id], new_value, now) #Update data
-
-            slope = get_slope(sensor_data[target_id])
-            print(slope)
-            if sensor_timer[target_id] != -1 and now - sensor_timer[target_id] >= VALVE_OPENING_TIME: #Need to re-evaluate the valve
-                if slope is not None and slope < SLOPE_THRESHOLD: #We can close the valve
-                    send_order(c, target_id, "close")
-                    sensor_timer[target_id] = -1
-                else: #we keep it open for another 10 mins
-                    sensor_timer[target_id] = now
-            elif sensor_timer[target_id] == -1 and slope is not None and slope > SLOPE_THRESHOLD: #Need to open the valve
-                send_order(c, target_id, "open")
-                sensor_timer[target_id] = now
+            now = time.time()
+            if capture:
+                capture.writelines("{:.6f} {}\n".format(now, message) for message in messages if message[:3] == "SRV")
+            for message in messages:
+                summary = parse_summary(message)
+                if summary is not None: #Sensors decided by a computation node
+                    computation_nodes.add(message[3:6])
+                    for entry in summary:
+                        metrics.summary(entry, now)
+                    continue
+                links = parse_links(message)
+                if links is not None: #Traffic of the links of a node, for the load map
+                    metrics.links(*links)
+                    continue
+                ack = parse_group_ack(message)
+                if ack is not None: #Sensors that executed a group order
+                    seqno, acked = ack
+                    group = groups["pending"].get(seqno)
+                    if group is not None:
+                        metrics.groups(acked=len(group["targets"] & acked))
+                        group["targets"] -= acked
+                        if not group["targets"]:
+                            del groups["pending"][seqno]
+                    continue
+                handoff = parse_handoff(message)
+                if handoff is not None: #Hand-off of a sensor by a computation node
+                    kind, node_id, child_id, is_open, periods, values, path = handoff
+                    if kind == "R": #Decided by the computation node from now on
+                        order_sent.pop(child_id, None)
+                        adopted[child_id] = node_id
+                        computation_nodes.add(node_id)
+                    elif adopted.get(child_id) == node_id:
+                        del adopted[child_id]
+                    if kind == "R" and path_is_complete(path) and WORKERS: #Answered by the worker of the sensor
+                        table.request_state(child_id, now, (c, node_id, path))
+                    elif kind == "R" and path_is_complete(path): #Warm start of the computation node
+                        is_open, periods = table.valve(child_id, now)
+                        c.sendall(format_handoff(node_id, child_id, is_open, periods, table.window(child_id, HND_MAX_VALUES), path).encode('utf-8'))
+                    elif kind == "B": #The server decides again for this sensor
+                        table.hand_back(child_id, is_open, periods, values, now)
+                        metrics.forget_summary(child_id)
+                    continue
+                new_value, target_id, seqno, valve, applied, path = parse_message(message)
+                if target_id is None or new_value is None: #Logs of the border
+                    if message[:3] == "SRV":
+                        metrics.bad_message()
+                    continue
+                if target_id not in sensor_seqno: #New node
+                    sensor_seqno[target_id] = deque(maxlen=DEDUP_WINDOW)
+                    sensor_path[target_id] = None
+                    sensor_border[target_id] = None
+                if is_duplicate(sensor_seqno[target_id], seqno): #Also if received by two borders
+                    metrics.duplicate()
+                    continue
+                metrics.srv(target_id, now)
+                sensor_trace[target_id] = seqno
+                sensor_time[target_id] = now
+                trace("server_rx", target_id, seqno)
+                if path_is_complete(path): #Source route of the next orders, through this border
+                    sensor_path[target_id] = path
+                    sensor_border[target_id] = c
+                table.append(target_id, new_value, now) #Update data
+                is_open = table.valve_open(target_id) if WORKERS else table.valve(target_id, now)[0]
+                if order_missed(valve, applied, is_open, order_sent.get(target_id), now):
+                    missed[target_id] = "open" if is_open else "close"
+            if WORKERS: #Wake up the workers, and send the hand-off states they answered
+                table.flush()
+                for (border, node_id, path), child_id, is_open, periods, values in table.take_states():
+                    if border in buffers:
+                        border.sendall(format_handoff(node_id, child_id, is_open, periods, values, path).encode('utf-8'))
+
+        now = time.time()
+        if now >= next_tick: #Evaluate all the sensors that changed
+            if WORKERS:
+                orders, open_valves = table.decide(now)
+                slopes = {}
+            else:
+                orders, slopes = decide(table, now, FORECAST)
+                open_valves = table.open_valves()
+            metrics.tick(now, time.time() - now, open_valves, len(orders))
+            if DEBUG:
+                for target_id, slope in slopes.items():
+                    print(target_id, slope)
+            # Sensors that missed a group order are ordered again alone, unless decided again meanwhile
+            decided = {target_id for target_id, _ in orders}
+            retries = [(target_id, order) for target_id, order in expired_groups(groups, now) if target_id not in decided]
+            metrics.groups(retried=len(retries))
+            # Same for the orders that the SRV reported as not executed
+            retries += [(target_id, order) for target_id, order in missed.items() if target_id not in decided]
+            metrics.orders_missed(len(missed))
+            missed = {}
+            metrics.orders_sent(*send_orders(retries, sensor_border, sensor_path, sensor_trace, order_seqno, order_sent, now))
+            pending = len(groups["pending"])
+            metrics.orders_sent(*send_orders(orders, sensor_border, sensor_path, sensor_trace, order_seqno, order_sent, now, groups))
+            metrics.groups(sent=len(groups["pending"]) - pending)
+            next_tick = now + TICK_PERIOD
+
+        if PROMOTE and now >= next_promotion: #Decisions moved to the busy areas, and back
+            for node_id in expired_promotions(adopted, promoted, now):
+                if sensor_border.get(node_id) is None: #No border to reach it : tried again at the next period
+                    continue
+                sensor_border[node_id].sendall(format_role(False, node_id, sensor_path[node_id]).encode('utf-8'))
+                del promoted[node_id]
+                computation_nodes.discard(node_id)
+                print("Relay {} demoted".format(node_id))
+            relay = choose_promotion(sensor_path, sensor_time, adopted, computation_nodes, last_promotion, now)
+            if relay is not None and sensor_border.get(relay) is not None:
+                sensor_border[relay].sendall(format_role(True, relay, sensor_path[relay]).encode('utf-8'))
+                promoted[relay] = last_promotion[relay] = now
+                print("Relay {} promoted".format(relay))
+            next_promotion = now + PROMOTE_PERIOD
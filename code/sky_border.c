@@ -4,147 +4,153 @@
 #include "lib/list.h"
 #include "lib/memb.h"
 #include "lib/random.h"
+#include "dev/serial-line.h"
 
-#include <stdio.h>
-
-// Runicast thing
-#define MAX_RETRANSMISSIONS 4
-
-// The max number of route to save
-#define MAX_ROUTES 30 // Adapt it for your network
-
-// The amount of message to wait before define "inactive"
-#define INACTIVE_ORDERS 10
-
-// Size of the Rime ID in the messages
-#define ID_SIZE 3
-
-// Used to correctly print the id in the messages
-#define STR_(X) #X
-#define STR(X) STR_(X)
-
-/* This structure holds information about the routes. */
-struct routes {
+#include "node_log.h"
+#include "node_message.h"
+#include "node_dedup.h"
+#include "node_retx.h"
+#include "node_group.h"
+#include "node_profile.h"
+#include "node_slots.h"
 
-  // The ->next pointer is needed for Contiki list
-  struct routes *next;
-
-  // The id that we want to reach
-  int id;
-
-  // Where to forward the message
-  linkaddr_t addr_fwd;
-
-  // int used to determine whether or not the node is still active
-  int age;
+#include <stdio.h>
 
-};
+// Period of the load measure advertised in the NDR
+#define LOAD_PERIOD (60 * CLOCK_SECOND)
 
-MEMB(routes_memb, struct routes, MAX_ROUTES);
-LIST(routes_list);
+// Load of this border : SRV received during the last LOAD_PERIOD
+static int border_load = 0;
+static int srv_received = 0;
 
-// Utils function for computing the Rime ID
-int power(int a, int b)
+//Utils to send an order of the server to a node
+// The server gives a complete COM, with its source route (see message_structure.txt)
+void send_order(const char *line, struct runicast_conn *c)
 {
-  int res = 1;
-  size_t i;
-  for(i = 0 ; i < b ; i++)
+  struct msg_com com;
+  struct msg_hnd hnd;
+  struct msg_rol rol;
+  linkaddr_t next_hop;
+
+  if(strlen(line) > MSG_MAX_LEN)
   {
-    res = res * a;
+    LOG_WARN(ORDER, "[ORDER] Order of %d bytes from the server, too long for a frame\n", (int)strlen(line));
+    return;
   }
-  return res;
-}
-
-//Utils to send order to a node
-void send_order(int order, int id, struct runicast_conn *c)
-{
-  printf("[ORDER] Send order %d to node %d\n", order, id);
-
-  char message[10];
-  sprintf(message, "COM%d%0"STR(ID_SIZE)"d", order, id);
-  packetbuf_copyfrom(message, strlen(message));
+  packetbuf_copyfrom(line, strlen(line));
 
-  struct routes *route;
-  /* Check if we already know this routes. */
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  // Role of a node (promotion or demotion), source routed the same way
+  if(msg_type() == MSG_ROL && msg_parse_rol(&rol) == 0)
   {
-    // We break out of the loop if the address in the list matches with from
-    if((int)route->id == (int)id) 
+    if(runicast_is_transmitting(c))
     {
-      break;
+      LOG_WARN(ORDER, "[ORDER] Busy, role of node %d dropped\n", rol.id);
+      return;
     }
+    msg_id_to_addr(&next_hop, msg_rol_next_hop(&rol));
+    retx_send(c, &next_hop);
+    LOG_INFO(ORDER, "[ORDER] Sending role %d to the node %d\n", rol.role, rol.id);
+    return;
+  }
 
+  // State of a child pushed to a computation node, source routed the same way
+  if(msg_type() == MSG_HND && msg_parse_hnd(&hnd) == 0 && hnd.kind == HND_STATE)
+  {
+    if(runicast_is_transmitting(c))
+    {
+      LOG_WARN(ORDER, "[ORDER] Busy, hand-off of node %d dropped\n", hnd.child);
+      return;
+    }
+    msg_id_to_addr(&next_hop, msg_hnd_next_hop(&hnd));
+    retx_send(c, &next_hop);
+    LOG_INFO(ORDER, "[ORDER] Sending the state of node %d to the computation node %d\n", hnd.child, hnd.node);
+    return;
   }
 
-  // If new_route is NULL, this node was not found in our list
-  if(NULL == route)
+  if(msg_type() != MSG_COM || msg_parse_com(&com) < 0)
   {
-    printf("[ORDER] No route for node %d\n", id);
+    LOG_WARN(ORDER, "[ORDER] Malformed order from the server\n");
+    return;
   }
-  else 
+
+  if(runicast_is_transmitting(c))
   {
-    runicast_send(c, &route->addr_fwd, MAX_RETRANSMISSIONS);
-    printf("[ORDER] Sending order %d to the node %d (%s)\n", order, route->addr_fwd.u8[0], message);
+    LOG_WARN(ORDER, "[ORDER] Busy, order %d for node %d dropped\n", com.order, com.id);
+    return;
   }
 
+  msg_id_to_addr(&next_hop, msg_com_next_hop(&com));
+  retx_send(c, &next_hop);
+  LOG_TRACE("com_down", com.id, com.trace);
+  LOG_INFO(ORDER, "[ORDER] Sending order %d for node %d to the node %d\n", com.order, com.id, next_hop.u8[0]);
 }
 
 /*---------------------------------------------------------------------------*/
 PROCESS(network_setup, "Network Setup");
 PROCESS(receive_data, "Receive SRV messages");
 PROCESS(send_orders, "Send COM messages");
-AUTOSTART_PROCESSES(&network_setup, &receive_data, &send_orders);
+PROCESS(group_orders, "Send GCM messages");
+PROCESS(serial_commands, "Serial commands");
+AUTOSTART_PROCESSES(&network_setup, &receive_data, &send_orders, &group_orders, &serial_commands);
 
-
-// This function is used to remove a node that has stopped communicating for a while.
-// It uses the INACTIVE_ORDERS constant
-void remove_old_routes()
+//Utils to send a group order of the server, its branches are sent by the
+// group_orders thread (the send_orders thread must not miss a serial line)
+void send_group_order(const char *line)
 {
-  struct routes *route;
+  struct msg_gcm gcm;
+  int trace;
 
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  if(strlen(line) > MSG_MAX_LEN)
   {
-    if(INACTIVE_ORDERS <= (int) route->age ) 
-    {
-      printf("removed route \n");
-      list_remove(routes_list, route);
-    }
-    else 
-    {
-      route->age += 1;
-    }
+    LOG_WARN(ORDER, "[ORDER] Group order of %d bytes from the server, too long for a frame\n", (int)strlen(line));
+    return;
+  }
+  packetbuf_copyfrom(line, strlen(line));
+  if(msg_parse_gcm(&gcm) < 0)
+  {
+    LOG_WARN(ORDER, "[ORDER] Malformed group order from the server\n");
+    return;
   }
+  group_receive(&gcm, &trace);
+  process_poll(&group_orders);
+  LOG_INFO(ORDER, "[ORDER] Sending group order %d for %d nodes\n", gcm.order, gcm.count);
+}
+
+
+// Print the routing state. Only called on demand (see ROUTE_DUMP_COMMAND).
+// The border has no routing table : the server gives the source route of each COM.
+void dump_routes()
+{
+  printf("[ROUTING] Border %d, COMs are source routed by the server\n", linkaddr_node_addr.u8[0]);
 }
 
 /*---------------------------------------------------------------------------*/
 static void
 recv_child_announce(struct broadcast_conn *c, const linkaddr_t *from)
 {
-  char message[10];
-  strcpy(message, (char *)packetbuf_dataptr());
-
   // Always respond to child announce
-  if (message[0] == 'N' && message[1] == 'D' && message[2] == 'A')
+  if (msg_type() == MSG_NDA)
   {
-    printf("[SETUP THREAD] Child announce received : %s\n", message);
+    LOG_DBG(SETUP, "[SETUP THREAD] Child announce received from %d\n", from->u8[0]);
 
     // Respond to the child
-    sprintf(message, "NDR%0"STR(ID_SIZE)"d", from->u8[0]);
-    packetbuf_copyfrom(message, strlen(message));
+    msg_build_ndr(from->u8[0], border_load);
     broadcast_send(c);
-    printf("[SETUP THREAD] Reponse (NDR) sent : %s\n", message);
+    LOG_DBG(SETUP, "[SETUP THREAD] Reponse (NDR) sent to %d\n", from->u8[0]);
   }
   
 }
 
 
-static const struct broadcast_callbacks broadcast_call = {recv_child_announce};
+PROFILE_BROADCAST_RECV(PROFILE_RECV_BDCST, recv_child_announce)
+static const struct broadcast_callbacks broadcast_call = {PROFILED(recv_child_announce)};
 static struct broadcast_conn broadcast;
 
 /*---------------------------------------------------------------------------*/
 PROCESS_THREAD(network_setup, ev, data)
 {
   static struct etimer et;
+  static clock_time_t load_period_start;
 
   PROCESS_EXITHANDLER(broadcast_close(&broadcast);)
 
@@ -152,10 +158,21 @@ PROCESS_THREAD(network_setup, ev, data)
 
   broadcast_open(&broadcast, 129, &broadcast_call);
 
-  printf("[BORDER] I'm %d\n", linkaddr_node_addr.u8[0]);
+  LOG_INFO(SETUP, "[BORDER] I'm %d\n", linkaddr_node_addr.u8[0]);
+
+  load_period_start = clock_time();
 
   while(1) {
 
+    // Update the load advertised to the new nodes
+    if ((clock_time_t)(clock_time() - load_period_start) >= LOAD_PERIOD)
+    {
+      border_load = srv_received;
+      srv_received = 0;
+      load_period_start = clock_time();
+      LOG_DBG(SETUP, "[SETUP THREAD] Load : %d SRV per period\n", border_load);
+    }
+
     /* Delay 2-4 seconds */
     etimer_set(&et, CLOCK_SECOND * 4 + random_rand() % (CLOCK_SECOND * 4));
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
@@ -170,92 +187,82 @@ PROCESS_THREAD(network_setup, ev, data)
 static void
 recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
 {
-  char message[10];
-  strcpy(message, (char *)packetbuf_dataptr());
-  int original_sender = 0;
-  size_t i;
-
-  // If SRV message, need to forward it to the parent_node
-  if (message[0] == 'S' && message[1] == 'R' && message[2] == 'V')
+  struct msg_srv srv;
+  struct msg_hnd hnd;
+  struct msg_gak gak;
+
+  // Hand-off of a child or summary of the children by a computation node, or
+  // link counters of a node, given to the server like a SRV
+  if ((msg_type() == MSG_HND && msg_parse_hnd(&hnd) == 0 && hnd.kind != HND_STATE) || msg_type() == MSG_SUM
+    || msg_type() == MSG_LNK)
   {
-    // Get the air quality
-    int air_quality = (message[3]-48) * 10 + (message[4]-48);
-
-    // Get the address of the original sender
-    for(i = 0 ; i < ID_SIZE ; i++)
+    printf("%.*s\n", packetbuf_datalen(), (char *)packetbuf_dataptr());
+    LOG_DBG(DATA, "[DATA THREAD] Report received from %d\n", from->u8[0]);
+  }
+  // Acknowledgements of a group order, aggregated with the others or given
+  // to the server as they are (late ones)
+  else if (msg_type() == MSG_GAK && msg_parse_gak(&gak) == 0)
+  {
+    if (!group_receive_ack(&gak))
     {
-      original_sender = original_sender + ((message[i+5]-48) * power(10,ID_SIZE-i-1));
+      printf("%.*s\n", packetbuf_datalen(), (char *)packetbuf_dataptr());
     }
+  }
+  // If SRV message, need to forward it to the server
+  else if (msg_type() == MSG_SRV && msg_parse_srv(&srv) == 0)
+  {
 
-    struct routes *new_route;
-
-    /* Check if we already know this routes. */
-    for(new_route = list_head(routes_list); new_route != NULL; new_route = list_item_next(new_route)) 
+    // Retransmission of a SRV already given to the server (lost ACK)
+    if (dedup_is_duplicate(MSG_SRV, srv.id, srv.id, srv.seqno))
     {
-
-      // We break out of the loop if the address in the list matches with from
-      if((int)new_route->id == (int)original_sender) 
-      {
-          break;
-      }
-
+      LOG_DBG(DATA, "[DATA THREAD] Duplicate SRV %d of node %d dropped\n", srv.seqno, srv.id);
+      return;
     }
 
-    // If new_route is NULL, this node was not found in our list
-    if(new_route == NULL) 
+    // A new neighbor, or a neighbor out of its reporting slot
+    if (slots_received(from, srv.id))
     {
-      new_route = memb_alloc(&routes_memb);
-
-      // If allocation failed, we give up.
-      if(new_route == NULL) 
-      {
-        return;
-      }
+      process_poll(&receive_data);
     }
-    new_route->age = 0;
-    if (!linkaddr_cmp(&new_route->addr_fwd, from)) // If routing has changed
-    {
-      // Initialize the new_route.
-      linkaddr_copy(&new_route->addr_fwd, from);
-      new_route->id = original_sender;
 
-      // Add the route into the list
-      printf("[ROUTING] New route\n");
-      list_add(routes_list, new_route);
-    }
+    srv_received++;
+
+    // Give the message to the server, alone on its line (with its path)
+    printf("%.*s\n", packetbuf_datalen(), (char *)packetbuf_dataptr());
+    LOG_TRACE("srv_up", srv.id, srv.seqno);
 
-    printf("[DATA THREAD] Data (%d) from node %d received (%s)\n", air_quality, original_sender, message);
+    LOG_DBG(DATA, "[DATA THREAD] Data (%d) from node %d received (%d hops)\n", srv.air_quality, srv.id, srv.path_hops);
 
   }
   else
   {
     // DEBUG PURPOSE
-    printf("[DATA THREAD] Weird message received from %d.%d\n", from->u8[0], from->u8[1]);
+    LOG_WARN(DATA, "[DATA THREAD] Weird message received from %d.%d\n", from->u8[0], from->u8[1]);
   }
 
-  /* ===== DEBUG ==== */
-  struct routes *route;
-
-  // Print the current routes
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
-  {
-    printf("[ROUTING] To contact %d, I have to send to %d\n", route->id, route->addr_fwd.u8[0]);
-  }
-  /* ================ */
-
 }
 
 /*---------------------------------------------------------------------------*/
 
-static const struct runicast_callbacks runicast_callbacks = {recv_ruc};
+// Statistics of the links to the next hops (see node_retx.h)
+static void
+sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
+{
+  retx_done(to, retransmissions, 0);
+}
+static void
+timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
+{
+  retx_done(to, retransmissions, 1);
+}
+
+PROFILE_RUNICAST_RECV(PROFILE_RECV_RUC, recv_ruc)
+static const struct runicast_callbacks runicast_callbacks = {PROFILED(recv_ruc), sent_runicast, timedout_runicast};
 static struct runicast_conn runicast;
 
 
 PROCESS_THREAD(send_orders, ev, data)
 {
-  //char message[10];
-  //int order, destination;
-
   PROCESS_EXITHANDLER(runicast_close(&runicast);)
     
   PROCESS_BEGIN();
@@ -263,25 +270,40 @@ PROCESS_THREAD(send_orders, ev, data)
   runicast_open(&runicast, 144, &runicast_callbacks);
 
   while(1) {
-    static struct etimer et;
-    
-    // Send the data to the parent
-    if(!runicast_is_transmitting(&runicast)) {
 
-      // TODO : Get this from the python server
-      //destination = <RIME ID>;
-      //order = <1 or 0>;
+    // Wait for an order of the python server (one COM per line on the serial line)
+    PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
 
-      //send_order(order, destination, &runicast);
+    if(strncmp((char *)data, "COM", TYPE_SIZE) == 0 || strncmp((char *)data, "HND", TYPE_SIZE) == 0
+      || strncmp((char *)data, "ROL", TYPE_SIZE) == 0)
+    {
+      PROFILE_CALL(PROFILE_SEND_ORDER, send_order((char *)data, &runicast));
     }
+    else if(strncmp((char *)data, "GCM", TYPE_SIZE) == 0)
+    {
+      send_group_order((char *)data);
+    }
+  }
 
-    // Check if there are some old routes to delete
-    remove_old_routes();
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
+PROCESS_THREAD(group_orders, ev, data)
+{
+  static struct etimer et;
 
-    /* Delay */
-    etimer_set(&et, (random_rand()%20)*CLOCK_SECOND + 10);
-    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+  PROCESS_BEGIN();
+
+  while(1) {
 
+    // Wait for a group order of the server, then send its branches and give
+    // the aggregated acknowledgements to the server
+    PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+    while(group_step(&runicast, NULL))
+    {
+      etimer_set(&et, GROUP_STEP_PERIOD);
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    }
   }
 
   PROCESS_END();
@@ -289,6 +311,8 @@ PROCESS_THREAD(send_orders, ev, data)
 /*---------------------------------------------------------------------------*/
 PROCESS_THREAD(receive_data, ev, data)
 {
+  static struct etimer et;
+
   PROCESS_EXITHANDLER(runicast_close(&runicast);)
     
   PROCESS_BEGIN();
@@ -297,8 +321,15 @@ PROCESS_THREAD(receive_data, ev, data)
 
   while(1) {
 
-    // Wait for SRV / CMD to forward
-    PROCESS_WAIT_EVENT();
+    // The SRV are given to the server by recv_ruc, this thread only gives
+    // their reporting slots to the neighbors (see node_slots.h)
+    PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+    // Reporting slots of the new children, or of the ones out of their slot
+    while(slots_step(&runicast))
+    {
+      etimer_set(&et, SLOTS_STEP_PERIOD);
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    }
   
   }
 
@@ -306,3 +337,42 @@ PROCESS_THREAD(receive_data, ev, data)
 }
 
 /*---------------------------------------------------------------------------*/
+
+// Serial commands thread (route dump, statistics)
+PROCESS_THREAD(serial_commands, ev, data)
+{
+  static clock_time_t last_dump = 0;
+
+  PROCESS_BEGIN();
+
+  while(1) {
+
+    PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
+
+    if(strcmp((char *)data, ROUTE_DUMP_COMMAND) == 0)
+    {
+      if(route_dump_allowed(&last_dump))
+      {
+        dump_routes();
+      }
+      else
+      {
+        LOG_WARN(ROUTING, "[ROUTING] Route dump rate-limited\n");
+      }
+    }
+    else if(strcmp((char *)data, STATS_COMMAND) == 0)
+    {
+      printf("[STATS] Duplicates suppressed : %u SRV, %u COM\n", dedup_suppressed_srv, dedup_suppressed_com);
+      printf("[STATS] Group orders dropped (queue full) : %u\n", group_dropped);
+      retx_dump();
+      slots_dump();
+    }
+    else if(PROFILE_ENABLED && strcmp((char *)data, PROFILE_COMMAND) == 0)
+    {
+      profile_dump();
+    }
+  }
+
+  PROCESS_END();
+}
+/*---------------------------------------------------------------------------*/
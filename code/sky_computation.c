@@ -4,34 +4,120 @@
 #include "lib/list.h"
 #include "lib/memb.h"
 #include "lib/random.h"
+#include "dev/serial-line.h"
+
+#include "node_log.h"
+#include "node_message.h"
+#include "node_dedup.h"
+#include "node_retx.h"
+
+// Single image (see sky_node.c) : the node is also a sensor, and only decides
+// for its children once promoted to the computation role (computation_role)
+#ifndef NODE_IMAGE
+#define NODE_IMAGE 0
+#endif
+#if NODE_IMAGE
+#include "leds.h"
+#endif
+
+// Decision of the valves : DECISION_SLOPE or DECISION_FORECAST (see valve_needed)
+#define DECISION_SLOPE 0
+#define DECISION_FORECAST 1
+#ifndef DECISION_MODE
+#define DECISION_MODE DECISION_SLOPE
+#endif
+
+// Version of the routes and children records of the checkpoint (the children
+// also hold the forecast state in DECISION_FORECAST, the single image saves its role)
+#define PERSIST_VERSION (4 + 16 * DECISION_MODE + 32 * NODE_IMAGE)
+#include "node_persist.h"
+#include "node_group.h"
+#include "node_profile.h"
+#include "node_links.h"
+#include "node_slots.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
-// Runicast thing
-#define MAX_RETRANSMISSIONS 4
+// Parent selection : the RSSI of a NDR is reduced by the border load / LOAD_PENALTY_DIVIDER
+#define LOAD_PENALTY_DIVIDER 4
 
 // The max number of route to save
-#define MAX_ROUTES 30 // Adapt it for your network
+#ifndef MAX_ROUTES
+#define MAX_ROUTES 50 // Adapt it for your network
+#endif
 
-// The amount of message to wait before define "inactive"
+// The amount of SRV (of any node) to wait before define "inactive"
 #define INACTIVE_MESSAGE 20 
 
 // The amount of value to store before computing
 #define NUMBER_OF_SAVED_VALUES 5 
 
 // The number of children that a computation node handle
-#define MAX_CHILDREN 5 // Adapt it for your network
+#ifndef MAX_CHILDREN
+#define MAX_CHILDREN 10 // Adapt it for your network
+#endif
 
-// Size of the Rime ID in the messages
-#define ID_SIZE 3
-
-// The time to left a valve open
+// The time to left a valve open (in readings of the child)
+#ifndef OPEN_TIME
 #define OPEN_TIME 10
-
-// Used to correctly print the ID in the messages
-#define STR_(X) #X
-#define STR(X) STR_(X)
+#endif
+
+// A valve is opened when the slope of the last readings is above SLOPE_THRESHOLD
+// (both can be set at run time in the host replay, see host/replay_computation.c)
+#ifndef SLOPE_THRESHOLD
+#define SLOPE_THRESHOLD 1.0
+#endif
+
+// DECISION_FORECAST : the slopes of a child are smoothed by Holt's linear
+// method, in fixed point (FORECAST_ONE is 1.0) : the level and the trend move
+// by 1/FORECAST_ALPHA and 1/FORECAST_BETA of their error at each reading.
+// The valve opens as soon as the slope forecast FORECAST_HORIZON readings
+// ahead is above SLOPE_THRESHOLD + FORECAST_HYSTERESIS, and it is kept open
+// while the forecast is above SLOPE_THRESHOLD - FORECAST_HYSTERESIS : a
+// borderline child does not flap, each flap costs a multi-hop COM.
+#define FORECAST_ONE 256
+#define FORECAST_ALPHA 2
+#define FORECAST_BETA 4
+#define FORECAST_HORIZON 3
+#define FORECAST_HYSTERESIS (FORECAST_ONE / 8)
+// The slopes are clamped, so that the level and the trend fit in an int16_t
+#define FORECAST_MAX_SLOPE 32
+
+// Max number of relays between a child and the computation node
+#define MAX_CHILD_PATH_HOPS 4
+
+// Child selection : every REBALANCE_PERIOD, the best scored node that is not
+// a child replaces the worst scored child if its score is higher by at least
+// REBALANCE_HYSTERESIS (at most one swap per period, to limit the churn)
+#define REBALANCE_PERIOD (5 * 60 * CLOCK_SECOND)
+#define REBALANCE_HYSTERESIS 8
+
+// Promotion of a relay (see promote_choose) : when all the slots are taken,
+// the neighbor that forwarded the most SRV of the nodes that are not children
+// during a REBALANCE_PERIOD (at least PROMOTE_MIN_SRV) is asked to take the
+// computation role. Only a node of the single image accepts, so the same
+// neighbor is not asked twice in a row.
+#define PROMOTE_MIN_SRV 20
+#define PROMOTE_NEIGHBORS 4
+
+// Weights of the score (see route_score)
+#define SCORE_TRAFFIC_WEIGHT 4
+#define SCORE_VOLATILITY_WEIGHT 1
+#define SCORE_HOPS_WEIGHT 4
+
+// Period of the check of the hand-offs to send (see send_handoff)
+#define HANDOFF_PERIOD (2 * CLOCK_SECOND)
+
+// What the server receives about the children that are decided here :
+// UPLINK_NONE : nothing, UPLINK_SUMMARY : a summary every SUMMARY_PERIOD (see send_summary)
+#define UPLINK_NONE 0
+#define UPLINK_SUMMARY 1
+#ifndef CHILD_UPLINK_MODE
+#define CHILD_UPLINK_MODE UPLINK_SUMMARY
+#endif
+#define SUMMARY_PERIOD (5 * 60 * CLOCK_SECOND)
 
 /* This structure holds information about the routes. */
 struct routes {
@@ -39,19 +125,26 @@ struct routes {
   // The ->next pointer is needed for Contiki list
   struct routes *next;
 
-  // The id that we want to reach
-  int id;
+  // The id that we want to reach (Rime ID, fits in one byte)
+  // No next hop is stored : the COMs carry their source route
+  uint8_t id;
 
-  // Where to forward the message
-  linkaddr_t addr_fwd;
-
-  // int used to determine whether or not the node is still active
-  int age;
+  // Used to determine whether or not the node is still active
+  uint8_t age : 6;
 
   // If = 0 this is a child
   // If = 1 this is not a child
   // If = 2 then collecting data before making child
-  int is_child;
+  uint8_t is_child : 2;
+
+  // Inputs of the child selection score (see route_score)
+  // Last reading, and average change between two readings
+  uint8_t last_value;
+  uint8_t volatility;
+  // SRV received during the current REBALANCE_PERIOD (saturates at 15)
+  uint8_t traffic : 4;
+  // Relays between the node and this computation node (saturates at 15)
+  uint8_t hops : 4;
 
 };
 
@@ -61,20 +154,58 @@ struct children {
   struct children *next;
 
   // The child's id
-  int id;
+  uint8_t id;
 
-  // Values from sensors
-  int last_values[NUMBER_OF_SAVED_VALUES];
+  // Values from sensors (the air quality is between 1 and 99)
+  uint8_t last_values[NUMBER_OF_SAVED_VALUES];
 
   //number of values stored
-  int nvalues;
+  uint8_t nvalues : 4;
 
   // Variables to know when close a valve (after 10min)
-  int is_open;
-  int time_it_has_been_opened;
+  uint8_t is_open : 1;
+
+  // The forecast of the slope started (DECISION_FORECAST)
+  uint8_t forecast_ready : 1;
+
+  // State asked to the server, not received yet : the valve state of the
+  // child is not known here (see receive_handoff)
+  uint8_t handoff_wait : 1;
+  uint8_t time_it_has_been_opened;
+
+  // New child, its state must be asked to the server (see send_handoff)
+  uint8_t handoff : 1;
+
+  // SRV received since the last summary (saturates at 127)
+  uint8_t samples : 7;
+
+  // Seqno of the last COM sent to the child (SEQNO_MAX if none), its SRV
+  // tell if it was executed
+  uint8_t last_order;
+
+  // Relays between the child and this node (path of its last SRV),
+  // used as source route for the orders
+  uint8_t path[MAX_CHILD_PATH_HOPS];
+  uint8_t path_hops;
+
+#if DECISION_MODE == DECISION_FORECAST
+  // Level and trend of the slope (fixed point, see valve_needed)
+  int16_t slope_level;
+  int16_t slope_trend;
+#endif
 
 };
 
+// The bit-fields above must be able to hold these constants
+#if INACTIVE_MESSAGE > 63 || NUMBER_OF_SAVED_VALUES > 15 || OPEN_TIME > 255
+#error "INACTIVE_MESSAGE, NUMBER_OF_SAVED_VALUES or OPEN_TIME too large for the tables"
+#endif
+
+// A hand-off carries the whole window of a child
+#if NUMBER_OF_SAVED_VALUES != HND_MAX_VALUES
+#error "NUMBER_OF_SAVED_VALUES must be HND_MAX_VALUES"
+#endif
+
 // memory allocation for routes
 MEMB(routes_memb, struct routes, MAX_ROUTES);
 LIST(routes_list);
@@ -83,24 +214,28 @@ LIST(routes_list);
 MEMB(children_memb, struct children, MAX_CHILDREN);
 LIST(children_list);
 
-// Utils function for computing the Rime ID
-int power(int a, int b)
-{
-  int res = 1;
-  size_t i;
-  for(i = 0 ; i < b ; i++)
-  {
-    res = res * a;
-  }
-  return res;
-}
+// Build-time RAM budget of the routes and children tables (see "make ram-report")
+// On the MSP430 a route takes 9 bytes (memb counter included) : 5 bytes of
+// fields, the 2 bytes list pointer and 1 byte of padding. A child takes 19
+// bytes (23 with DECISION_FORECAST), 5 of them for its source route. The
+// budget is 50 routes and 10 children, raise it with MAX_ROUTES/MAX_CHILDREN.
+#if DECISION_MODE == DECISION_FORECAST
+#define TABLES_RAM_BUDGET 680
+#else
+#define TABLES_RAM_BUDGET 640
+#endif
+#ifdef __MSP430__
+typedef char tables_ram_budget_check[(MAX_ROUTES * (sizeof(struct routes) + 1)
+  + MAX_CHILDREN * (sizeof(struct children) + 1) <= TABLES_RAM_BUDGET) ? 1 : -1];
+#endif
 
 // Computing the slope of child values
-float get_slope(int* last_values)
+float get_slope(uint8_t* last_values)
 {
-  printf("[SLOPE COMPUTATION] Computing slope...\n");
+  LOG_DBG(SLOPE, "[SLOPE COMPUTATION] Computing slope...\n");
   size_t i;
   float sumX=0, sumY=0, sumX2=0, sumXY=0, a, b;
+  PROFILE_BEGIN(PROFILE_GET_SLOPE);
   for (i = 0 ; i < NUMBER_OF_SAVED_VALUES ; i++)
   {
     sumX = sumX + (i+1);
@@ -110,54 +245,145 @@ float get_slope(int* last_values)
   }
   b = (NUMBER_OF_SAVED_VALUES*sumXY-sumX*sumY)/(NUMBER_OF_SAVED_VALUES*sumX2-sumX*sumX);
   a = (sumY - b*sumX)/NUMBER_OF_SAVED_VALUES;
+  PROFILE_END(PROFILE_GET_SLOPE);
   return -b/a;
 }
 
-//Utils to send order to a node
-void send_order(int order, int id, struct runicast_conn *c)
+// Decision of a child with the slope of its last readings : 1 if its valve
+// must be open (or stay open)
+int valve_needed(struct children *child, float slope)
 {
-  printf("[ORDER] Send order %d to node %d\n", order, id);
-
-  char message[10];
-  sprintf(message, "COM%d%0"STR(ID_SIZE)"d", order, id);
-  packetbuf_copyfrom(message, strlen(message));
+#if DECISION_MODE == DECISION_FORECAST
+  int32_t x, level, trend;
 
-  struct routes *route;
-  /* Check if we already know this routes. */
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  // Flat readings at 0 give a NaN slope, it counts as 0
+  if (slope > FORECAST_MAX_SLOPE)
   {
-    // We break out of the loop if the address in the list matches with from
-    if((int)route->id == (int)id) 
-    {
-      break;
-    }
-
+    slope = FORECAST_MAX_SLOPE;
+  }
+  else if (slope < -FORECAST_MAX_SLOPE)
+  {
+    slope = -FORECAST_MAX_SLOPE;
+  }
+  else if (slope != slope)
+  {
+    slope = 0;
   }
+  x = (int32_t)(slope * FORECAST_ONE);
 
-  // If new_route is NULL, this node was not found in our list
-  if(NULL == route)
+  if (!child->forecast_ready)
   {
-    printf("[ORDER] No route for node %d\n", id);
+    level = x;
+    trend = 0;
+    child->forecast_ready = 1;
   }
-  else 
+  else
+  {
+    level = child->slope_level + child->slope_trend;
+    level += (x - level) / FORECAST_ALPHA;
+    trend = child->slope_trend + (level - child->slope_level - child->slope_trend) / FORECAST_BETA;
+  }
+  child->slope_level = level;
+  child->slope_trend = trend;
+
+  return level + FORECAST_HORIZON * trend > (int32_t)(SLOPE_THRESHOLD * FORECAST_ONE)
+    + (child->is_open ? -FORECAST_HYSTERESIS : FORECAST_HYSTERESIS);
+#else
+  return slope > SLOPE_THRESHOLD;
+#endif
+}
+
+// Sequence number of the next COM sent by this node
+static uint8_t order_seqno;
+
+//Utils to send order to a child, along the path of its last SRV
+// trace : seqno of the SRV of the child that triggered the order
+void send_order(int order, struct children *child, int trace, struct runicast_conn *c)
+{
+  linkaddr_t next_hop;
+  struct msg_com com;
+  uint8_t i;
+  PROFILE_BEGIN(PROFILE_SEND_ORDER);
+
+  LOG_DBG(ORDER, "[ORDER] Send order %d to node %d\n", order, child->id);
+
+  msg_build_com(order, child->id, linkaddr_node_addr.u8[0], order_seqno, trace);
+  child->last_order = order_seqno;
+  order_seqno = (order_seqno + 1) % SEQNO_MAX;
+
+  for(i = 0 ; i < child->path_hops ; i++)
   {
-    runicast_send(c, &route->addr_fwd, MAX_RETRANSMISSIONS);
-    printf("[ORDER] Sending order %d to the node %d (%s)\n", order, route->addr_fwd.u8[0], message);
+    msg_com_append_hop(child->path[i]);
   }
 
+  // Built here : only a corrupted path of the child makes it malformed
+  if (msg_parse_com(&com) < 0)
+  {
+    LOG_ERR(ORDER, "[ORDER] Malformed order for node %d not sent\n", child->id);
+    PROFILE_END(PROFILE_SEND_ORDER);
+    return;
+  }
+  msg_id_to_addr(&next_hop, msg_com_next_hop(&com));
+  retx_send(c, &next_hop);
+  LOG_TRACE("com_send", child->id, trace);
+  LOG_INFO(ORDER, "[ORDER] Sending order %d for node %d to the node %d\n", order, child->id, next_hop.u8[0]);
+  PROFILE_END(PROFILE_SEND_ORDER);
 }
 
 
+#if NODE_IMAGE
+// Sensor role of the single image, like z1_sensor.c
+// State of the valve, and origin and seqno of the last COM executed (given in the SRV)
+static uint8_t valve_open = 0;
+static uint8_t order_origin = ORIGIN_SERVER;
+static uint8_t order_applied = SEQNO_MAX - 1;
+
+// Sequence number of the next SRV sent by this node
+static uint8_t srv_seqno;
+
+// The valve is simulated by the LEDs (red : closed, green : open)
+// trace : seqno of the SRV that triggered the order, the actuation time ends its trace
+void execute_order(int order, int trace)
+{
+  if(order == valve_open)
+  {
+    LOG_DBG(ORDER, "[ORDER] Valve already in state %d\n", order);
+    return;
+  }
+  valve_open = order;
+  LOG_TRACE("actuate", linkaddr_node_addr.u8[0], trace);
+  leds_on(order ? LEDS_GREEN : LEDS_RED);
+  leds_off(order ? LEDS_RED : LEDS_GREEN);
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 PROCESS(network_setup, "Network Setup");
 PROCESS(forwarding_messages, "Forwarding SRV & COM");
-AUTOSTART_PROCESSES(&network_setup, &forwarding_messages);
-
-static linkaddr_t *parent_node;
+PROCESS(serial_commands, "Serial commands");
+#if NODE_IMAGE
+PROCESS(send_sensor_data, "Send Sensor Data");
+AUTOSTART_PROCESSES(&network_setup, &send_sensor_data, &forwarding_messages, &serial_commands);
+#else
+AUTOSTART_PROCESSES(&network_setup, &forwarding_messages, &serial_commands);
+#endif
+
+static linkaddr_t parent_node;
 static int not_connected = 1;
 static int parent_signal = -9999;
+
+// Load of the border reached through the parent (given in its NDR)
+static int parent_load = 0;
 static int number_of_children = 0;
 
+// Role of the node : always the computation role, but in the single image
+// that starts as a relay (see role_set)
+static uint8_t computation_role = !NODE_IMAGE;
+#if NODE_IMAGE
+// Time of the last role change (see rebalance_children)
+static clock_time_t role_start;
+#endif
+
 // Used to get a children using RIME id. 
 // When a new child is created, it might not be in the list already.
 // This function creates any new child that does not yet exist.
@@ -174,11 +400,205 @@ struct children* get_children(int id)
   // If the child does not exist, it needs to be created
   if ( child == NULL ) // From 2 to 0
   {
-    printf("requested non-existing child %d\n", id);
+    LOG_ERR(ROUTING, "[ROUTING] Requested non-existing child %d\n", id);
   }
   return child;
 }
 
+// Score of a node as a child : the more SRV it sends and the more its
+// readings change, the more upstream traffic and decision latency are saved
+// by deciding here. The closer it is, the cheaper its orders are.
+int route_score(struct routes *route)
+{
+  return SCORE_TRAFFIC_WEIGHT * route->traffic + SCORE_VOLATILITY_WEIGHT * route->volatility
+    - SCORE_HOPS_WEIGHT * route->hops;
+}
+
+// Best scored node that could become a child (NULL if there is none)
+struct routes* best_candidate()
+{
+  struct routes *route, *best = NULL;
+
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+  {
+    if(route->is_child == 1 && route->hops <= MAX_CHILD_PATH_HOPS
+      && (best == NULL || route_score(route) > route_score(best)))
+    {
+      best = route;
+    }
+  }
+  return best;
+}
+
+// Give the slot of a child to a new node, that collects data before making decisions
+void reuse_child(struct children *child, struct routes *route)
+{
+  route->is_child = 2;
+  child->id = route->id;
+  child->nvalues = 0;
+  child->is_open = 0;
+  child->forecast_ready = 0;
+  child->handoff_wait = 0;
+  child->time_it_has_been_opened = 0;
+  child->path_hops = 0;
+  child->handoff = 1;
+  child->samples = 0;
+  child->last_order = SEQNO_MAX;
+  persist_dirty = 1;
+}
+
+// A child given back to the server, waiting to be sent (see send_handoff)
+static struct children handback;
+static uint8_t handback_pending = 0;
+
+// Ask the server for the state of a new child, or give a child back to it
+// Called out of the packet handlers : packetbuf and the runicast must be free
+void send_handoff(struct runicast_conn *c)
+{
+  struct children *child;
+
+  if (not_connected || runicast_is_transmitting(c) || !retx_ready(&parent_node))
+  {
+    return;
+  }
+
+#if NODE_IMAGE
+  // Relay role : the children left are given back to the server, one at a time
+  if (!computation_role && (child = list_head(children_list)) != NULL)
+  {
+    struct routes *route;
+
+    msg_build_hnd(HND_BACK, linkaddr_node_addr.u8[0], child->id, child->is_open,
+      child->time_it_has_been_opened, child->nvalues, child->last_values);
+    retx_send(c, &parent_node);
+    LOG_INFO(ROUTING, "[ROUTING] Node %d given back to the server (relay role)\n", child->id);
+    for(route = list_head(routes_list); route != NULL && route->id != child->id; route = list_item_next(route));
+    if (route != NULL)
+    {
+      list_remove(routes_list, route);
+      memb_free(&routes_memb, route);
+    }
+    list_remove(children_list, child);
+    memb_free(&children_memb, child);
+    number_of_children--;
+    persist_dirty = 1;
+    return;
+  }
+#endif
+
+  if (handback_pending)
+  {
+    msg_build_hnd(HND_BACK, linkaddr_node_addr.u8[0], handback.id, handback.is_open,
+      handback.time_it_has_been_opened, handback.nvalues, handback.last_values);
+    retx_send(c, &parent_node);
+    handback_pending = 0;
+    LOG_INFO(ROUTING, "[ROUTING] Node %d given back to the server (valve open:%d)\n", handback.id, handback.is_open);
+    return;
+  }
+
+  for(child = list_head(children_list); child != NULL; child = list_item_next(child))
+  {
+    if (child->handoff)
+    {
+      msg_build_hnd(HND_REQUEST, linkaddr_node_addr.u8[0], child->id, 0, 0, 0, NULL);
+      retx_send(c, &parent_node);
+      child->handoff = 0;
+      child->handoff_wait = 1;
+      LOG_DBG(ROUTING, "[ROUTING] State of the new child %d asked to the server\n", child->id);
+      return;
+    }
+  }
+}
+
+#if CHILD_UPLINK_MODE == UPLINK_SUMMARY
+// Position of the next child to summarize in the children list, -1 if no summary is due
+static int summary_next = -1;
+
+// Send the summary of the next SUM_MAX_ENTRIES children decided here.
+// Called out of the packet handlers, like send_handoff. Returns 1 if sent.
+int send_summary(struct runicast_conn *c)
+{
+  struct children *child;
+  int i, min, max, sum, entries = 0, position = 0;
+
+  if (summary_next < 0 || !computation_role || not_connected || runicast_is_transmitting(c) || !retx_ready(&parent_node))
+  {
+    return 0;
+  }
+
+  msg_build_sum(linkaddr_node_addr.u8[0]);
+  for(child = list_head(children_list); child != NULL; child = list_item_next(child), position++)
+  {
+    // The collecting children are forwarded to the server
+    if (position < summary_next || child->nvalues < NUMBER_OF_SAVED_VALUES)
+    {
+      continue;
+    }
+    if (entries == SUM_MAX_ENTRIES)
+    {
+      break;
+    }
+    min = max = sum = child->last_values[0];
+    for(i = 1 ; i < NUMBER_OF_SAVED_VALUES ; i++)
+    {
+      min = child->last_values[i] < min ? child->last_values[i] : min;
+      max = child->last_values[i] > max ? child->last_values[i] : max;
+      sum += child->last_values[i];
+    }
+    msg_sum_add(child->id, min, max, sum / NUMBER_OF_SAVED_VALUES,
+      (int)(get_slope(child->last_values) * 100), child->is_open, child->samples);
+    child->samples = 0;
+    entries++;
+  }
+  // The next message starts where this one stopped
+  summary_next = child == NULL ? -1 : position;
+
+  if (entries == 0)
+  {
+    return 0;
+  }
+  retx_send(c, &parent_node);
+  LOG_DBG(DATA, "[DATA THREAD] Summary of %d children sent\n", entries);
+  return 1;
+}
+#endif
+
+// State of a new child pushed by the server : the child does not need to
+// collect NUMBER_OF_SAVED_VALUES readings before the decisions start
+void receive_handoff(struct msg_hnd *hnd)
+{
+  struct routes *route;
+  struct children *child;
+  int i;
+
+  for(route = list_head(routes_list); route != NULL && route->id != hnd->child; route = list_item_next(route));
+  for(child = list_head(children_list); child != NULL && child->id != hnd->child; child = list_item_next(child));
+
+  // Only a child that is still collecting data uses the state of the server
+  if (route == NULL || child == NULL || route->is_child != 2)
+  {
+    return;
+  }
+  // The SRV of a collecting child are forwarded, the server has all of them
+  if (hnd->nvalues > child->nvalues)
+  {
+    for(i = 0 ; i < hnd->nvalues ; i++)
+    {
+      child->last_values[i] = msg_hnd_value(hnd, i);
+    }
+    child->nvalues = hnd->nvalues;
+  }
+  child->is_open = hnd->open;
+  child->time_it_has_been_opened = hnd->timer;
+  child->handoff_wait = 0;
+  if (child->nvalues == NUMBER_OF_SAVED_VALUES)
+  {
+    route->is_child = 0;
+  }
+  persist_dirty = 1;
+  LOG_INFO(ROUTING, "[ROUTING] State of the child %d received (%d values, valve open:%d)\n", child->id, hnd->nvalues, hnd->open);
+}
+
 // Used to remove a child
 // It is called when a child stops communication by remove_old_routes()
 // This function selects a new child to replace the removed one from the list of routes
@@ -191,37 +611,36 @@ void remove_child(int id)
   {
     if ( child->id == id )
     {
-      printf("removed child \n");
+      LOG_INFO(ROUTING, "[ROUTING] Removed child %d\n", id);
       // We don't really remove it now, maybe we will re-use it juste after
       break;
     }
   }
+  if (child == NULL)
+  {
+    return;
+  }
 
+  // The best scored sensor (*) that communicates with the server replaces it
+  struct routes *route = best_candidate();
 
-  struct routes *route;
-
-  // If a sensor (*) communicate with the server, wait to have 30 data messages
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  if(route != NULL)
   {
-    if(route->is_child == 1) // Can't just be !route->is_child
-    {
-      // As long as is_child = 2 (computation node does not
-      // have NUMBER_OF_SAVED_VALUES data points), 
-      // messages will be forwarded to the server
+    // As long as is_child = 2 (computation node does not
+    // have NUMBER_OF_SAVED_VALUES data points), 
+    // messages will be forwarded to the server
 
-      // We re-use the previous child (the child to delete)
-      route->is_child = 2; 
-      child->id = route->id;
-      child->nvalues = 0;
-      break; // only select one
-    }
+    // We re-use the previous child (the child to delete)
+    reuse_child(child, route);
   }
   // If there are no one (*) , remove a child from the counter
   // and we really delete the child
-  if(route == NULL)
+  else
   {
     number_of_children--;
+    persist_dirty = 1;
     list_remove(children_list, child);
+    memb_free(&children_memb, child);
   }
 }
 
@@ -229,19 +648,24 @@ void remove_child(int id)
 // It uses the INACTIVE_MESSAGE constant
 void remove_old_routes()
 {
-  struct routes *route;
+  struct routes *route, *next;
 
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  for(route = list_head(routes_list); route != NULL; route = next) 
   {
+    // list_remove() clears route->next, get it before
+    next = list_item_next(route);
+
     // If no more message since a long time, the route can be deleted
     if(INACTIVE_MESSAGE <= (int) route->age ) 
     {
-      printf("removed route \n");
+      LOG_INFO(ROUTING, "[ROUTING] Removed route to %d\n", route->id);
       if (route->is_child != 1) // Can't just be route->is_child
       {
         remove_child(route->id);
       }
       list_remove(routes_list, route);
+      memb_free(&routes_memb, route);
+      persist_dirty = 1;
     }
     // Else, increase its age
     else 
@@ -251,53 +675,351 @@ void remove_old_routes()
   }
 }
 
+// Neighbors that forwarded SRV of nodes that are not children during the
+// current REBALANCE_PERIOD (see promote_choose)
+struct promote_neighbor {
+  uint8_t id;
+  uint8_t srv;
+};
+static struct promote_neighbor promote_neighbors[PROMOTE_NEIGHBORS];
+static uint8_t promote_count = 0;
+
+// Neighbor to ask for the computation role (0 if none), and the last one asked
+static uint8_t promote_pending = 0;
+static uint8_t promote_last = 0;
+
+// A SRV of a node that is not a child, forwarded to this full node by the relay from
+void promote_count_srv(const linkaddr_t *from)
+{
+  uint8_t i, j;
+
+  for(i = 0 ; i < promote_count && promote_neighbors[i].id != from->u8[0] ; i++);
+  if(i == promote_count)
+  {
+    // New neighbor : a free entry, else the one with the least SRV
+    if(promote_count < PROMOTE_NEIGHBORS)
+    {
+      i = promote_count++;
+    }
+    else
+    {
+      for(i = 0, j = 1 ; j < PROMOTE_NEIGHBORS ; j++)
+      {
+        if(promote_neighbors[j].srv < promote_neighbors[i].srv)
+        {
+          i = j;
+        }
+      }
+    }
+    promote_neighbors[i].id = from->u8[0];
+    promote_neighbors[i].srv = 0;
+  }
+  if(promote_neighbors[i].srv < 255)
+  {
+    promote_neighbors[i].srv++;
+  }
+}
+
+// End of a REBALANCE_PERIOD : the neighbor that relays the most nodes this
+// full node cannot decide is asked to decide them (see send_promotion)
+void promote_choose()
+{
+  struct promote_neighbor *best = NULL;
+  uint8_t i;
+
+  for(i = 0 ; i < promote_count ; i++)
+  {
+    if(promote_neighbors[i].id != promote_last && promote_neighbors[i].srv >= PROMOTE_MIN_SRV
+      && (best == NULL || promote_neighbors[i].srv > best->srv))
+    {
+      best = &promote_neighbors[i];
+    }
+  }
+  if(best != NULL && number_of_children >= MAX_CHILDREN)
+  {
+    promote_pending = best->id;
+    promote_last = best->id;
+    LOG_INFO(ROUTING, "[ROUTING] Relay %d forwarded %d SRV of other nodes, asked to decide them\n", best->id, best->srv);
+  }
+  promote_count = 0;
+}
+
+// Send the ROL chosen by promote_choose, to a neighbor (no source route).
+// Called out of the packet handlers, like send_handoff. Returns 1 if sent.
+int send_promotion(struct runicast_conn *c)
+{
+  linkaddr_t to;
+
+  msg_id_to_addr(&to, promote_pending);
+  if (promote_pending == 0 || runicast_is_transmitting(c) || !retx_ready(&to))
+  {
+    return 0;
+  }
+  msg_build_rol(ROL_COMPUTATION, promote_pending);
+  retx_send(c, &to);
+  promote_pending = 0;
+  return 1;
+}
+
+#if NODE_IMAGE
+// Promotion (ROL_COMPUTATION) or demotion (ROL_RELAY) of this node. A relay
+// forwards every SRV : it forgets its routes, and send_handoff gives its
+// children back to the server with their state. A promoted node takes its
+// children from the SRV it forwards, like any computation node.
+void role_set(int role)
+{
+  struct routes *route, *next;
+
+  if (role == computation_role)
+  {
+    return;
+  }
+  computation_role = role;
+  role_start = clock_time();
+  persist_dirty = 1;
+  if (role == ROL_RELAY)
+  {
+    for(route = list_head(routes_list); route != NULL; route = next)
+    {
+      next = list_item_next(route);
+      if (route->is_child == 1)
+      {
+        list_remove(routes_list, route);
+        memb_free(&routes_memb, route);
+      }
+    }
+    promote_pending = 0;
+  }
+  LOG_INFO(ROUTING, "[ROUTING] Now in the %s role\n", role == ROL_COMPUTATION ? "computation" : "relay");
+}
+#endif
+
+// Periodic child selection : a free slot goes to the best candidate, else the
+// best candidate replaces the worst child when it is clearly better.
+// The replaced child is given back to the server with its valve state.
+void rebalance_children()
+{
+  struct routes *route, *worst = NULL;
+  struct routes *best;
+  struct children *child;
+
+#if NODE_IMAGE
+  // A promoted node that did not get any child during a whole period goes
+  // back to the relay role
+  if (computation_role && number_of_children == 0 && (clock_time_t)(clock_time() - role_start) >= REBALANCE_PERIOD)
+  {
+    role_set(ROL_RELAY);
+  }
+  if (!computation_role)
+  {
+    return;
+  }
+#endif
+
+  // Too many nodes to decide here : a relay is asked to decide some of them
+  promote_choose();
+
+  best = best_candidate();
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+  {
+    if(route->is_child != 1 && (worst == NULL || route_score(route) < route_score(worst)))
+    {
+      worst = route;
+    }
+  }
+
+  if(best != NULL && number_of_children < MAX_CHILDREN)
+  {
+    child = memb_alloc(&children_memb);
+    if(child != NULL)
+    {
+      list_add(children_list, child);
+      number_of_children++;
+      reuse_child(child, best);
+      LOG_INFO(ROUTING, "[ROUTING] Node %d becomes a child (score %d)\n", best->id, route_score(best));
+    }
+  }
+  else if(best != NULL && worst != NULL && !handback_pending
+    && route_score(best) >= route_score(worst) + REBALANCE_HYSTERESIS
+    && (child = get_children(worst->id)) != NULL)
+  {
+    LOG_INFO(ROUTING, "[ROUTING] Node %d (score %d) replaces the child %d (score %d)\n", best->id, route_score(best), worst->id, route_score(worst));
+    handback = *child;
+    handback_pending = 1;
+    worst->is_child = 1;
+    reuse_child(child, best);
+  }
+
+  // New period
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route))
+  {
+    route->traffic = 0;
+  }
+}
+
+// Bytes of a route / child saved in the checkpoint (all but the list pointer)
+#define ROUTE_RECORD_SIZE (sizeof(struct routes) - offsetof(struct routes, id))
+#define CHILD_RECORD_SIZE (sizeof(struct children) - offsetof(struct children, id))
+
+// Checkpoint of the parent, the routes and the children in the flash (see node_persist.h)
+void save_state()
+{
+  struct routes *route;
+  struct children *child;
+  uint8_t count[2];
+  int fd = persist_begin_write();
+  int error;
+
+  if(fd < 0)
+  {
+    LOG_WARN(SETUP, "[SETUP THREAD] Impossible to save the state\n");
+    return;
+  }
+  count[0] = list_length(routes_list);
+  count[1] = list_length(children_list);
+  error = persist_write(fd, &not_connected, sizeof(not_connected)) < 0
+    || persist_write(fd, &parent_node, sizeof(parent_node)) < 0
+    || persist_write(fd, &parent_signal, sizeof(parent_signal)) < 0
+    || persist_write(fd, &parent_load, sizeof(parent_load)) < 0
+    || persist_write(fd, count, sizeof(count)) < 0;
+#if NODE_IMAGE
+  error = error || persist_write(fd, &computation_role, sizeof(computation_role)) < 0;
+#endif
+  for(route = list_head(routes_list); route != NULL && !error; route = list_item_next(route))
+  {
+    error = persist_write(fd, &route->id, ROUTE_RECORD_SIZE) < 0;
+  }
+  for(child = list_head(children_list); child != NULL && !error; child = list_item_next(child))
+  {
+    error = persist_write(fd, &child->id, CHILD_RECORD_SIZE) < 0;
+  }
+  persist_end_write(fd, error);
+  LOG_DBG(SETUP, "[SETUP THREAD] State saved (%d routes, %d children)\n", count[0], count[1]);
+}
+
+// Restore the last checkpoint. It is validated lazily : the parent is used
+// until a runicast to it times out, the routes age out if their node is gone
+void restore_state()
+{
+  struct routes *route;
+  struct children *child;
+  uint8_t count[2];
+  int connected, signal, load;
+  linkaddr_t parent;
+  int fd = persist_begin_read();
+
+  if(fd < 0)
+  {
+    return;
+  }
+  if(cfs_read(fd, &connected, sizeof(connected)) != sizeof(connected)
+    || cfs_read(fd, &parent, sizeof(parent)) != sizeof(parent)
+    || cfs_read(fd, &signal, sizeof(signal)) != sizeof(signal)
+    || cfs_read(fd, &load, sizeof(load)) != sizeof(load)
+    || cfs_read(fd, count, sizeof(count)) != sizeof(count))
+  {
+    cfs_close(fd);
+    return;
+  }
+  if(!connected)
+  {
+    not_connected = 0;
+    linkaddr_copy(&parent_node, &parent);
+    parent_signal = signal;
+    parent_load = load;
+  }
+#if NODE_IMAGE
+  // A promoted node stays promoted
+  if(cfs_read(fd, &computation_role, sizeof(computation_role)) != sizeof(computation_role))
+  {
+    computation_role = 0;
+    cfs_close(fd);
+    return;
+  }
+#endif
+  for( ; count[0] > 0 && (route = memb_alloc(&routes_memb)) != NULL ; count[0]--)
+  {
+    if(cfs_read(fd, &route->id, ROUTE_RECORD_SIZE) != ROUTE_RECORD_SIZE)
+    {
+      memb_free(&routes_memb, route);
+      break;
+    }
+    route->age = 0;
+    list_add(routes_list, route);
+  }
+  for( ; count[1] > 0 && (child = memb_alloc(&children_memb)) != NULL ; count[1]--)
+  {
+    if(cfs_read(fd, &child->id, CHILD_RECORD_SIZE) != CHILD_RECORD_SIZE)
+    {
+      memb_free(&children_memb, child);
+      break;
+    }
+    list_add(children_list, child);
+    number_of_children++;
+  }
+  cfs_close(fd);
+  LOG_INFO(SETUP, "[SETUP THREAD] Restored from the flash : parent %d, %d routes, %d children\n", parent_node.u8[0], list_length(routes_list), number_of_children);
+}
+
+// Print the current routes. Only called on demand (see ROUTE_DUMP_COMMAND),
+// never from the packet handlers.
+void dump_routes()
+{
+  struct routes *route;
+
+#if NODE_IMAGE
+  printf("[ROUTING] Parent is %d (connected:%d), computation role:%d\n", parent_node.u8[0], !not_connected, computation_role);
+#endif
+
+  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  {
+    printf("[ROUTING] Node %d (child:%d, age:%d, score:%d)\n", route->id, route->is_child, route->age, route_score(route));
+  }
+}
+
 /*---------------------------------------------------------------------------*/
 static void
 recv_bdcst(struct broadcast_conn *c, const linkaddr_t *from)
 {
-  char message[10];
-  strcpy(message, (char *)packetbuf_dataptr());
-
+  enum msg_type type = msg_type();
 
   // If announce from a new node
-  if (message[0] == 'N' && message[1] == 'D' && message[2] == 'A')
+  if (type == MSG_NDA)
   {
     // If this node is connected to the server
-    printf("[SETUP THREAD] Announce received : %s\n", message);
+    LOG_DBG(SETUP, "[SETUP THREAD] Announce received from %d\n", from->u8[0]);
     if (!not_connected)
     {
       // Respond to the child
-      sprintf(message, "NDR%0"STR(ID_SIZE)"d", from->u8[0]);
-      packetbuf_copyfrom(message, strlen(message));
+      msg_build_ndr(from->u8[0], parent_load);
       broadcast_send(c);
-      printf("[SETUP THREAD] Reponse (NDR) sent : %s\n", message);
+      LOG_DBG(SETUP, "[SETUP THREAD] Reponse (NDR) sent to %d\n", from->u8[0]);
     }
     
   }
 
   // If response to an announce
-  else if (message[0] == 'N' && message[1] == 'D' && message[2] == 'R')
+  else if (type == MSG_NDR)
   {
-    size_t i;
-    int recipient = 0;
-
-    // Compute the recipient from the radio message
-    for(i = 0 ; i < ID_SIZE ; i++)
-    {
-      recipient = recipient + ((message[i+3]-48) * power(10,ID_SIZE-i-1));
-    }
+    struct msg_ndr ndr;
 
     // If the message is for this node (avoid broadcast loop)
-    if(recipient == linkaddr_node_addr.u8[0])
+    if(msg_parse_ndr(&ndr) == 0 && ndr.recipient == linkaddr_node_addr.u8[0])
     {
-      //printf("[SETUP THREAD] Parent response received from %d with signal %d\n", from->u8[0], packetbuf_attr(PACKETBUF_ATTR_RSSI));
+      // The signal is penalised by the load of the border, to spread the
+      // sensors across the borders
+      int signal = packetbuf_attr(PACKETBUF_ATTR_RSSI) - ndr.load / LOAD_PENALTY_DIVIDER;
+
+      LOG_DBG(SETUP, "[SETUP THREAD] Parent response received from %d with signal %d (load %d)\n", from->u8[0], packetbuf_attr(PACKETBUF_ATTR_RSSI), ndr.load);
 
-      if (packetbuf_attr(PACKETBUF_ATTR_RSSI) > parent_signal)
+      if (signal > parent_signal)
       {
-        printf("[SETUP THREAD] This parent is better than %d\n", parent_signal);
-        parent_signal = packetbuf_attr(PACKETBUF_ATTR_RSSI);
-        linkaddr_copy(parent_node, from);
+        LOG_INFO(SETUP, "[SETUP THREAD] This parent is better than %d\n", parent_signal);
+        parent_signal = signal;
+        parent_load = ndr.load;
+        linkaddr_copy(&parent_node, from);
         not_connected = 0;
+        persist_dirty = 1;
       }
     }
     
@@ -306,14 +1028,15 @@ recv_bdcst(struct broadcast_conn *c, const linkaddr_t *from)
 }
 
 
-static const struct broadcast_callbacks broadcast_call = {recv_bdcst};
+PROFILE_BROADCAST_RECV(PROFILE_RECV_BDCST, recv_bdcst)
+static const struct broadcast_callbacks broadcast_call = {PROFILED(recv_bdcst)};
 static struct broadcast_conn broadcast;
 
 /*---------------------------------------------------------------------------*/
 PROCESS_THREAD(network_setup, ev, data)
 {
   static struct etimer et;
-  char message[10];
+  static clock_time_t rebalance_start;
 
   PROCESS_EXITHANDLER(broadcast_close(&broadcast);)
 
@@ -321,17 +1044,38 @@ PROCESS_THREAD(network_setup, ev, data)
 
   broadcast_open(&broadcast, 129, &broadcast_call);
 
-  printf("[COMPUTATION] I'm %d\n", linkaddr_node_addr.u8[0]);
+#if NODE_IMAGE
+  LOG_INFO(SETUP, "[NODE] I'm %d (computation role:%d)\n", linkaddr_node_addr.u8[0], computation_role);
+#else
+  LOG_INFO(SETUP, "[COMPUTATION] I'm %d\n", linkaddr_node_addr.u8[0]);
+#endif
+
+  // Warm restart : the parent and the routes of the last checkpoint are used at once
+  restore_state();
+
+  rebalance_start = clock_time();
 
   while(1) {
 
     // If the node is not connected to the network, try to connect
     if (not_connected)
     {
-      sprintf(message, "NDA");
-      packetbuf_copyfrom(message, strlen(message));
+      msg_build_nda();
       broadcast_send(&broadcast);
-      printf("[SETUP THREAD] Announce (NDA) sent : %s\n", message);
+      LOG_DBG(SETUP, "[SETUP THREAD] Announce (NDA) sent\n");
+    }
+
+    // Choose the children again with the scores of the last period
+    if ((clock_time_t)(clock_time() - rebalance_start) >= REBALANCE_PERIOD)
+    {
+      rebalance_children();
+      rebalance_start = clock_time();
+    }
+
+    // Save the tables if they changed (not too often, to spare the flash)
+    if (persist_due())
+    {
+      save_state();
     }
 
     /* Delay 2-4 seconds */
@@ -348,23 +1092,55 @@ PROCESS_THREAD(network_setup, ev, data)
 static void
 recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
 {
-  char message[10];
-  strcpy(message, (char *)packetbuf_dataptr());
-  int original_sender = 0, data;
-  size_t i;
+  // The message is parsed in packetbuf, and forwarded without being copied
+  enum msg_type type = msg_type();
+  int original_sender, data;
   float slope;
   
   // If SRV message, need to forward it to the parent_node
-  if (message[0] == 'S' && message[1] == 'R' && message[2] == 'V')
+  if (type == MSG_SRV)
   {
-    // Get the air_quality
-    data = (message[3]-48)*10 + (message[4]-48);
+    struct msg_srv srv;
+
+    if (msg_parse_srv(&srv) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed SRV received from %d\n", from->u8[0]);
+      return;
+    }
+
+    // Retransmission of a SRV already handled (lost ACK) : it must not be
+    // forwarded again, nor stored twice in last_values
+    if (dedup_is_duplicate(MSG_SRV, srv.id, srv.id, srv.seqno))
+    {
+      LOG_DBG(FWD, "[FORWARDING THREAD] Duplicate SRV %d of node %d dropped\n", srv.seqno, srv.id);
+      return;
+    }
 
-    // Get the address of the original sender
-    for(i = 0 ; i < ID_SIZE ; i++)
+    // A new neighbor, or a neighbor out of its reporting slot
+    if (slots_received(from, srv.id))
     {
-      original_sender = original_sender + ((message[i+5]-48) * power(10,ID_SIZE-i-1));
+      process_poll(&forwarding_messages);
+    }
+    data = srv.air_quality;
+    original_sender = srv.id;
+
+#if NODE_IMAGE
+    // Relay role : forwarded like by a sensor (the children left are given
+    // back by send_handoff, the server decides them again)
+    if (!computation_role)
+    {
+      if (msg_srv_append_hop(linkaddr_node_addr.u8[0]) < 0)
+      {
+        LOG_WARN(FWD, "[FORWARDING THREAD] Path of the SRV of node %d is full\n", original_sender);
+      }
+      if (!linkaddr_cmp(from, &parent_node))
+      {
+        links_forwarded(LINKS_SRV, &parent_node, retx_send(c, &parent_node));
+        LOG_TRACE("srv_fwd", original_sender, srv.seqno);
+      }
+      return;
     }
+#endif
 
     struct routes *new_route;
 
@@ -385,17 +1161,25 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
     {
       new_route = memb_alloc(&routes_memb);
 
-      // If allocation failed, we give up.
+      // If allocation failed, we give up (the old routes still age, to free some)
       if(new_route == NULL) 
       {
+        remove_old_routes();
         return;
       }
+      new_route->id = original_sender;
+      new_route->last_value = 0;
+      new_route->volatility = 0;
+      new_route->traffic = 0;
+      list_add(routes_list, new_route);
+      persist_dirty = 1;
 
-      // IF there is space left for a child
-      if (number_of_children < MAX_CHILDREN)
+      // IF there is space left for a child (close enough to be source routed)
+      if (number_of_children < MAX_CHILDREN && srv.path_hops <= MAX_CHILD_PATH_HOPS)
       {
-        //Creating the child
-        new_route->is_child = 0;
+        //Creating the child, it collects data (and its SRV reach the server)
+        //until it has enough values or the server sent its state (see receive_handoff)
+        new_route->is_child = 2;
         struct children *new_child;
         new_child = memb_alloc(&children_memb);
         if (new_child == NULL) // If there is an error / no memory left
@@ -409,6 +1193,13 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
           new_child->id = original_sender;
           new_child->nvalues = 0;
           new_child->is_open = 0;
+          new_child->forecast_ready = 0;
+          new_child->handoff_wait = 0;
+          new_child->time_it_has_been_opened = 0;
+          new_child->path_hops = 0;
+          new_child->handoff = 1;
+          new_child->samples = 0;
+          new_child->last_order = SEQNO_MAX;
           list_add(children_list, new_child);
         }
         // Always increment, if there was a memory problem
@@ -420,19 +1211,22 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
       { // If there are too many children
         new_route->is_child = 1;
       }
-      printf("[ROUTING] New node\n");
+      LOG_DBG(ROUTING, "[ROUTING] New node\n");
     }
     new_route->age = 0; // used for deleting routes after they stop communicating
-    if (!linkaddr_cmp(&new_route->addr_fwd, from)) // If routing has changed
-    {
-      // Initialize the new_route.
-      linkaddr_copy(&new_route->addr_fwd, from);
-      new_route->id = original_sender;
 
-      // Add the route into the list
-      printf("[ROUTING] New route\n");
-      list_add(routes_list, new_route);
+    // Inputs of the child selection score
+    if (new_route->traffic < 15)
+    {
+      new_route->traffic++;
     }
+    new_route->hops = srv.path_hops < 15 ? srv.path_hops : 15;
+    if (new_route->last_value != 0)
+    {
+      // Average of the absolute change, over about 4 readings
+      new_route->volatility = new_route->volatility - new_route->volatility / 4 + abs(data - new_route->last_value) / 4;
+    }
+    new_route->last_value = data;
     
     if ( new_route->is_child != 1 )
     {
@@ -440,6 +1234,24 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
       struct children *this_child;
       this_child = get_children(original_sender);
 
+      // Keep the path of the child up to date, it is the source route of its orders
+      if (srv.path_hops <= MAX_CHILD_PATH_HOPS)
+      {
+        for (this_child->path_hops = 0; this_child->path_hops < srv.path_hops; this_child->path_hops++)
+        {
+          this_child->path[this_child->path_hops] = msg_srv_hop(&srv, this_child->path_hops);
+        }
+      }
+      else
+      {
+        LOG_WARN(ROUTING, "[ROUTING] Child %d is now %d hops away, path not updated\n", original_sender, srv.path_hops);
+      }
+
+      if (this_child->samples < 127)
+      {
+        this_child->samples++;
+      }
+
       // When the array is not full, append data
       if (this_child->nvalues < NUMBER_OF_SAVED_VALUES){
         this_child->last_values[this_child->nvalues] = data;
@@ -459,20 +1271,45 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
     } // When the message comes from either a node that is not a child (1) or that is becomming a child (2)
     if ( new_route->is_child != 0 )
     {
-      // Forward the message to the parent
-      packetbuf_copyfrom(message, strlen(message));
-      runicast_send(c, parent_node, MAX_RETRANSMISSIONS);
+      // No slot for this node, a relay could decide it (see promote_choose)
+      if (new_route->is_child == 1 && number_of_children >= MAX_CHILDREN && from->u8[0] != original_sender)
+      {
+        promote_count_srv(from);
+      }
 
-      printf("[FORWARDING THREAD] [TO SERVER] Forwarding from %d to %d (%s)\n", from->u8[0], parent_node->u8[0], message);
+      // Record this node in the path of the SRV, the server uses it to route its COMs
+      if (msg_srv_append_hop(linkaddr_node_addr.u8[0]) < 0)
+      {
+        LOG_WARN(FWD, "[FORWARDING THREAD] Path of the SRV of node %d is full\n", original_sender);
+      }
+
+      // Forward the message (still in packetbuf) to the parent, unless it
+      // comes from it (feedback loop)
+      if (!linkaddr_cmp(from, &parent_node))
+      {
+        links_forwarded(LINKS_SRV, &parent_node, retx_send(c, &parent_node));
+        LOG_TRACE("srv_fwd", original_sender, srv.seqno);
+      }
+
+      LOG_DBG(FWD, "[FORWARDING THREAD] [TO SERVER] Forwarding from %d to %d (data %d of node %d)\n", from->u8[0], parent_node.u8[0], data, original_sender);
     } // When the node is a child
     if ( new_route->is_child == 0 )
     {  
       struct children *this_child;
+      uint8_t ordered = 0;
       this_child = get_children(original_sender);
+
+      // The state of the server never came (lost, or no complete path) : the
+      // valve is the one the child reports
+      if (this_child->handoff_wait)
+      {
+        this_child->is_open = srv.valve;
+        this_child->handoff_wait = 0;
+      }
       // Check if there are enough values
       if (this_child->nvalues == NUMBER_OF_SAVED_VALUES)
       {
-        printf("[SLOPE COMPUTATION] Enough data for child %d, computing the slope...\n", this_child->id);
+        LOG_DBG(SLOPE, "[SLOPE COMPUTATION] Enough data for child %d, computing the slope...\n", this_child->id);
         slope = get_slope(this_child->last_values);
 
         // If already open, increase the "timer"
@@ -480,9 +1317,9 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
           this_child->time_it_has_been_opened++;
 
         // If the valve need to be open
-        if( slope > 1.0 )
+        if( valve_needed(this_child, slope) )
         {
-          printf("[SLOPE COMPUTATION] The slope is > 1, opening the valve of node %d\n", this_child->id);
+          LOG_INFO(SLOPE, "[SLOPE COMPUTATION] The slope is (or will be) > 1, opening the valve of node %d\n", this_child->id);
           
           // Already open
           if (this_child->is_open == 1)
@@ -493,8 +1330,10 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
           else
           {
             // If the valve is closed
-            send_order(1, this_child->id, c);
+            send_order(1, this_child, srv.seqno, c);
+            ordered = 1;
             this_child->is_open = 1;
+            persist_dirty = 1;
             this_child->time_it_has_been_opened = 0;
           }
 
@@ -508,89 +1347,388 @@ recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
             if (this_child->time_it_has_been_opened >= OPEN_TIME)
             {
               // We can close it
-              send_order(0, this_child->id, c);
+              send_order(0, this_child, srv.seqno, c);
+              ordered = 1;
               this_child->is_open = 0;
+              persist_dirty = 1;
             }
           }
         }
       }
+
+      // The valve of the child is not in the state decided here, and it did not
+      // execute the last order (of this node) : the COM was lost, send it again
+      if (!ordered && !this_child->handoff && !this_child->handoff_wait && srv.valve != this_child->is_open
+        && (srv.origin != linkaddr_node_addr.u8[0] || srv.applied != this_child->last_order))
+      {
+        LOG_INFO(ORDER, "[ORDER] Node %d missed its order (valve %d, last order %d), sending it again\n", this_child->id, srv.valve, srv.applied);
+        send_order(this_child->is_open, this_child, srv.seqno, c);
+      }
     }
 
+    // Check if there are some old routes to delete : the routes age with the
+    // SRV only, the control messages (SUM, GAK, HND, ...) do not tell the
+    // activity of the sensors
+    remove_old_routes();
   }
 
   // If order message, forward it
-  else if (message[0] == 'C' && message[1] == 'O' && message[2] == 'M')
+  else if (type == MSG_COM)
   {
-    int recipient = 0;    
-    int order = message[3] - '0';
-    struct routes *route;
+    struct msg_com com;
+    linkaddr_t next_hop;
 
-    // Get the address of the message recipient 
-    for(i = 0 ; i < ID_SIZE ; i++)
+    if (msg_parse_com(&com) < 0)
     {
-      recipient = recipient + ((message[i+4]-48) * power(10,ID_SIZE-i-1));
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed COM received from %d\n", from->u8[0]);
+      return;
     }
 
-    // gets the right route
-    for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+    // Retransmission of a COM already forwarded (lost ACK)
+    if (dedup_is_duplicate(MSG_COM, com.id, com.origin, com.seqno))
     {
-      // We break out of the loop if the address in the list matches with from
-      if((int)route->id == (int)recipient) 
-      {
-        break;
-      }
+      LOG_DBG(FWD, "[FORWARDING THREAD] Duplicate COM %d for node %d dropped\n", com.seqno, com.id);
+      return;
     }
 
-    // Forward the message to the parent
-    packetbuf_copyfrom(message, strlen(message));
-    runicast_send(c, &route->addr_fwd, MAX_RETRANSMISSIONS);
+#if NODE_IMAGE
+    // Sensor role : the order of its own valve
+    if (com.id == linkaddr_node_addr.u8[0])
+    {
+      LOG_INFO(ORDER, "[ORDER] I was ordered by %d to follow order %d\n", from->u8[0], com.order);
+      execute_order(com.order, com.trace);
+      order_origin = com.origin;
+      order_applied = com.seqno;
+      return;
+    }
+#endif
+
+    // Forward the message (still in packetbuf) along its source route
+    msg_id_to_addr(&next_hop, msg_com_next_hop(&com));
+    links_forwarded(LINKS_COM, &next_hop, retx_send(c, &next_hop));
+    LOG_TRACE("com_fwd", com.id, com.trace);
     
-    printf("[FORWARDING THREAD] [TO NODE] Order: %d received from %d for %d (%s)\n", order, from->u8[0], recipient, message);
+    LOG_DBG(FWD, "[FORWARDING THREAD] [TO NODE] Order: %d received from %d for %d\n", com.order, from->u8[0], com.id);
     
   }
-  else
+  // If group order, the branches are sent by the forwarding thread
+  else if (type == MSG_GCM)
   {
-    // DEBUG PURPOSE
-    printf("[FORWARDING THREAD] Weird message received from %d.%d\n", from->u8[0], from->u8[1]);
-  }
+    struct msg_gcm gcm;
+    int trace;
 
-  /* ===== DEBUG ==== */
-  struct routes *route;
+    if (msg_parse_gcm(&gcm) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed GCM received from %d\n", from->u8[0]);
+      return;
+    }
+    if (dedup_is_duplicate(MSG_GCM, 0, ORIGIN_SERVER, gcm.seqno))
+    {
+      LOG_DBG(FWD, "[FORWARDING THREAD] Duplicate GCM %d dropped\n", gcm.seqno);
+      return;
+    }
+#if NODE_IMAGE
+    if (group_receive(&gcm, &trace))
+    {
+      execute_order(gcm.order, trace);
+    }
+#else
+    group_receive(&gcm, &trace);
+#endif
+    process_poll(&forwarding_messages);
+  }
+  // If acknowledgement of a group order, aggregate it or forward it as it is
+  else if (type == MSG_GAK)
+  {
+    struct msg_gak gak;
 
-  // Print the current routes
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+    if (msg_parse_gak(&gak) == 0 && !group_receive_ack(&gak) && !linkaddr_cmp(from, &parent_node))
+    {
+      retx_send(c, &parent_node);
+    }
+  }
+  // If summary of another computation node or link counters, forward it to the parent as it is
+  // (not back to the parent it comes from, during a transient loop)
+  else if (type == MSG_SUM || type == MSG_LNK)
   {
-    printf("[ROUTING] To contact %d (child:%d), I have to send to %d\n", route->id, route->is_child, route->addr_fwd.u8[0]);
-    //list_remove(routes_list, route);
+    if (!linkaddr_cmp(from, &parent_node))
+    {
+      retx_send(c, &parent_node);
+    }
   }
-  /* ================ */
+  // If hand-off of a child between the server and a computation node
+  else if (type == MSG_HND)
+  {
+    struct msg_hnd hnd;
+    linkaddr_t next_hop;
 
-  // Check if there are some old routes to delete
-  remove_old_routes();
+    if (msg_parse_hnd(&hnd) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed HND received from %d\n", from->u8[0]);
+      return;
+    }
 
+    if (hnd.kind == HND_STATE && hnd.node == linkaddr_node_addr.u8[0])
+    {
+      // Late answer to a node demoted meanwhile : its child is already given back
+      if (computation_role)
+      {
+        receive_handoff(&hnd);
+      }
+    }
+    else if (hnd.kind == HND_STATE)
+    {
+      // To another computation node, along its source route
+      msg_id_to_addr(&next_hop, msg_hnd_next_hop(&hnd));
+      retx_send(c, &next_hop);
+    }
+    else if (!linkaddr_cmp(from, &parent_node))
+    {
+      // To the server, the path is recorded like for a SRV
+      msg_hnd_append_hop(linkaddr_node_addr.u8[0]);
+      retx_send(c, &parent_node);
+    }
+  }
+  // If role given by the server or a computation node, take it or forward it
+  else if (type == MSG_ROL)
+  {
+    struct msg_rol rol;
+    linkaddr_t next_hop;
+
+    if (msg_parse_rol(&rol) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed ROL received from %d\n", from->u8[0]);
+      return;
+    }
+    if (rol.id == linkaddr_node_addr.u8[0])
+    {
+#if NODE_IMAGE
+      role_set(rol.role);
+#else
+      LOG_WARN(ROUTING, "[ROUTING] Role %d asked by %d, only the single image changes its role\n", rol.role, from->u8[0]);
+#endif
+    }
+    else
+    {
+      msg_id_to_addr(&next_hop, msg_rol_next_hop(&rol));
+      retx_send(c, &next_hop);
+    }
+  }
+#if NODE_IMAGE
+  // If reporting slot given by the parent, the next SRV is sent in it
+  else if (type == MSG_SLT)
+  {
+    int wait = msg_parse_slt();
+
+    if (wait >= 0 && linkaddr_cmp(from, &parent_node))
+    {
+      if (slots_follow(from, wait))
+      {
+        process_poll(&forwarding_messages);
+      }
+      process_poll(&send_sensor_data);
+    }
+  }
+#endif
+  else
+  {
+    // DEBUG PURPOSE
+    LOG_WARN(FWD, "[FORWARDING THREAD] Weird message received from %d.%d\n", from->u8[0], from->u8[1]);
+  }
 }
 
 /*---------------------------------------------------------------------------*/
 
-static const struct runicast_callbacks runicast_callbacks = {recv_ruc};
+static void
+sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
+{
+  links_done(to, retransmissions, 0);
+  retx_done(to, retransmissions, 0);
+}
+static void
+timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
+{
+  links_done(to, retransmissions, 1);
+
+  // If the parent does not answer (for example a parent restored from the
+  // flash that is gone), re-run the network setup to find a new one. A single
+  // timeout only puts the link in backoff (see node_retx.h).
+  if (retx_done(to, retransmissions, 1) && linkaddr_cmp(to, &parent_node))
+  {
+    LOG_WARN(FWD, "[FORWARDING THREAD] Parent %d does not answer, disconnected from network.\n", to->u8[0]);
+    not_connected = 1;
+    parent_signal = -9999;
+    persist_dirty = 1;
+  }
+}
+
+PROFILE_RUNICAST_RECV(PROFILE_RECV_RUC, recv_ruc)
+static const struct runicast_callbacks runicast_callbacks = {PROFILED(recv_ruc), sent_runicast, timedout_runicast};
 static struct runicast_conn runicast;
 
+/*---------------------------------------------------------------------------*/
+#if NODE_IMAGE
+// Sensor role : one SRV per period, in the slot given by the parent (like z1_sensor.c)
+PROCESS_THREAD(send_sensor_data, ev, data)
+{
+  static struct etimer et;
+  int air_quality;
+
+  PROCESS_EXITHANDLER(runicast_close(&runicast);)
+
+  PROCESS_BEGIN();
+
+  // The valve is closed (red led on)
+  leds_off(LEDS_ALL);
+  leds_on(LEDS_RED);
+
+  runicast_open(&runicast, 144, &runicast_callbacks);
+
+  // Random first sequence number, so a rebooted node is not seen as duplicate
+  srv_seqno = random_rand() % SEQNO_MAX;
+
+  // Random start (0-59 s), like the installation of the sensors
+  etimer_set(&et, random_rand() % 60 * CLOCK_SECOND);
+  PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+
+  while(1) {
+
+    // Start of a period : the slots of the children follow it
+    slots_own_report();
+
+    // (the parent is not in backoff after a timeout)
+    if (!not_connected && !runicast_is_transmitting(&runicast) && retx_ready(&parent_node))
+    {
+      air_quality = random_rand() % 99 + 1;
+      msg_build_srv(air_quality, linkaddr_node_addr.u8[0], srv_seqno, valve_open, order_origin, order_applied);
+      retx_send(&runicast, &parent_node);
+      LOG_TRACE("sample", linkaddr_node_addr.u8[0], srv_seqno);
+      srv_seqno = (srv_seqno + 1) % SEQNO_MAX;
+      LOG_INFO(DATA, "[DATA THREAD] Sending data (%d) to the server\n", air_quality);
+    }
+
+    // Next period, or the slot given by the parent
+    etimer_set(&et, SLOTS_PERIOD);
+    do
+    {
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || ev == PROCESS_EVENT_POLL);
+      if (ev == PROCESS_EVENT_POLL)
+      {
+        etimer_set(&et, slots_wait());
+      }
+    } while(!etimer_expired(&et));
+  }
+
+  PROCESS_END();
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 PROCESS_THREAD(forwarding_messages, ev, data)
 {
+#if CHILD_UPLINK_MODE == UPLINK_SUMMARY
+  static clock_time_t summary_start;
+#endif
+
   PROCESS_EXITHANDLER(runicast_close(&runicast);)
     
   PROCESS_BEGIN();
 
   runicast_open(&runicast, 144, &runicast_callbacks);
 
+  // Random first sequence number, so a rebooted node is not seen as duplicate
+  order_seqno = random_rand() % SEQNO_MAX;
+
+#if CHILD_UPLINK_MODE == UPLINK_SUMMARY
+  summary_start = clock_time();
+#endif
+
   while(1) {
+    static struct etimer et;
+
+    // The SRV / COM are forwarded by recv_ruc, this thread only sends the
+    // group orders, the hand-offs, the summaries of the children, the link
+    // counters and the promotions (the runicast must not be busy)
+    etimer_set(&et, HANDOFF_PERIOD);
+    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || ev == PROCESS_EVENT_POLL);
+
+    // Branches of a group order and their acknowledgements first
+    while(group_step(&runicast, &parent_node))
+    {
+      etimer_set(&et, GROUP_STEP_PERIOD);
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    }
+    // Reporting slots of the new children, or of the ones out of their slot
+    while(slots_step(&runicast))
+    {
+      etimer_set(&et, SLOTS_STEP_PERIOD);
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    }
 
-    // Wait for SRV / CMD to forward
-    PROCESS_WAIT_EVENT();
+#if CHILD_UPLINK_MODE == UPLINK_SUMMARY
+    if ((clock_time_t)(clock_time() - summary_start) >= SUMMARY_PERIOD)
+    {
+      summary_next = 0;
+      summary_start = clock_time();
+    }
+    if (send_summary(&runicast))
+    {
+      continue;
+    }
+#endif
+    if (!not_connected && links_report(&runicast, &parent_node))
+    {
+      continue;
+    }
+    if (send_promotion(&runicast))
+    {
+      continue;
+    }
+    send_handoff(&runicast);
   
   }
 
   PROCESS_END();
 }
+
+/*---------------------------------------------------------------------------*/
+
+// Serial commands thread (route dump, statistics)
+PROCESS_THREAD(serial_commands, ev, data)
+{
+  static clock_time_t last_dump = 0;
+
+  PROCESS_BEGIN();
+
+  while(1) {
+
+    PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
+
+    if(strcmp((char *)data, ROUTE_DUMP_COMMAND) == 0)
+    {
+      if(route_dump_allowed(&last_dump))
+      {
+        dump_routes();
+      }
+      else
+      {
+        LOG_WARN(ROUTING, "[ROUTING] Route dump rate-limited\n");
+      }
+    }
+    else if(strcmp((char *)data, STATS_COMMAND) == 0)
+    {
+      printf("[STATS] Duplicates suppressed : %u SRV, %u COM\n", dedup_suppressed_srv, dedup_suppressed_com);
+      printf("[STATS] Group orders dropped (queue full) : %u\n", group_dropped);
+      retx_dump();
+      slots_dump();
+      links_dump();
+    }
+    else if(PROFILE_ENABLED && strcmp((char *)data, PROFILE_COMMAND) == 0)
+    {
+      profile_dump();
+    }
+  }
+
+  PROCESS_END();
+}
 /*---------------------------------------------------------------------------*/
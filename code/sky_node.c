@@ -0,0 +1,8 @@
+// Single firmware image : a sensor that relays like z1_sensor.c, and that
+// the server or a loaded computation node can promote to the computation
+// role at run time, then demote again (see ROL in message_structure.txt).
+// It is the computation node with the sensor role built in, so every node
+// carries the routes and children tables.
+#define NODE_IMAGE 1
+
+#include "sky_computation.c"
@@ -0,0 +1,118 @@
+import sys
+
+# Latency from a dangerous sample to the actuation of the valve (see LOG_TRACE in node_log.h)
+#
+# Usage : python3 trace_latency.py cooja.log [server.log]
+#   The firmwares must be built with the trace lines : CFLAGS += -DLOG_LEVEL_TRACE=LOG_LEVEL_INFO
+#   cooja.log : output of the motes saved by Cooja ("time ID:node [TRACE] ..." per line,
+#               time in milliseconds or mm:ss.mmm)
+#   server.log : output of "server.py --trace" (optional, gives the time spent in the server)
+#
+# A trace is a SRV (origin, seqno) and the COM that echoes this seqno. Its stages are :
+#   uplink : sample -> srv_up (border) or com_send (computation node)
+#   server : srv_up -> com_down, the serial lines and the server (Cooja time)
+#   downlink : com_down or com_send -> actuate
+#   total : sample -> actuate
+# and each hop is the time between two consecutive trace lines of the same trace.
+
+UPLINK_END = ("srv_up", "com_send")
+DOWNLINK_START = ("com_down", "com_send")
+
+def parse_time(field):
+    # Cooja time, in seconds
+    if ":" in field:
+        seconds = 0.0
+        for part in field.split(":"):
+            seconds = seconds * 60 + float(part)
+        return seconds
+    return int(field) / 1000
+
+def read_cooja(path):
+    # List of (time, stage, origin, trace, node), in the order of the log
+    events = []
+    with open(path) as f:
+        for line in f:
+            if "[TRACE]" not in line:
+                continue
+            head, trace = line.split("[TRACE]", 1)
+            fields = trace.split()
+            try:
+                events.append((parse_time(head.split()[0]), fields[0], int(fields[1]), int(fields[2]), int(fields[3])))
+            except (ValueError, IndexError): #Line cut by another print
+                continue
+    return events
+
+def read_server(path):
+    # Time spent in the server between the SRV and the COM of each trace
+    received = {}
+    durations = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) != 6 or fields[0] != "[TRACE]":
+                continue
+            key = (int(fields[2]), int(fields[3]))
+            if fields[1] == "server_rx":
+                received[key] = float(fields[5])
+            elif fields[1] == "server_tx" and key in received:
+                durations.append(float(fields[5]) - received[key])
+    return durations
+
+def build_traces(events):
+    # A sample starts a new trace of its origin, the next lines of the same
+    # (origin, seqno) belong to it
+    current = {}
+    traces = []
+    for event in sorted(events, key=lambda e: e[0]):
+        key = (event[2], event[3])
+        if event[1] == "sample":
+            current[key] = [event]
+            traces.append(current[key])
+        elif key in current:
+            current[key].append(event)
+    return traces
+
+def first(trace, stages):
+    for event in trace:
+        if event[1] in stages:
+            return event[0]
+    return None
+
+def stats(name, values):
+    if not values:
+        print("{:<24} no data".format(name))
+        return
+    values = sorted(values)
+    print("{:<24} n={:<5} min={:8.3f} mean={:8.3f} p50={:8.3f} p95={:8.3f} max={:8.3f}".format(
+        name, len(values), values[0], sum(values) / len(values), values[len(values) // 2],
+        values[min(len(values) - 1, int(len(values) * 0.95))], values[-1]))
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print("Usage : python3 trace_latency.py cooja.log [server.log]")
+        sys.exit(1)
+    traces = [t for t in build_traces(read_cooja(sys.argv[1])) if t[-1][1] == "actuate"]
+    stages = {"uplink": [], "server": [], "downlink": [], "total": []}
+    hops = {}
+    for trace in traces:
+        sample, actuate = trace[0][0], trace[-1][0]
+        uplink_end, downlink_start = first(trace, UPLINK_END), first(trace, DOWNLINK_START)
+        stages["total"].append(actuate - sample)
+        if uplink_end is not None:
+            stages["uplink"].append(uplink_end - sample)
+        if downlink_start is not None:
+            stages["downlink"].append(actuate - downlink_start)
+        if uplink_end is not None and downlink_start is not None and downlink_start > uplink_end:
+            stages["server"].append(downlink_start - uplink_end)
+        for before, after in zip(trace, trace[1:]):
+            hop = "{} {} -> {} {}".format(before[1], before[4], after[1], after[4])
+            hops.setdefault(hop, []).append(after[0] - before[0])
+
+    print("{} traces (seconds)".format(len(traces)))
+    for name, values in stages.items():
+        stats(name, values)
+    if len(sys.argv) > 2:
+        stats("in server.py", read_server(sys.argv[2]))
+    print("Per hop :")
+    for hop, values in sorted(hops.items()):
+        stats(hop, values)
@@ -0,0 +1,202 @@
+from decision import SensorTable, decide
+from multiprocessing import Event, Process, shared_memory
+import struct
+import time
+
+# Sharded decisions (server.py --workers N)
+#
+# The sensors are split across N worker processes by their id (id modulo N).
+# Each worker owns the readings and the valves of its sensors (a SensorTable),
+# and runs the regressions and the valve state machine of its shard. The server
+# keeps the network side : the borders, the paths, the duplicates and the orders.
+#
+# The server and a worker exchange fixed size records through two rings in
+# shared memory (one per direction), nothing is pickled. An event per ring
+# wakes up its reader after a batch of records.
+#
+#   server -> worker : SRV (reading), BACK (hand-back), STATE (state asked by a hand-off), TICK, STOP
+#   worker -> server : ORDER (decision of a tick), DONE (end of a tick, with the open valves), STATE (answer)
+
+RING_CAPACITY = 1 << 16 # Records per ring
+RING_FULL_WAIT = 0.0005 # Seconds between two checks of a full ring
+TICK_TIMEOUT = 5.0 # Seconds to wait for the decisions of all the workers
+STATE_VALUES = 5 # Readings in a STATE answer (HND_MAX_VALUES of server.py)
+
+SRV, BACK, STATE, TICK, STOP, ORDER, DONE = range(7)
+
+# kind, flag (open valve / order), nvalues, sensor, request, periods, time, values
+RECORD = struct.Struct("<BBBxIIid{}B3x".format(STATE_VALUES))
+HEADER = struct.Struct("<QQ") # Records written (head) and read (tail) since the start
+
+class Ring:
+    # Single producer, single consumer ring of RECORDs in shared memory
+    # The producer only writes the head, the consumer only the tail
+
+    def __init__(self, capacity=RING_CAPACITY):
+        self.capacity = capacity
+        self.shm = shared_memory.SharedMemory(create=True, size=HEADER.size + capacity * RECORD.size)
+        self.buf = self.shm.buf
+        HEADER.pack_into(self.buf, 0, 0, 0)
+        self.ready = Event()
+        self.written = 0 # Records written since the last notify
+
+    def __getstate__(self):
+        # Given to a worker by its name : the memory itself cannot be pickled
+        # (spawn and forkserver start methods)
+        return self.capacity, self.shm.name, self.ready
+
+    def __setstate__(self, state):
+        self.capacity, name, self.ready = state
+        self.shm = shared_memory.SharedMemory(name=name)
+        self.buf = self.shm.buf
+        self.written = 0
+
+    def write(self, kind, flag=0, nvalues=0, sensor=0, request=0, periods=0, when=0.0, values=()):
+        head, tail = HEADER.unpack_from(self.buf, 0)
+        while head - tail >= self.capacity: #Full : the reader is late
+            self.notify()
+            time.sleep(RING_FULL_WAIT)
+            head, tail = HEADER.unpack_from(self.buf, 0)
+        values = tuple(values) + (0,) * (STATE_VALUES - len(values))
+        RECORD.pack_into(self.buf, HEADER.size + (head % self.capacity) * RECORD.size,
+            kind, flag, nvalues, sensor, request, periods, when, *values)
+        struct.pack_into("<Q", self.buf, 0, head + 1) #Published once complete
+        self.written += 1
+
+    def notify(self):
+        # Wake up the reader, once per batch
+        if self.written:
+            self.ready.set()
+            self.written = 0
+
+    def read(self):
+        # All the records written since the last read
+        head, tail = HEADER.unpack_from(self.buf, 0)
+        records = [RECORD.unpack_from(self.buf, HEADER.size + (i % self.capacity) * RECORD.size) for i in range(tail, head)]
+        struct.pack_into("<Q", self.buf, 8, head)
+        return records
+
+    def wait(self, timeout=None):
+        # Wait for records, the ones written before the wake up are not missed
+        self.ready.wait(timeout)
+        self.ready.clear()
+
+    def close(self, unlink=False):
+        self.buf = None
+        self.shm.close()
+        if unlink:
+            self.shm.unlink()
+
+def sensor_name(sensor):
+    return "{:03d}".format(sensor)
+
+def worker(inbox, outbox, forecast):
+    # Decisions of one shard, until STOP
+    table = SensorTable()
+    while True:
+        inbox.wait()
+        for kind, flag, nvalues, sensor, request, periods, when, *values in inbox.read():
+            if kind == SRV:
+                table.append(sensor_name(sensor), values[0], when)
+            elif kind == BACK:
+                table.hand_back(sensor_name(sensor), flag == 1, periods, values[:nvalues], when)
+            elif kind == STATE:
+                is_open, periods = table.valve(sensor_name(sensor), when)
+                window = table.window(sensor_name(sensor), STATE_VALUES)
+                outbox.write(STATE, int(is_open), len(window), sensor, request, periods, values=window)
+            elif kind == TICK:
+                orders, _ = decide(table, when, forecast)
+                for sensor_id, order in orders:
+                    outbox.write(ORDER, int(order == "open"), sensor=int(sensor_id))
+                outbox.write(DONE, request=table.open_valves())
+            elif kind == STOP:
+                return
+        outbox.notify()
+
+class WorkerPool:
+    # Front-end of the workers, used by the main loop of the server in place of
+    # its SensorTable. It mirrors the valve of each sensor from the orders, the
+    # server needs it for each SRV (see order_missed).
+
+    def __init__(self, count, forecast=False):
+        self.inboxes = [Ring() for _ in range(count)]
+        self.outboxes = [Ring() for _ in range(count)]
+        self.processes = [Process(target=worker, args=(inbox, outbox, forecast), daemon=True)
+            for inbox, outbox in zip(self.inboxes, self.outboxes)]
+        for process in self.processes:
+            process.start()
+        self.open = set() # Sensors whose valve is open
+        self.requests = {} # Id of a STATE request -> context given by the server
+        self.next_request = 0
+        self.states = [] # Answers received, see take_states
+        self.orders = [] # Orders received (late ones of a worker included), see decide
+
+    def shard(self, sensor_id):
+        return self.inboxes[int(sensor_id) % len(self.inboxes)]
+
+    def append(self, sensor_id, new_value, receive_time):
+        self.shard(sensor_id).write(SRV, sensor=int(sensor_id), when=receive_time, values=(new_value,))
+
+    def hand_back(self, sensor_id, is_open, periods, values, now):
+        self.shard(sensor_id).write(BACK, int(is_open), len(values), int(sensor_id), periods=periods, when=now, values=values)
+        (self.open.add if is_open else self.open.discard)(sensor_id)
+
+    def valve_open(self, sensor_id):
+        return sensor_id in self.open
+
+    def request_state(self, sensor_id, now, context):
+        # The answer comes later, with the context (see take_states)
+        self.requests[self.next_request] = context
+        self.shard(sensor_id).write(STATE, sensor=int(sensor_id), request=self.next_request, when=now)
+        self.next_request = (self.next_request + 1) % (1 << 32)
+
+    def flush(self):
+        # End of a batch of records : wake up the workers
+        for inbox in self.inboxes:
+            inbox.notify()
+
+    def _receive(self, record):
+        kind, flag, nvalues, sensor, request, periods, when, *values = record
+        if kind == ORDER:
+            self.orders.append((sensor_name(sensor), "open" if flag else "close"))
+            (self.open.add if flag else self.open.discard)(sensor_name(sensor))
+        elif kind == STATE:
+            self.states.append((self.requests.pop(request), sensor_name(sensor), flag == 1, periods, values[:nvalues]))
+
+    def take_states(self):
+        # Answers to request_state : (context, sensor id, open, periods, readings)
+        for outbox in self.outboxes:
+            for record in outbox.read():
+                self._receive(record)
+        states, self.states = self.states, []
+        return states
+
+    def decide(self, now):
+        # Evaluation of all the shards : the orders and the number of open valves
+        # A worker that does not answer in time gives its orders at the next tick
+        open_valves = 0
+        for inbox in self.inboxes:
+            inbox.write(TICK, when=now)
+            inbox.notify()
+        deadline = time.time() + TICK_TIMEOUT
+        for outbox in self.outboxes:
+            done = False
+            while not done and time.time() < deadline:
+                outbox.wait(max(0, deadline - time.time()))
+                for record in outbox.read():
+                    if record[0] == DONE:
+                        done = True
+                        open_valves += record[4]
+                    else:
+                        self._receive(record)
+        orders, self.orders = self.orders, []
+        return orders, open_valves
+
+    def close(self):
+        for inbox in self.inboxes:
+            inbox.write(STOP)
+            inbox.notify()
+        for process in self.processes:
+            process.join(1.0)
+        for ring in self.inboxes + self.outboxes:
+            ring.close(unlink=True)
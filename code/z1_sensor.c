@@ -5,40 +5,45 @@
 #include "lib/memb.h"
 #include "lib/random.h"
 #include "leds.h"
+#include "dev/serial-line.h"
+
+#include "node_log.h"
+#include "node_message.h"
+#include "node_dedup.h"
+#include "node_retx.h"
+#include "node_persist.h"
+#include "node_group.h"
+#include "node_profile.h"
+#include "node_links.h"
+#include "node_slots.h"
 
 #include <stdio.h>
 
-// Runicast thing
-#define MAX_RETRANSMISSIONS 4
+// Parent selection : the RSSI of a NDR is reduced by the border load / LOAD_PENALTY_DIVIDER
+#define LOAD_PENALTY_DIVIDER 4
 
-// The max number of route to save
-#define MAX_ROUTES 30 // Adapt it for your network
+// Period of the check of the link counters to send (see links_report)
+#define LINKS_CHECK_PERIOD (10 * CLOCK_SECOND)
 
-#define INACTIVE_DATA_TRANSFERS 4
+// State of the valve, and origin and seqno of the last COM executed (given in the SRV)
+static uint8_t valve_open = 0;
+static uint8_t order_origin = ORIGIN_SERVER;
+static uint8_t order_applied = SEQNO_MAX - 1;
 
-// Size of the Rime ID in the messages
-#define ID_SIZE 3
-
-// Used to correctly print the id in the messages
-#define STR_(X) #X
-#define STR(X) STR_(X)
-
-// Utils function for computing the Rime ID
-int power(int a, int b)
+// Function to modify to adapt the order execution
+// In this case, we use LEDs to simulate the valve
+// trace : seqno of the SRV that triggered the order, the actuation time ends its trace
+// The order sets the valve, it is not a toggle : executing it twice is harmless
+void execute_order(int order, int trace)
 {
-  int res = 1;
-  size_t i;
-  for(i = 0 ; i < b ; i++)
+  if(order == valve_open)
   {
-    res = res * a;
+    LOG_DBG(ORDER, "[ORDER] Valve already in state %d\n", order);
+    return;
   }
-  return res;
-}
+  valve_open = order;
+  LOG_TRACE("actuate", linkaddr_node_addr.u8[0], trace);
 
-// Function to modify to adapt the order execution
-// In this case, we use LEDs to simulate the valve
-void execute_order(int order)
-{
   if(order == 1)
   {
     // If the valve is open, the green led is on
@@ -54,106 +59,119 @@ void execute_order(int order)
 }
 
 
-/* This structure holds information about the routes. */
-struct routes {
-
-  // The ->next pointer is needed for Contiki list
-  struct routes *next;
-
-  // The id that we want to reach
-  int id;
-
-  // Where to forward the message
-  linkaddr_t addr_fwd;
-
-  // int used to determine whether or not the node is still active
-  int age;
-
-};
-
-MEMB(routes_memb, struct routes, MAX_ROUTES);
-LIST(routes_list);
-
 /*---------------------------------------------------------------------------*/
 PROCESS(network_setup, "Network Setup");
 PROCESS(send_sensor_data, "Send Sensor Data");
 PROCESS(forwarding_messages, "Forwarding SRV & COM");
-AUTOSTART_PROCESSES(&network_setup, &send_sensor_data, &forwarding_messages);
+PROCESS(serial_commands, "Serial commands");
+AUTOSTART_PROCESSES(&network_setup, &send_sensor_data, &forwarding_messages, &serial_commands);
 
-static linkaddr_t *parent_node;
+static linkaddr_t parent_node;
 static int not_connected = 1;
 static int parent_signal = -9999;
 
-// This function is used to remove a node that has stopped communicating for a while.
-// It uses the INACTIVE_DATA_TRANSFERS constant
-void remove_old_routes()
+// Load of the border reached through the parent (given in its NDR)
+static int parent_load = 0;
+
+// Sequence number of the next SRV sent by this node
+static uint8_t srv_seqno;
+
+// Checkpoint of the parent in the flash (see node_persist.h)
+void save_state()
 {
-  struct routes *route;
+  int fd = persist_begin_write();
+  int error;
 
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+  if(fd < 0)
   {
-    // If no more message since a long time, the route can be deleted
-    if(INACTIVE_DATA_TRANSFERS <= (int) route->age ) 
-    {
-      printf("removed route \n");
-      list_remove(routes_list, route);
-    }
-    else 
-    {
-      // Else, increase its age
-      route->age += 1;
-    }
+    LOG_WARN(SETUP, "[SETUP THREAD] Impossible to save the state\n");
+    return;
+  }
+  error = persist_write(fd, &not_connected, sizeof(not_connected)) < 0
+    || persist_write(fd, &parent_node, sizeof(parent_node)) < 0
+    || persist_write(fd, &parent_signal, sizeof(parent_signal)) < 0
+    || persist_write(fd, &parent_load, sizeof(parent_load)) < 0;
+  persist_end_write(fd, error);
+  LOG_DBG(SETUP, "[SETUP THREAD] State saved (parent %d)\n", parent_node.u8[0]);
+}
+
+// Restore the parent of the last checkpoint, it is used until a runicast to it times out
+void restore_state()
+{
+  int fd = persist_begin_read();
+  int connected, signal, load;
+  linkaddr_t parent;
+
+  if(fd < 0)
+  {
+    return;
+  }
+  if(cfs_read(fd, &connected, sizeof(connected)) == sizeof(connected)
+    && cfs_read(fd, &parent, sizeof(parent)) == sizeof(parent)
+    && cfs_read(fd, &signal, sizeof(signal)) == sizeof(signal)
+    && cfs_read(fd, &load, sizeof(load)) == sizeof(load)
+    && !connected)
+  {
+    not_connected = 0;
+    linkaddr_copy(&parent_node, &parent);
+    parent_signal = signal;
+    parent_load = load;
+    LOG_INFO(SETUP, "[SETUP THREAD] Parent %d restored from the flash\n", parent_node.u8[0]);
   }
+  cfs_close(fd);
+}
+
+// Print the routing state. Only called on demand (see ROUTE_DUMP_COMMAND).
+// A sensor has no per-destination state : the COMs carry their source route.
+void dump_routes()
+{
+  printf("[ROUTING] Parent is %d (connected:%d)\n", parent_node.u8[0], !not_connected);
 }
 
 /*---------------------------------------------------------------------------*/
 static void
 recv_bdcst(struct broadcast_conn *c, const linkaddr_t *from)
 {
-  char message[10];
-  strcpy(message, (char *)packetbuf_dataptr());
-
+  enum msg_type type = msg_type();
 
   // If announce from a new node
-  if (message[0] == 'N' && message[1] == 'D' && message[2] == 'A')
+  if (type == MSG_NDA)
   {
     // If this node is connected to the server
-    printf("[SETUP THREAD] Announce received : %s\n", message);
+    LOG_DBG(SETUP, "[SETUP THREAD] Announce received from %d\n", from->u8[0]);
     if (!not_connected)
     {
       // Respond to the child
-      sprintf(message, "NDR%0"STR(ID_SIZE)"d", from->u8[0]);
-      packetbuf_copyfrom(message, strlen(message));
+      msg_build_ndr(from->u8[0], parent_load);
       broadcast_send(c);
-      printf("[SETUP THREAD] Reponse (NDR) sent : %s\n", message);
+      LOG_DBG(SETUP, "[SETUP THREAD] Reponse (NDR) sent to %d\n", from->u8[0]);
     }
     
   }
 
   // If response to an announce
-  else if (message[0] == 'N' && message[1] == 'D' && message[2] == 'R')
+  else if (type == MSG_NDR)
   {
-    size_t i;
-    int recipient = 0;
-
-    // Compute the recipient from the radio message 
-    for(i = 0 ; i < ID_SIZE ; i++)
-    {
-      recipient = recipient + ((message[i+3]-48) * power(10,ID_SIZE-i-1));
-    }
+    struct msg_ndr ndr;
 
     // If the message is for this node (avoid broadcast loop)
-    if(recipient == linkaddr_node_addr.u8[0])
+    if(msg_parse_ndr(&ndr) == 0 && ndr.recipient == linkaddr_node_addr.u8[0])
     {
-      printf("[SETUP THREAD] Parent response received from %d with signal %d\n", from->u8[0], packetbuf_attr(PACKETBUF_ATTR_RSSI));
+      // The signal is penalised by the load of the border, to spread the
+      // sensors across the borders
+      int signal = packetbuf_attr(PACKETBUF_ATTR_RSSI) - ndr.load / LOAD_PENALTY_DIVIDER;
+
+      LOG_DBG(SETUP, "[SETUP THREAD] Parent response received from %d with signal %d (load %d)\n", from->u8[0], packetbuf_attr(PACKETBUF_ATTR_RSSI), ndr.load);
 
       // Check if this parent is not better than the actual (based on the signal)
-      if (packetbuf_attr(PACKETBUF_ATTR_RSSI) > parent_signal)
+      if (signal > parent_signal)
       {
-        printf("[SETUP THREAD] This parent is better than %d\n", parent_signal);
-        parent_signal = packetbuf_attr(PACKETBUF_ATTR_RSSI);
-        linkaddr_copy(parent_node, from);
+        LOG_INFO(SETUP, "[SETUP THREAD] This parent is better than %d\n", parent_signal);
+        parent_signal = signal;
+        parent_load = ndr.load;
+        linkaddr_copy(&parent_node, from);
         not_connected = 0;
+        persist_dirty = 1;
       }
     }
     
@@ -161,31 +179,39 @@ recv_bdcst(struct broadcast_conn *c, const linkaddr_t *from)
   
 }
 
-static const struct broadcast_callbacks broadcast_call = {recv_bdcst};
+PROFILE_BROADCAST_RECV(PROFILE_RECV_BDCST, recv_bdcst)
+static const struct broadcast_callbacks broadcast_call = {PROFILED(recv_bdcst)};
 static struct broadcast_conn broadcast;
 
 /*---------------------------------------------------------------------------*/
 PROCESS_THREAD(network_setup, ev, data)
 {
   static struct etimer et;
-  char message[10];
   PROCESS_EXITHANDLER(broadcast_close(&broadcast);)
 
   PROCESS_BEGIN();
 
   broadcast_open(&broadcast, 129, &broadcast_call);
 
-  printf("[SENSOR] I'm %d\n", linkaddr_node_addr.u8[0]);
+  LOG_INFO(SETUP, "[SENSOR] I'm %d\n", linkaddr_node_addr.u8[0]);
+
+  // Warm restart : the parent of the last checkpoint is used at once
+  restore_state();
 
   while(1) {
 
     // If the node is not connected to the network, try to connect
     if (not_connected)
     {
-      sprintf(message, "NDA");
-      packetbuf_copyfrom(message, strlen(message));
+      msg_build_nda();
       broadcast_send(&broadcast);
-      printf("[SETUP THREAD] Announce (NDA) sent : %s\n", message);
+      LOG_DBG(SETUP, "[SETUP THREAD] Announce (NDA) sent\n");
+    }
+
+    // Save the parent if it changed (not too often, to spare the flash)
+    if (persist_due())
+    {
+      save_state();
     }
 
     /* Delay 2-4 seconds */
@@ -203,126 +229,198 @@ PROCESS_THREAD(network_setup, ev, data)
 static void
 recv_ruc(struct runicast_conn *c, const linkaddr_t *from, uint8_t seqno)
 {
-  char message[10];
-  strcpy(message, (char *)packetbuf_dataptr());
-  int original_sender = 0;
-  size_t i;
+  // The message is parsed in packetbuf, and forwarded without being copied
+  enum msg_type type = msg_type();
 
   // If SRV message, need to forward it to the parent_node
-  if (message[0] == 'S' && message[1] == 'R' && message[2] == 'V')
+  if (type == MSG_SRV)
   {
-    // Get the address of the original sender
-    for(i = 0 ; i < ID_SIZE ; i++) 
+    struct msg_srv srv;
+
+    if (msg_parse_srv(&srv) < 0)
     {
-      original_sender = original_sender + ((message[i+5]-48) * power(10,ID_SIZE-i-1));
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed SRV received from %d\n", from->u8[0]);
+      return;
     }
 
-    struct routes *new_route;
-
-    /* Check if we already know this routes. */
-    for(new_route = list_head(routes_list); new_route != NULL; new_route = list_item_next(new_route)) 
+    // Retransmission of a SRV already forwarded (lost ACK)
+    if (dedup_is_duplicate(MSG_SRV, srv.id, srv.id, srv.seqno))
     {
-
-      // We break out of the loop if the address in the list matches with from
-      if((int)new_route->id == (int)original_sender) 
-      {
-          break;
-      }
-
+      LOG_DBG(FWD, "[FORWARDING THREAD] Duplicate SRV %d of node %d dropped\n", srv.seqno, srv.id);
+      return;
     }
 
-    // If new_route is NULL, this node was not found in our list
-    if(new_route == NULL) 
+    // A new child, or a child out of its reporting slot
+    if (slots_received(from, srv.id))
     {
-      new_route = memb_alloc(&routes_memb);
-
-      // If allocation failed, we give up.
-      if(new_route == NULL) 
-      {
-        return;
-      }
+      process_poll(&forwarding_messages);
     }
-    new_route->age = 0;
-    if (!linkaddr_cmp(&new_route->addr_fwd, from)) // If routing has changed
+
+    // Record this node in the path of the SRV, the server uses it to route its COMs
+    if (msg_srv_append_hop(linkaddr_node_addr.u8[0]) < 0)
     {
-  
-      // Initialize the new_route.
-      linkaddr_copy(&new_route->addr_fwd, from);
-      new_route->id = original_sender;
-  
-      // Add the route into the list
-      printf("[ROUTING] New route\n");
-      list_add(routes_list, new_route);
+      LOG_WARN(FWD, "[FORWARDING THREAD] Path of the SRV of node %d is full\n", srv.id);
     }
 
-    if (from->u8[0] != parent_node->u8[0]) // fails safe, if a message is i a feedback loop
+    if (!linkaddr_cmp(from, &parent_node)) // fails safe, if a message is i a feedback loop
     {
-      // Forward the message to the parent
-      packetbuf_copyfrom(message, strlen(message));
-      runicast_send(c, parent_node, MAX_RETRANSMISSIONS);
+      // Forward the message to the parent (still in packetbuf)
+      links_forwarded(LINKS_SRV, &parent_node, retx_send(c, &parent_node));
 
-      printf("[FORWARDING THREAD] Forwarding from %d to %d (%s)\n", from->u8[0], parent_node->u8[0], message);
+      LOG_TRACE("srv_fwd", srv.id, srv.seqno);
+      LOG_DBG(FWD, "[FORWARDING THREAD] Forwarding from %d to %d (data %d of node %d)\n", from->u8[0], parent_node.u8[0], srv.air_quality, srv.id);
     }
 
   }
   // If order message, forward it or handle it
-  else if (message[0] == 'C' && message[1] == 'O' && message[2] == 'M')
+  else if (type == MSG_COM)
   {
-    int recipient = 0;    
-    int order = message[3] - '0';
-    
-    // Get the address of the original sender
-    for(i = 0 ; i < ID_SIZE ; i++)
+    struct msg_com com;
+
+    if (msg_parse_com(&com) < 0)
     {
-      recipient = recipient + ((message[i+4]-48) * power(10,ID_SIZE-i-1));
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed COM received from %d\n", from->u8[0]);
+      return;
+    }
+
+    // Retransmission of a COM already handled (lost ACK)
+    if (dedup_is_duplicate(MSG_COM, com.id, com.origin, com.seqno))
+    {
+      LOG_DBG(FWD, "[FORWARDING THREAD] Duplicate COM %d for node %d dropped\n", com.seqno, com.id);
+      return;
     }
 
     // If the message is for me
-    if(recipient == linkaddr_node_addr.u8[0])
+    if(com.id == linkaddr_node_addr.u8[0])
     {
-      printf("I was ordered by %d to follow order %d (%s)\n", from->u8[0], order, message);
-      // Execute the order
-      execute_order(order);
+      LOG_INFO(ORDER, "[ORDER] I was ordered by %d to follow order %d\n", from->u8[0], com.order);
+      // Execute the order, the next SRV tells the controller it was received
+      execute_order(com.order, com.trace);
+      order_origin = com.origin;
+      order_applied = com.seqno;
     }
     // If the message is not for me
     else
     {
-      struct routes *route;
+      linkaddr_t next_hop;
+
+      // Finally, forward the message (still in packetbuf) along its source route
+      msg_id_to_addr(&next_hop, msg_com_next_hop(&com));
+      links_forwarded(LINKS_COM, &next_hop, retx_send(c, &next_hop));
+      LOG_TRACE("com_fwd", com.id, com.trace);
+      
+      LOG_DBG(FWD, "[FORWARDING THREAD] [TO NODE] Order: %d received from %d for %d\n", com.order, from->u8[0], com.id);
+    }
+    
+  }
+  // If group order, execute it if this node is a target, the branches are
+  // sent by the forwarding thread
+  else if (type == MSG_GCM)
+  {
+    struct msg_gcm gcm;
+    int trace;
+
+    if (msg_parse_gcm(&gcm) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed GCM received from %d\n", from->u8[0]);
+      return;
+    }
+    if (dedup_is_duplicate(MSG_GCM, 0, ORIGIN_SERVER, gcm.seqno))
+    {
+      LOG_DBG(FWD, "[FORWARDING THREAD] Duplicate GCM %d dropped\n", gcm.seqno);
+      return;
+    }
+    if (group_receive(&gcm, &trace))
+    {
+      LOG_INFO(ORDER, "[ORDER] I was ordered by %d to follow the group order %d\n", from->u8[0], gcm.order);
+      execute_order(gcm.order, trace);
+    }
+    process_poll(&forwarding_messages);
+  }
+  // If reporting slot given by the parent, the next SRV is sent in it
+  else if (type == MSG_SLT)
+  {
+    int wait = msg_parse_slt();
 
-      // Print the current routes
-      for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+    if (wait >= 0 && linkaddr_cmp(from, &parent_node))
+    {
+      if (slots_follow(from, wait))
       {
-        // We break out of the loop if the address in the list matches with from
-        if((int)route->id == (int)recipient) 
-        {
-          break;
-        }
+        process_poll(&forwarding_messages);
       }
+      process_poll(&send_sensor_data);
+      LOG_DBG(DATA, "[DATA THREAD] Reporting slot in %d.%d s\n", wait / 10, wait % 10);
+    }
+  }
+  // If acknowledgement of a group order, aggregate it or forward it as it is
+  else if (type == MSG_GAK)
+  {
+    struct msg_gak gak;
 
-      // Finally, forward the message to the parent
-      packetbuf_copyfrom(message, strlen(message));
-      runicast_send(c, &route->addr_fwd, MAX_RETRANSMISSIONS);
-      
-      printf("[FORWARDING THREAD] [TO NODE] Order: %d received from %d for %d (%s)\n", order, from->u8[0], recipient, message);
+    if (msg_parse_gak(&gak) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed GAK received from %d\n", from->u8[0]);
+      return;
+    }
+    if (!group_receive_ack(&gak) && !linkaddr_cmp(from, &parent_node))
+    {
+      retx_send(c, &parent_node);
     }
-    
   }
-  else
+  // If summary of a computation node or link counters, forward it to the parent as it is
+  else if (type == MSG_SUM || type == MSG_LNK)
   {
-    // DEBUG PURPOSE
-    printf("[FORWARDING THREAD] Weird message received from %d.%d\n", from->u8[0], from->u8[1]);
+    if (!linkaddr_cmp(from, &parent_node))
+    {
+      retx_send(c, &parent_node);
+      LOG_DBG(FWD, "[FORWARDING THREAD] Report forwarded from %d to %d\n", from->u8[0], parent_node.u8[0]);
+    }
   }
+  // If hand-off of a child between the server and a computation node, only forward it
+  else if (type == MSG_HND)
+  {
+    struct msg_hnd hnd;
+    linkaddr_t next_hop;
 
-  /* ===== DEBUG ==== */
-  struct routes *route;
+    if (msg_parse_hnd(&hnd) < 0)
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] Malformed HND received from %d\n", from->u8[0]);
+      return;
+    }
 
-  // Print the current routes
-  for(route = list_head(routes_list); route != NULL; route = list_item_next(route)) 
+    if (hnd.kind == HND_STATE)
+    {
+      // To the computation node, along its source route
+      msg_id_to_addr(&next_hop, msg_hnd_next_hop(&hnd));
+      retx_send(c, &next_hop);
+    }
+    else if (!linkaddr_cmp(from, &parent_node))
+    {
+      // To the server, the path is recorded like for a SRV
+      msg_hnd_append_hop(linkaddr_node_addr.u8[0]);
+      retx_send(c, &parent_node);
+    }
+    LOG_DBG(FWD, "[FORWARDING THREAD] Hand-off %c of node %d (computation node %d) forwarded\n", hnd.kind, hnd.child, hnd.node);
+  }
+  // If role of a node of the single image (see sky_node.c), only forward it
+  else if (type == MSG_ROL)
   {
-    printf("[ROUTING] To contact %d, I have to send to %d\n", route->id, route->addr_fwd.u8[0]);
-    //list_remove(routes_list, route);
+    struct msg_rol rol;
+    linkaddr_t next_hop;
+
+    if (msg_parse_rol(&rol) < 0 || rol.id == linkaddr_node_addr.u8[0])
+    {
+      LOG_WARN(FWD, "[FORWARDING THREAD] ROL from %d ignored, this sensor has no computation role\n", from->u8[0]);
+      return;
+    }
+    msg_id_to_addr(&next_hop, msg_rol_next_hop(&rol));
+    retx_send(c, &next_hop);
+  }
+  else
+  {
+    // DEBUG PURPOSE
+    LOG_WARN(FWD, "[FORWARDING THREAD] Weird message received from %d.%d\n", from->u8[0], from->u8[1]);
   }
-  /* ================ */
 
 }
 
@@ -331,19 +429,32 @@ sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmiss
 {
   //printf("runicast message sent to %d.%d, retransmissions %d\n",
   // to->u8[0], to->u8[1], retransmissions);
+  links_done(to, retransmissions, 0);
+  retx_done(to, retransmissions, 0);
 }
 static void
 timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
 {
+  links_done(to, retransmissions, 1);
+
+  // A single timeout only puts the link in backoff (see node_retx.h)
+  if (!retx_done(to, retransmissions, 1))
+  {
+    LOG_DBG(FWD, "[FORWARDING THREAD] No ACK from %d, backing off\n", to->u8[0]);
+    return;
+  }
+
   // If connecion timeout, re-run the network setup to find a new parent
-  printf("[FORWARDING THREAD] Impossible to send data, disconnected from network.");
+  LOG_WARN(FWD, "[FORWARDING THREAD] Impossible to send data, disconnected from network.\n");
   not_connected = 1;
   parent_signal = -9999;
+  persist_dirty = 1;
 }
 
 /*---------------------------------------------------------------------------*/
 
-static const struct runicast_callbacks runicast_callbacks = {recv_ruc, sent_runicast, timedout_runicast};
+PROFILE_RUNICAST_RECV(PROFILE_RECV_RUC, recv_ruc)
+static const struct runicast_callbacks runicast_callbacks = {PROFILED(recv_ruc), sent_runicast, timedout_runicast};
 static struct runicast_conn runicast;
 
 /*---------------------------------------------------------------------------*/
@@ -351,7 +462,6 @@ static struct runicast_conn runicast;
 // Sending data thread
 PROCESS_THREAD(send_sensor_data, ev, data)
 {
-  char message[10];
   int air_quality;
   static struct etimer before_start;
 
@@ -365,35 +475,47 @@ PROCESS_THREAD(send_sensor_data, ev, data)
 
   runicast_open(&runicast, 144, &runicast_callbacks);
 
+  // Random first sequence number, so a rebooted node is not seen as duplicate
+  srv_seqno = random_rand() % SEQNO_MAX;
+
   /* Wait random seconds to simulate the different time
   of the node installation (0-59min) */
-  printf("[DATA THREAD] Waiting before start ...\n");
+  LOG_INFO(DATA, "[DATA THREAD] Waiting before start ...\n");
   etimer_set(&before_start, random_rand()%60 * CLOCK_SECOND);
   PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&before_start));
-  printf("[DATA THREAD] Starting ...\n");
+  LOG_INFO(DATA, "[DATA THREAD] Starting ...\n");
 
   while(1) {
     static struct etimer et;
-    
+
+    // Start of a period : the slots of the children follow it
+    slots_own_report();
+
     // Send the data to the parent
-    if(!not_connected && !runicast_is_transmitting(&runicast)) {
+    // (the parent is not in backoff after a timeout)
+    if(!not_connected && !runicast_is_transmitting(&runicast) && retx_ready(&parent_node)) {
 
       // Generate random sensor data
       air_quality = random_rand() % 99 + 1;
       
-      sprintf(message, "SRV%02d%0"STR(ID_SIZE)"d", air_quality, linkaddr_node_addr.u8[0]);
-      packetbuf_copyfrom(message, strlen(message));
+      msg_build_srv(air_quality, linkaddr_node_addr.u8[0], srv_seqno, valve_open, order_origin, order_applied);
+      retx_send(&runicast, &parent_node);
+      LOG_TRACE("sample", linkaddr_node_addr.u8[0], srv_seqno);
 
-      runicast_send(&runicast, parent_node, MAX_RETRANSMISSIONS);
+      srv_seqno = (srv_seqno + 1) % SEQNO_MAX;
 
-      printf("[DATA THREAD] Sending data (%d) to the server\n", air_quality);
+      LOG_INFO(DATA, "[DATA THREAD] Sending data (%d) to the server\n", air_quality);
     }
-    // Check if there are some old routes to delete
-    remove_old_routes();
-
-    /* Delay 1 minute */
-    etimer_set(&et, 60*CLOCK_SECOND);
-    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    /* Delay 1 minute, or until the reporting slot given by the parent */
+    etimer_set(&et, SLOTS_PERIOD);
+    do
+    {
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || ev == PROCESS_EVENT_POLL);
+      if (ev == PROCESS_EVENT_POLL)
+      {
+        etimer_set(&et, slots_wait());
+      }
+    } while(!etimer_expired(&et));
 
   }
 
@@ -413,11 +535,72 @@ PROCESS_THREAD(forwarding_messages, ev, data)
 
 
   while(1) {
+    static struct etimer et;
+
+    // The SRV / COM are forwarded by recv_ruc, this thread only sends the
+    // branches of the group orders and their acknowledgements, and the link
+    // counters (the runicast must not be busy)
+    etimer_set(&et, LINKS_CHECK_PERIOD);
+    PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et) || ev == PROCESS_EVENT_POLL);
+    while(group_step(&runicast, &parent_node))
+    {
+      etimer_set(&et, GROUP_STEP_PERIOD);
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    }
+    // Reporting slots of the new children, or of the ones out of their slot
+    while(slots_step(&runicast))
+    {
+      etimer_set(&et, SLOTS_STEP_PERIOD);
+      PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+    }
 
-    // Wait for SRV / CMD to forward
-    PROCESS_WAIT_EVENT();
+    if (!not_connected)
+    {
+      links_report(&runicast, &parent_node);
+    }
   
   }
 
   PROCESS_END();
 }
+
+/*---------------------------------------------------------------------------*/
+
+// Serial commands thread (route dump, statistics)
+PROCESS_THREAD(serial_commands, ev, data)
+{
+  static clock_time_t last_dump = 0;
+
+  PROCESS_BEGIN();
+
+  while(1) {
+
+    PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
+
+    if(strcmp((char *)data, ROUTE_DUMP_COMMAND) == 0)
+    {
+      if(route_dump_allowed(&last_dump))
+      {
+        dump_routes();
+      }
+      else
+      {
+        LOG_WARN(ROUTING, "[ROUTING] Route dump rate-limited\n");
+      }
+    }
+    else if(strcmp((char *)data, STATS_COMMAND) == 0)
+    {
+      printf("[STATS] Duplicates suppressed : %u SRV, %u COM\n", dedup_suppressed_srv, dedup_suppressed_com);
+      printf("[STATS] Group orders dropped (queue full) : %u\n", group_dropped);
+      retx_dump();
+      slots_dump();
+      links_dump();
+    }
+    else if(PROFILE_ENABLED && strcmp((char *)data, PROFILE_COMMAND) == 0)
+    {
+      profile_dump();
+    }
+  }
+
+  PROCESS_END();
+}